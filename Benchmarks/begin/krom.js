@@ -0,0 +1,55 @@
+"use strict";
+
+// Measures the cost of Krom.begin with a multiple render target array. Every
+// call reads renderTarget_ and length from JS objects, which is where the
+// property id lookups are spent. begin(null) does no lookups and is used as
+// the baseline, run the same file with an older build to compare.
+
+const width = 256;
+const height = 256;
+const calls = 10000;
+const frames = 60;
+const warmupFrames = 10;
+
+Krom.init("begin benchmark", width, height, 1, false, 0, 0);
+
+function createImage() {
+	return { renderTarget_: Krom.createRenderTarget(width, height, 0, 0, 0) };
+}
+
+const target = createImage();
+const additional = [createImage(), createImage(), createImage()];
+
+let frame = 0;
+let nullTime = 0;
+let mrtTime = 0;
+
+function measure(image, images) {
+	const start = Krom.getTime();
+	for (let i = 0; i < calls; ++i) {
+		Krom.begin(image, images);
+	}
+	return Krom.getTime() - start;
+}
+
+Krom.setCallback(function () {
+	const nullElapsed = measure(null, null);
+	const mrtElapsed = measure(target, additional);
+	Krom.begin(null, null);
+	Krom.end();
+
+	++frame;
+	if (frame <= warmupFrames) return;
+	nullTime += nullElapsed;
+	mrtTime += mrtElapsed;
+
+	if (frame === warmupFrames + frames) {
+		const count = calls * frames;
+		const nullCall = nullTime / count * 1000000;
+		const mrtCall = mrtTime / count * 1000000;
+		Krom.log("begin(null): " + nullCall.toFixed(3) + " us per call");
+		Krom.log("begin(target, [3 targets]): " + mrtCall.toFixed(3) + " us per call");
+		Krom.log("lookup and unboxing: " + (mrtCall - nullCall).toFixed(3) + " us per call");
+		Krom.requestShutdown();
+	}
+});
@@ -0,0 +1,144 @@
+"use strict";
+
+// Compares draws per millisecond of the per call bindings against one
+// Krom.submitCommands call per frame. Both paths issue the same draws, frames
+// alternate between them. The shaders are GLSL sources, so this needs an
+// OpenGL build.
+
+const width = 640;
+const height = 480;
+const draws = 2000;
+const frames = 120;
+const warmupFrames = 20;
+
+Krom.init("commands benchmark", width, height, 1, false, 0, 0);
+
+const vertexShader = Krom.createVertexShaderFromSource(
+	"#version 330\n" +
+	"in vec2 pos;\n" +
+	"uniform vec4 offset;\n" +
+	"void main() { gl_Position = vec4(pos * offset.z + offset.xy, 0.0, 1.0); }\n");
+const fragmentShader = Krom.createFragmentShaderFromSource(
+	"#version 330\n" +
+	"uniform vec4 offset;\n" +
+	"out vec4 color;\n" +
+	"void main() { color = vec4(offset.w, 0.5, 1.0 - offset.w, 1.0); }\n");
+
+const structure = { instanced: false, elements: [{ name: "pos", data: 1 }] };
+const allTrue = [true, true, true, true, true, true, true, true];
+const state = {
+	cullMode: 2,
+	depthWrite: false,
+	depthMode: 0,
+	stencilMode: 0,
+	stencilBothPass: 0,
+	stencilDepthFail: 0,
+	stencilFail: 0,
+	stencilReferenceValue: 0,
+	stencilReadMask: 0xff,
+	stencilWriteMask: 0xff,
+	blendSource: 0,
+	blendDestination: 1,
+	alphaBlendSource: 0,
+	alphaBlendDestination: 1,
+	colorWriteMaskRed: allTrue,
+	colorWriteMaskGreen: allTrue,
+	colorWriteMaskBlue: allTrue,
+	colorWriteMaskAlpha: allTrue,
+	conservativeRasterization: false
+};
+
+const pipeline = Krom.createPipeline();
+Krom.compilePipeline(pipeline, structure, null, null, null, 1, vertexShader, fragmentShader, null, null, null, state);
+const offset = Krom.getConstantLocation(pipeline, "offset");
+
+const vertexBuffer = Krom.createVertexBuffer(3, structure.elements, 0, 0);
+const vertices = Krom.lockVertexBuffer(vertexBuffer);
+vertices.set([-1, -1, 1, -1, 0, 1]);
+Krom.unlockVertexBuffer(vertexBuffer);
+
+const indexBuffer = Krom.createIndexBuffer(3);
+const indices = Krom.lockIndexBuffer(indexBuffer);
+indices.set([0, 1, 2]);
+Krom.unlockIndexBuffer(indexBuffer);
+
+const offsets = new Float32Array(draws * 4);
+for (let i = 0; i < draws; ++i) {
+	offsets[i * 4 + 0] = (i % 50) / 25 - 1;
+	offsets[i * 4 + 1] = Math.floor(i / 50) / 20 - 1;
+	offsets[i * 4 + 2] = 0.02;
+	offsets[i * 4 + 3] = i / draws;
+}
+
+// Opcodes from Sources/main.cpp
+const CommandSetPipeline = 1;
+const CommandSetVertexBuffer = 2;
+const CommandSetIndexBuffer = 4;
+const CommandSetFloat4 = 14;
+const CommandDrawIndexedVertices = 18;
+
+const handles = [pipeline, vertexBuffer, indexBuffer, offset];
+const commands = new ArrayBuffer((6 + draws * 9) * 4);
+const words = new Int32Array(commands);
+const floats = new Float32Array(commands);
+let commandLength = 0;
+
+function buildCommands() {
+	let pc = 0;
+	words[pc++] = CommandSetPipeline; words[pc++] = 0;
+	words[pc++] = CommandSetVertexBuffer; words[pc++] = 1;
+	words[pc++] = CommandSetIndexBuffer; words[pc++] = 2;
+	for (let i = 0; i < draws; ++i) {
+		words[pc++] = CommandSetFloat4; words[pc++] = 3;
+		floats[pc++] = offsets[i * 4 + 0];
+		floats[pc++] = offsets[i * 4 + 1];
+		floats[pc++] = offsets[i * 4 + 2];
+		floats[pc++] = offsets[i * 4 + 3];
+		words[pc++] = CommandDrawIndexedVertices; words[pc++] = 0; words[pc++] = 3;
+	}
+	return pc;
+}
+
+function drawCalls() {
+	Krom.setPipeline(pipeline);
+	Krom.setVertexBuffer(vertexBuffer);
+	Krom.setIndexBuffer(indexBuffer);
+	for (let i = 0; i < draws; ++i) {
+		Krom.setFloat4(offset, offsets[i * 4 + 0], offsets[i * 4 + 1], offsets[i * 4 + 2], offsets[i * 4 + 3]);
+		Krom.drawIndexedVertices(0, 3);
+	}
+}
+
+function drawCommands() {
+	// Filling the buffer is part of the cost, apps rebuild it every frame
+	commandLength = buildCommands();
+	Krom.submitCommands(commands, commandLength, handles);
+}
+
+let frame = 0;
+let callTime = 0;
+let commandTime = 0;
+
+Krom.setCallback(function () {
+	Krom.begin(null, null);
+	Krom.clear(1, 0xff000000, 1, 0);
+
+	const useCommands = (frame & 1) === 1;
+	const start = Krom.getTime();
+	if (useCommands) drawCommands();
+	else drawCalls();
+	const elapsed = Krom.getTime() - start;
+	Krom.end();
+
+	++frame;
+	if (frame <= warmupFrames) return;
+	if (useCommands) commandTime += elapsed;
+	else callTime += elapsed;
+
+	if (frame === warmupFrames + frames) {
+		const count = draws * frames / 2;
+		Krom.log("per call bindings: " + (count / (callTime * 1000)).toFixed(1) + " draws per ms");
+		Krom.log("submitCommands: " + (count / (commandTime * 1000)).toFixed(1) + " draws per ms");
+		Krom.requestShutdown();
+	}
+});
@@ -0,0 +1,86 @@
+"use strict";
+
+// Compares ops per second of the key value store (kvPut/kvGet) against
+// writeStorage/readStorage with small records. writeStorage writes on a
+// background thread, so its writes are timed until the last callback arrives,
+// and kv writes are timed including the kvFlush that makes them durable.
+// Queued writes to the same file are merged, which is part of the measured
+// writeStorage behavior.
+// Leaves benchmark_* files in the save path.
+
+const records = 2000;
+const keys = 64;
+const recordSize = 64;
+
+Krom.init("storage benchmark", 64, 64, 1, false, 0, 0);
+
+const record = new ArrayBuffer(recordSize);
+const bytes = new Uint8Array(record);
+for (let i = 0; i < recordSize; ++i) bytes[i] = i;
+
+function key(i) {
+	return "benchmark_" + (i % keys);
+}
+
+function log(name, ops, seconds) {
+	Krom.log(name + ": " + Math.round(ops / seconds) + " ops per second");
+}
+
+function benchmarkKv() {
+	let start = Krom.getTime();
+	for (let i = 0; i < records; ++i) {
+		bytes[0] = i & 0xff;
+		Krom.kvPut(key(i), record);
+	}
+	Krom.kvFlush();
+	log("kvPut", records, Krom.getTime() - start);
+
+	start = Krom.getTime();
+	for (let i = 0; i < records; ++i) {
+		Krom.kvGet(key(i));
+	}
+	log("kvGet", records, Krom.getTime() - start);
+
+	for (let i = 0; i < keys; ++i) {
+		Krom.kvDelete(key(i));
+	}
+	Krom.kvFlush();
+}
+
+let written = 0;
+let writeStart = 0;
+
+function benchmarkStorageReads() {
+	const start = Krom.getTime();
+	for (let i = 0; i < records; ++i) {
+		Krom.readStorage(key(i));
+	}
+	log("readStorage", records, Krom.getTime() - start);
+}
+
+function storageWritten() {
+	++written;
+	if (written === records) {
+		log("writeStorage", records, Krom.getTime() - writeStart);
+		benchmarkStorageReads();
+		Krom.requestShutdown();
+	}
+}
+
+function benchmarkStorage() {
+	writeStart = Krom.getTime();
+	for (let i = 0; i < records; ++i) {
+		bytes[0] = i & 0xff;
+		Krom.writeStorage(key(i), record, storageWritten);
+	}
+}
+
+let frame = 0;
+
+Krom.setCallback(function () {
+	++frame;
+	if (frame === 10) {
+		benchmarkKv();
+		benchmarkStorage();
+	}
+});
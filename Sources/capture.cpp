@@ -0,0 +1,519 @@
+#include "pch.h"
+#include "capture.h"
+#include "hash.h"
+#include "semaphore.h"
+
+#include <Kore/Log.h>
+#include <Kore/Threads/Mutex.h>
+#include <Kore/Threads/Thread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef KORE_WINDOWS
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace {
+	struct Frame;
+
+	struct Capture {
+		std::string path;
+		bool video;
+		FILE* file;
+		int fps;
+		int width;
+		int height;
+		int submitted;
+		int pending;
+		bool stopped;
+		// Set by any encoder, the first one reports the failure
+		std::atomic<bool> failed;
+		// Only touched by encoders holding videoMutex
+		int written;
+		std::map<int, Frame*> ready;
+	};
+
+	struct Frame {
+		Capture* capture;
+		int index;
+		uint8_t* pixels;
+		size_t capacity;
+		int width;
+		int height;
+		int stride;
+		bool flipped;
+		std::vector<uint8_t> encoded;
+	};
+
+	const int maxFrames = 4;
+	const int encoderThreads = 2;
+
+	Kore::Mutex mutex;
+	Kore::Mutex videoMutex;
+	Semaphore* semaphore = nullptr;
+	Frame frames[maxFrames];
+	std::vector<Frame*> freeFrames;
+	std::deque<Frame*> queued;
+	int dropped = 0;
+
+	// Only touched by the main thread
+	Capture* capture = nullptr;
+	Frame* acquired = nullptr;
+
+	const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+	struct BitWriter {
+		std::vector<uint8_t>& out;
+		uint32_t bits;
+		int count;
+
+		BitWriter(std::vector<uint8_t>& out) : out(out), bits(0), count(0) {}
+
+		void put(uint32_t value, int length) {
+			bits |= value << count;
+			count += length;
+			while (count >= 8) {
+				out.push_back(bits & 0xff);
+				bits >>= 8;
+				count -= 8;
+			}
+		}
+
+		// Huffman codes are stored starting with their most significant bit
+		void putCode(uint32_t code, int length) {
+			uint32_t reversed = 0;
+			for (int i = 0; i < length; ++i) {
+				reversed = (reversed << 1) | (code & 1);
+				code >>= 1;
+			}
+			put(reversed, length);
+		}
+
+		void finish() {
+			if (count > 0) out.push_back(bits & 0xff);
+			bits = 0;
+			count = 0;
+		}
+	};
+
+	void putLiteral(BitWriter& writer, int value) {
+		if (value < 144) writer.putCode(0x30 + value, 8);
+		else if (value < 256) writer.putCode(0x190 + value - 144, 9);
+		else if (value < 280) writer.putCode(value - 256, 7);
+		else writer.putCode(0xc0 + value - 280, 8);
+	}
+
+	void putMatch(BitWriter& writer, int length, int distance) {
+		int code = 0;
+		while (code < 28 && lengthBase[code + 1] <= length) ++code;
+		putLiteral(writer, 257 + code);
+		writer.put(length - lengthBase[code], lengthExtra[code]);
+		code = 0;
+		while (code < 29 && distanceBase[code + 1] <= distance) ++code;
+		writer.putCode(code, 5);
+		writer.put(distance - distanceBase[code], distanceExtra[code]);
+	}
+
+	uint32_t hash3(const uint8_t* data) {
+		return ((data[0] << 16 | data[1] << 8 | data[2]) * 2654435761u) >> 17;
+	}
+
+	uint32_t adler32(const uint8_t* data, size_t size) {
+		uint32_t a = 1, b = 0;
+		while (size > 0) {
+			size_t block = size < 5552 ? size : 5552;
+			for (size_t i = 0; i < block; ++i) {
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += block;
+			size -= block;
+		}
+		return b << 16 | a;
+	}
+
+	void putBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+		out.push_back(value >> 24);
+		out.push_back((value >> 16) & 0xff);
+		out.push_back((value >> 8) & 0xff);
+		out.push_back(value & 0xff);
+	}
+
+	// zlib stream with a single fixed Huffman block and greedy matching
+	// against the last position of each hash. Much faster than a real
+	// compressor and good enough for the flat areas of rendered frames.
+	void deflate(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+		const int window = 32768;
+		const int maxMatch = 258;
+		std::vector<int> head(1 << 15, -1);
+		out.push_back(0x78);
+		out.push_back(0x01);
+		BitWriter writer(out);
+		writer.put(1, 1);
+		writer.put(1, 2);
+		int i = 0;
+		int end = (int)size;
+		while (i + 3 <= end) {
+			uint32_t hash = hash3(&data[i]);
+			int candidate = head[hash];
+			head[hash] = i;
+			if (candidate >= 0 && i - candidate <= window && memcmp(&data[candidate], &data[i], 3) == 0) {
+				int max = end - i < maxMatch ? end - i : maxMatch;
+				int length = 3;
+				while (length < max && data[candidate + length] == data[i + length]) ++length;
+				putMatch(writer, length, i - candidate);
+				for (int j = i + 1; j < i + length && j + 3 <= end; ++j) head[hash3(&data[j])] = j;
+				i += length;
+			}
+			else {
+				putLiteral(writer, data[i]);
+				++i;
+			}
+		}
+		while (i < end) putLiteral(writer, data[i++]);
+		putLiteral(writer, 256);
+		writer.finish();
+		putBigEndian(out, adler32(data, size));
+	}
+
+	const uint8_t* sourceRow(const Frame& frame, int y) {
+		int row = frame.flipped ? frame.height - 1 - y : y;
+		return &frame.pixels[(size_t)row * frame.stride * 4];
+	}
+
+	void putChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+		putBigEndian(out, (uint32_t)size);
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data, data + size);
+		putBigEndian(out, crc32(&out[start], size + 4));
+	}
+
+	// RGB without alpha, every row uses the Up filter
+	void encodePng(Frame& frame) {
+		int rowSize = frame.width * 3 + 1;
+		std::vector<uint8_t> filtered((size_t)rowSize * frame.height);
+		for (int y = 0; y < frame.height; ++y) {
+			const uint8_t* row = sourceRow(frame, y);
+			const uint8_t* above = y > 0 ? sourceRow(frame, y - 1) : nullptr;
+			uint8_t* to = &filtered[(size_t)y * rowSize];
+			*to++ = 2;
+			for (int x = 0; x < frame.width; ++x) {
+				for (int c = 0; c < 3; ++c) {
+					*to++ = row[x * 4 + c] - (above != nullptr ? above[x * 4 + c] : 0);
+				}
+			}
+		}
+
+		std::vector<uint8_t>& out = frame.encoded;
+		out.clear();
+		const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+		out.insert(out.end(), signature, signature + 8);
+		uint8_t header[13] = {0};
+		header[0] = frame.width >> 24;
+		header[1] = (frame.width >> 16) & 0xff;
+		header[2] = (frame.width >> 8) & 0xff;
+		header[3] = frame.width & 0xff;
+		header[4] = frame.height >> 24;
+		header[5] = (frame.height >> 16) & 0xff;
+		header[6] = (frame.height >> 8) & 0xff;
+		header[7] = frame.height & 0xff;
+		header[8] = 8;
+		header[9] = 2;
+		putChunk(out, "IHDR", header, sizeof(header));
+
+		size_t start = out.size();
+		putBigEndian(out, 0);
+		out.insert(out.end(), "IDAT", "IDAT" + 4);
+		deflate(filtered.data(), filtered.size(), out);
+		uint32_t length = (uint32_t)(out.size() - start - 8);
+		out[start + 0] = length >> 24;
+		out[start + 1] = (length >> 16) & 0xff;
+		out[start + 2] = (length >> 8) & 0xff;
+		out[start + 3] = length & 0xff;
+		putBigEndian(out, crc32(&out[start + 4], length + 4));
+
+		putChunk(out, "IEND", nullptr, 0);
+	}
+
+	uint8_t clampByte(int value) {
+		return value < 0 ? 0 : (value > 255 ? 255 : value);
+	}
+
+	// Full range BT.601, chroma is averaged over 2x2 pixels
+	void encodeY4m(Frame& frame) {
+		int width = frame.width;
+		int height = frame.height;
+		int chromaWidth = (width + 1) / 2;
+		int chromaHeight = (height + 1) / 2;
+		const char tag[] = "FRAME\n";
+		std::vector<uint8_t>& out = frame.encoded;
+		out.resize(6 + (size_t)width * height + (size_t)chromaWidth * chromaHeight * 2);
+		memcpy(out.data(), tag, 6);
+		uint8_t* luma = &out[6];
+		uint8_t* blue = luma + (size_t)width * height;
+		uint8_t* red = blue + (size_t)chromaWidth * chromaHeight;
+
+		for (int y = 0; y < height; ++y) {
+			const uint8_t* row = sourceRow(frame, y);
+			for (int x = 0; x < width; ++x) {
+				const uint8_t* pixel = &row[x * 4];
+				luma[(size_t)y * width + x] = (77 * pixel[0] + 150 * pixel[1] + 29 * pixel[2] + 128) >> 8;
+			}
+		}
+
+		for (int y = 0; y < chromaHeight; ++y) {
+			const uint8_t* row0 = sourceRow(frame, y * 2);
+			const uint8_t* row1 = sourceRow(frame, y * 2 + 1 < height ? y * 2 + 1 : y * 2);
+			for (int x = 0; x < chromaWidth; ++x) {
+				int x0 = x * 8;
+				int x1 = x * 2 + 1 < width ? x0 + 4 : x0;
+				int r = (row0[x0 + 0] + row0[x1 + 0] + row1[x0 + 0] + row1[x1 + 0] + 2) >> 2;
+				int g = (row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1] + 2) >> 2;
+				int b = (row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2] + 2) >> 2;
+				blue[(size_t)y * chromaWidth + x] = clampByte((-43 * r - 85 * g + 128 * b + 32768 + 128) >> 8);
+				red[(size_t)y * chromaWidth + x] = clampByte((128 * r - 107 * g - 21 * b + 32768 + 128) >> 8);
+			}
+		}
+	}
+
+	void closeCapture(Capture* capture) {
+		if (capture->file != nullptr) fclose(capture->file);
+		delete capture;
+	}
+
+	void releaseFrame(Frame* frame) {
+		mutex.lock();
+		Capture* capture = frame->capture;
+		frame->capture = nullptr;
+		freeFrames.push_back(frame);
+		--capture->pending;
+		bool close = capture->stopped && capture->pending == 0;
+		mutex.unlock();
+		if (close) closeCapture(capture);
+	}
+
+	void reportFailure(Capture* capture, const char* path) {
+		if (capture->failed.exchange(true)) return;
+		Kore::log(Kore::Warning, "Could not write captured frames to %s", path);
+	}
+
+	// Encoders finish in any order, video frames are appended by whichever
+	// encoder completes the next frame in line.
+	void writeVideoFrame(Frame* frame) {
+		Capture* capture = frame->capture;
+		std::vector<Frame*> written;
+		videoMutex.lock();
+		capture->ready[frame->index] = frame;
+		for (;;) {
+			std::map<int, Frame*>::iterator it = capture->ready.find(capture->written);
+			if (it == capture->ready.end()) break;
+			Frame* next = it->second;
+			capture->ready.erase(it);
+			bool success = true;
+			if (capture->written == 0) {
+				success = fprintf(capture->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", capture->width, capture->height, capture->fps) > 0;
+			}
+			success = success && fwrite(next->encoded.data(), 1, next->encoded.size(), capture->file) == next->encoded.size();
+			if (!success) reportFailure(capture, capture->path.c_str());
+			++capture->written;
+			written.push_back(next);
+		}
+		videoMutex.unlock();
+		for (size_t i = 0; i < written.size(); ++i) {
+			releaseFrame(written[i]);
+		}
+	}
+
+	void writeImage(Frame* frame) {
+		Capture* capture = frame->capture;
+		char name[32];
+		snprintf(name, sizeof(name), "/frame%06d.png", frame->index);
+		std::string path = capture->path + name;
+		FILE* file = fopen(path.c_str(), "wb");
+		bool success = file != nullptr && fwrite(frame->encoded.data(), 1, frame->encoded.size(), file) == frame->encoded.size();
+		if (file != nullptr) success = fclose(file) == 0 && success;
+		if (!success) reportFailure(capture, capture->path.c_str());
+		releaseFrame(frame);
+	}
+
+	void runEncoder(void*) {
+		for (;;) {
+			semaphore->wait();
+			mutex.lock();
+			Frame* frame = queued.front();
+			queued.pop_front();
+			mutex.unlock();
+			if (frame->capture->video) {
+				encodeY4m(*frame);
+				writeVideoFrame(frame);
+			}
+			else {
+				encodePng(*frame);
+				writeImage(frame);
+			}
+		}
+	}
+
+	void startEncoders() {
+		mutex.create();
+		videoMutex.create();
+		semaphore = new Semaphore(0);
+		for (int i = 0; i < maxFrames; ++i) {
+			frames[i].pixels = nullptr;
+			frames[i].capacity = 0;
+			freeFrames.push_back(&frames[i]);
+		}
+		for (int i = 0; i < encoderThreads; ++i) {
+			Kore::createAndRunThread(runEncoder, nullptr);
+		}
+	}
+
+	bool endsWith(const std::string& string, const char* suffix) {
+		size_t length = strlen(suffix);
+		return string.size() >= length && string.compare(string.size() - length, length, suffix) == 0;
+	}
+
+	bool createDirectory(const char* path) {
+#ifdef KORE_WINDOWS
+		return CreateDirectoryA(path, nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+		struct stat info;
+		return mkdir(path, 0755) == 0 || (stat(path, &info) == 0 && S_ISDIR(info.st_mode));
+#endif
+	}
+}
+
+bool captureStart(const char* path, int fps) {
+	if (semaphore == nullptr) startEncoders();
+	captureStop();
+	Capture* started = new Capture;
+	started->path = path;
+	started->video = endsWith(started->path, ".y4m");
+	started->file = nullptr;
+	started->fps = fps > 0 ? fps : 60;
+	started->width = 0;
+	started->height = 0;
+	started->submitted = 0;
+	started->pending = 0;
+	started->stopped = false;
+	started->failed = false;
+	started->written = 0;
+	if (started->video) started->file = fopen(path, "wb");
+	if (started->video ? started->file == nullptr : !createDirectory(path)) {
+		Kore::log(Kore::Warning, "Could not start capturing to %s", path);
+		delete started;
+		return false;
+	}
+	mutex.lock();
+	dropped = 0;
+	mutex.unlock();
+	capture = started;
+	return true;
+}
+
+void captureStop() {
+	if (capture == nullptr) return;
+	mutex.lock();
+	capture->stopped = true;
+	bool close = capture->pending == 0;
+	mutex.unlock();
+	if (close) closeCapture(capture);
+	capture = nullptr;
+}
+
+bool captureActive() {
+	return capture != nullptr;
+}
+
+uint8_t* captureAcquire(size_t size) {
+	if (capture == nullptr) return nullptr;
+	mutex.lock();
+	Frame* frame = nullptr;
+	if (!freeFrames.empty()) {
+		frame = freeFrames.back();
+		freeFrames.pop_back();
+	}
+	else {
+		++dropped;
+	}
+	mutex.unlock();
+	if (frame == nullptr) return nullptr;
+	if (frame->capacity < size) {
+		free(frame->pixels);
+		frame->pixels = (uint8_t*)malloc(size);
+		frame->capacity = frame->pixels != nullptr ? size : 0;
+		if (frame->pixels == nullptr) {
+			mutex.lock();
+			freeFrames.push_back(frame);
+			++dropped;
+			mutex.unlock();
+			return nullptr;
+		}
+	}
+	acquired = frame;
+	return frame->pixels;
+}
+
+void captureSubmit(int width, int height, int stride, bool flipped) {
+	Frame* frame = acquired;
+	acquired = nullptr;
+	if (frame == nullptr) return;
+	// A video keeps the size of its first frame
+	if (capture == nullptr || (capture->video && capture->submitted > 0 && (width != capture->width || height != capture->height))) {
+		mutex.lock();
+		freeFrames.push_back(frame);
+		++dropped;
+		mutex.unlock();
+		return;
+	}
+	if (capture->submitted == 0) {
+		capture->width = width;
+		capture->height = height;
+	}
+	frame->capture = capture;
+	frame->index = capture->submitted++;
+	frame->width = width;
+	frame->height = height;
+	frame->stride = stride;
+	frame->flipped = flipped;
+	mutex.lock();
+	++capture->pending;
+	queued.push_back(frame);
+	mutex.unlock();
+	semaphore->signal();
+}
+
+int captureDropped() {
+	if (semaphore == nullptr) return 0;
+	mutex.lock();
+	int count = dropped;
+	mutex.unlock();
+	return count;
+}
+
+void captureFlush() {
+	if (semaphore == nullptr) return;
+	for (;;) {
+		mutex.lock();
+		bool done = (int)freeFrames.size() + (acquired != nullptr ? 1 : 0) == maxFrames;
+		mutex.unlock();
+		if (done) return;
+		Kore::threadSleep(1);
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes captured frames to disk on background threads. Frames go through a
+// small fixed set of buffers, when all of them are in use new frames are
+// dropped instead of waiting for the encoders. Reading the pixels of a frame
+// is not part of this, the caller's getPixels waits for the GPU to finish
+// all queued work, so capturing costs a full GPU sync every frame.
+
+// Paths ending in .y4m are written as a single 4:2:0 Y4M video, any other
+// path is a directory that receives numbered PNG files.
+bool captureStart(const char* path, int fps);
+
+// Frames that are already queued are still written.
+void captureStop();
+
+bool captureActive();
+
+// Returns a buffer for size bytes of RGBA pixels, or nullptr when the frame
+// has to be dropped. A returned buffer has to be passed to captureSubmit.
+uint8_t* captureAcquire(size_t size);
+
+// stride is the row length of the buffer in pixels. Flipped frames are
+// stored bottom row first.
+void captureSubmit(int width, int height, int stride, bool flipped);
+
+// Frames dropped since the last captureStart.
+int captureDropped();
+
+// Blocks until all queued frames are written.
+void captureFlush();
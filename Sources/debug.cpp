@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "debug.h"
 #include "debug_server.h"
+#include "ids.h"
 
 #include <ChakraCore.h>
 #include <ChakraDebug.h>
@@ -56,7 +57,7 @@ int scriptId() {
 		JsValueRef scripts;
 		JsDiagGetScripts(&scripts);
 		JsValueRef lengthObj;
-		JsGetProperty(scripts, getId("length"), &lengthObj);
+		JsGetProperty(scripts, ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 		for (int i = 0; i < length; ++i) {
@@ -65,10 +66,10 @@ int scriptId() {
 			JsIntToNumber(i, &iObj);
 			JsValueRef obj;
 			JsGetIndexedProperty(scripts, iObj, &obj);
-			JsGetProperty(obj, getId("scriptId"), &scriptId);
-			JsGetProperty(obj, getId("fileName"), &fileName);
-			JsGetProperty(obj, getId("lineCount"), &lineCount);
-			JsGetProperty(obj, getId("sourceLength"), &sourceLength);
+			JsGetProperty(obj, ids[scriptId_id], &scriptId);
+			JsGetProperty(obj, ids[fileName_id], &fileName);
+			JsGetProperty(obj, ids[lineCount_id], &lineCount);
+			JsGetProperty(obj, ids[sourceLength_id], &sourceLength);
 
 			Script script;
 			JsNumberToInt(scriptId, &script.scriptId);
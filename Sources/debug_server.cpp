@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "debug_server.h"
+#include "ids.h"
 
 #include <Kore/Log.h>
 #include <Kore/Threads/Thread.h>
@@ -146,13 +147,6 @@ void startServer(int port) {
 int scriptId();
 extern JsRuntimeHandle runtime;
 
-JsPropertyIdRef getId(const char* name) {
-	JsPropertyIdRef id;
-	JsErrorCode err = JsCreatePropertyId(name, strlen(name), &id);
-	assert(err == JsNoError);
-	return id;
-}
-
 namespace {
 	class Stack {
 	public:
@@ -171,7 +165,7 @@ namespace {
 		JsValueRef stackTrace;
 		JsDiagGetStackTrace(&stackTrace);
 		JsValueRef lengthObj;
-		JsGetProperty(stackTrace, getId("length"), &lengthObj);
+		JsGetProperty(stackTrace, ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 		for (int i = 0; i < length; ++i) {
@@ -180,13 +174,13 @@ namespace {
 			JsIntToNumber(i, &iObj);
 			JsValueRef obj;
 			JsGetIndexedProperty(stackTrace, iObj, &obj);
-			JsGetProperty(obj, getId("index"), &indexObj);
-			JsGetProperty(obj, getId("scriptId"), &scriptIdObj);
-			JsGetProperty(obj, getId("line"), &lineObj);
-			JsGetProperty(obj, getId("column"), &columnObj);
-			JsGetProperty(obj, getId("sourceLength"), &sourceLengthObj);
-			JsGetProperty(obj, getId("sourceText"), &sourceTextObj);
-			JsGetProperty(obj, getId("functionHandle"), &functionHandleObj);
+			JsGetProperty(obj, ids[index_id], &indexObj);
+			JsGetProperty(obj, ids[scriptId_id], &scriptIdObj);
+			JsGetProperty(obj, ids[line_id], &lineObj);
+			JsGetProperty(obj, ids[column_id], &columnObj);
+			JsGetProperty(obj, ids[sourceLength_id], &sourceLengthObj);
+			JsGetProperty(obj, ids[sourceText_id], &sourceTextObj);
+			JsGetProperty(obj, ids[functionHandle_id], &functionHandleObj);
 			Stack stack;
 			JsNumberToInt(indexObj, &stack.index);
 			JsNumberToInt(scriptIdObj, &stack.scriptId);
@@ -226,9 +220,9 @@ namespace {
 		JsValueRef properties;
 		JsDiagGetStackProperties(0, &properties);
 		JsValueRef locals;
-		JsGetProperty(properties, getId("locals"), &locals);
+		JsGetProperty(properties, ids[locals_id], &locals);
 		JsValueRef lengthObj;
-		JsGetProperty(locals, getId("length"), &lengthObj);
+		JsGetProperty(locals, ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 
@@ -243,9 +237,9 @@ namespace {
 			JsValueRef value;
 			JsGetIndexedProperty(locals, index, &value);
 			JsValueRef nameObj, typeObj, valueObj;
-			JsGetProperty(value, getId("name"), &nameObj);
-			JsGetProperty(value, getId("type"), &typeObj);
-			JsGetProperty(value, getId("value"), &valueObj);
+			JsGetProperty(value, ids[name_id], &nameObj);
+			JsGetProperty(value, ids[type_id], &typeObj);
+			JsGetProperty(value, ids[value_id], &valueObj);
 
 			char name[256];
 			size_t length;
@@ -327,7 +321,7 @@ bool handleDebugMessage(Message& message, bool halted) {
 			JsValueRef breakpoints;
 			JsDiagGetBreakpoints(&breakpoints);
 			JsValueRef lengthObj;
-			JsGetProperty(breakpoints, getId("length"), &lengthObj);
+			JsGetProperty(breakpoints, ids[length_id], &lengthObj);
 			int length;
 			JsNumberToInt(lengthObj, &length);
 			for (int i = 0; i < length; ++i) {
@@ -336,7 +330,7 @@ bool handleDebugMessage(Message& message, bool halted) {
 				JsValueRef breakpoint;
 				JsGetIndexedProperty(breakpoints, index, &breakpoint);
 				JsValueRef breakpointIdObj;
-				JsGetProperty(breakpoint, getId("breakpointId"), &breakpointIdObj);
+				JsGetProperty(breakpoint, ids[breakpointId_id], &breakpointIdObj);
 				int breakpointId;
 				JsNumberToInt(breakpointIdObj, &breakpointId);
 				JsDiagRemoveBreakpoint(breakpointId);
@@ -0,0 +1,599 @@
+#include "pch.h"
+#include "dsp.h"
+#include "pcm.h"
+#include "ring.h"
+#include "simd.h"
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace {
+	const int maxNodes = 64;
+	const int blockFrames = 256;
+	const float pi = 3.14159265358979f;
+
+	const int combCount = 4;
+	const int allpassCount = 2;
+	const int combTunings[combCount] = {1116, 1188, 1277, 1356};
+	const int allpassTunings[allpassCount] = {556, 441};
+	const int stereoSpread = 23;
+
+	// Longest interaural time difference, in seconds
+	const float maxItd = 0.00066f;
+
+	struct Comb {
+		std::vector<float> buffer;
+		int index;
+		float filter;
+	};
+
+	struct Allpass {
+		std::vector<float> buffer;
+		int index;
+	};
+
+	struct Node {
+		int id;
+		int type;
+		Node* output;
+		int depth;
+		float parameters[dspMaxParameters];
+		bool dirty;
+		float input[blockFrames * 2];
+
+		// Biquad, coefficients are normalized by a0
+		float b0, b1, b2, a1, a2;
+		float z1[2], z2[2];
+
+		// Delay and panner lines, interleaved stereo for the delay
+		std::vector<float> line;
+		int position;
+
+		// Reverb, left combs and allpasses first
+		Comb combs[combCount * 2];
+		Allpass allpasses[allpassCount * 2];
+		float feedback, damping;
+
+		// Panner
+		float leftGain, rightGain, shadow;
+		int itd;
+		float shadowState;
+
+		// Compressor
+		float envelope, attack, release;
+	};
+
+	enum CommandType {
+		CommandCreate,
+		CommandDelete,
+		CommandConnect,
+		CommandParameter
+	};
+
+	struct Command {
+		CommandType type;
+		int node;
+		Node* created;
+		int target;
+		int parameter;
+		float value;
+	};
+
+	const int queueSize = 1024;
+
+	int sampleRate = 44100;
+	Ring<Command, queueSize> commands;
+	// The audio thread only takes a command while this has room
+	Ring<Node*, maxNodes * 2> garbage;
+
+	// JS thread copy of the connections, used to reject cycles. Node ids
+	// encode a slot, (id - 1) % maxNodes, so the audio thread finds nodes
+	// without searching.
+	std::map<int, int> targets;
+	int slotIds[maxNodes];
+	int generations[maxNodes];
+	std::deque<Command> overflow;
+
+	// Only touched by the audio thread
+	Node* slots[maxNodes];
+	Node* nodes[maxNodes];
+	int nodeCount = 0;
+	bool sorted = true;
+
+	// Commands that did not fit into the ring wait here, in order
+	void flushOverflow() {
+		while (!overflow.empty() && commands.push(overflow.front())) {
+			overflow.pop_front();
+		}
+	}
+
+	void pushCommand(const Command& command) {
+		flushOverflow();
+		if (!overflow.empty() || !commands.push(command)) overflow.push_back(command);
+	}
+
+	int allocateId() {
+		for (int slot = 0; slot < maxNodes; ++slot) {
+			if (slotIds[slot] != 0) continue;
+			if (generations[slot] >= INT_MAX / maxNodes - 1) generations[slot] = 0;
+			slotIds[slot] = slot + 1 + maxNodes * generations[slot]++;
+			return slotIds[slot];
+		}
+		return 0;
+	}
+
+	int nodeSlot(int id) {
+		return (id - 1) % maxNodes;
+	}
+
+	Command makeCommand(CommandType type, int node) {
+		Command command;
+		memset(&command, 0, sizeof(command));
+		command.type = type;
+		command.node = node;
+		return command;
+	}
+
+	Node* findNode(int id) {
+		if (id <= 0) return nullptr;
+		Node* node = slots[nodeSlot(id)];
+		return node != nullptr && node->id == id ? node : nullptr;
+	}
+
+	void setupComb(Comb& comb, int length) {
+		comb.buffer.assign(length > 1 ? length : 1, 0.0f);
+		comb.index = 0;
+		comb.filter = 0;
+	}
+
+	void setupAllpass(Allpass& allpass, int length) {
+		allpass.buffer.assign(length > 1 ? length : 1, 0.0f);
+		allpass.index = 0;
+	}
+
+	Node* allocateNode(int id, int type) {
+		Node* node = new Node;
+		node->id = id;
+		node->type = type;
+		node->output = nullptr;
+		node->depth = 0;
+		node->dirty = true;
+		node->position = 0;
+		node->z1[0] = node->z1[1] = node->z2[0] = node->z2[1] = 0;
+		node->shadowState = 0;
+		node->envelope = 0;
+		float* p = node->parameters;
+		for (int i = 0; i < dspMaxParameters; ++i) p[i] = 0;
+		float scale = sampleRate / 44100.0f;
+		switch (type) {
+		case DspBiquad:
+			p[0] = DspLowpass; p[1] = 1000; p[2] = 0.7071f; p[3] = 0;
+			break;
+		case DspDelay:
+			p[0] = 0.25f; p[1] = 0.3f; p[2] = 0.5f; p[3] = 1;
+			node->line.assign(sampleRate * 2 * 2, 0.0f);
+			break;
+		case DspReverb:
+			p[0] = 0.5f; p[1] = 0.5f; p[2] = 0.3f; p[3] = 1;
+			for (int i = 0; i < combCount; ++i) {
+				setupComb(node->combs[i], (int)(combTunings[i] * scale));
+				setupComb(node->combs[combCount + i], (int)((combTunings[i] + stereoSpread) * scale));
+			}
+			for (int i = 0; i < allpassCount; ++i) {
+				setupAllpass(node->allpasses[i], (int)(allpassTunings[i] * scale));
+				setupAllpass(node->allpasses[allpassCount + i], (int)((allpassTunings[i] + stereoSpread) * scale));
+			}
+			break;
+		case DspPanner:
+			p[0] = 0; p[1] = 1;
+			node->line.assign((int)(maxItd * sampleRate) + 2, 0.0f);
+			break;
+		case DspCompressor:
+			p[0] = -12; p[1] = 4; p[2] = 0.01f; p[3] = 0.1f; p[4] = 0;
+			break;
+		}
+		return node;
+	}
+
+	void updateBiquad(Node* node) {
+		int filter = (int)node->parameters[0];
+		float frequency = node->parameters[1];
+		float nyquist = sampleRate * 0.5f;
+		if (frequency < 10) frequency = 10;
+		if (frequency > nyquist * 0.99f) frequency = nyquist * 0.99f;
+		float q = node->parameters[2] > 0.01f ? node->parameters[2] : 0.01f;
+		float a = powf(10.0f, node->parameters[3] / 40.0f);
+		float w = 2 * pi * frequency / sampleRate;
+		float cw = cosf(w);
+		float alpha = sinf(w) / (2 * q);
+		float b0, b1, b2, a0, a1, a2;
+		switch (filter) {
+		default:
+		case DspLowpass:
+			b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+			break;
+		case DspHighpass:
+			b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+			break;
+		case DspBandpass:
+			b0 = alpha; b1 = 0; b2 = -alpha;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+			break;
+		case DspNotch:
+			b0 = 1; b1 = -2 * cw; b2 = 1;
+			a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+			break;
+		case DspPeak:
+			b0 = 1 + alpha * a; b1 = -2 * cw; b2 = 1 - alpha * a;
+			a0 = 1 + alpha / a; a1 = -2 * cw; a2 = 1 - alpha / a;
+			break;
+		case DspLowShelf: {
+			float s = 2 * sqrtf(a) * alpha;
+			b0 = a * ((a + 1) - (a - 1) * cw + s); b1 = 2 * a * ((a - 1) - (a + 1) * cw); b2 = a * ((a + 1) - (a - 1) * cw - s);
+			a0 = (a + 1) + (a - 1) * cw + s; a1 = -2 * ((a - 1) + (a + 1) * cw); a2 = (a + 1) + (a - 1) * cw - s;
+			break;
+		}
+		case DspHighShelf: {
+			float s = 2 * sqrtf(a) * alpha;
+			b0 = a * ((a + 1) + (a - 1) * cw + s); b1 = -2 * a * ((a - 1) + (a + 1) * cw); b2 = a * ((a + 1) + (a - 1) * cw - s);
+			a0 = (a + 1) - (a - 1) * cw + s; a1 = 2 * ((a - 1) - (a + 1) * cw); a2 = (a + 1) - (a - 1) * cw - s;
+			break;
+		}
+		}
+		node->b0 = b0 / a0;
+		node->b1 = b1 / a0;
+		node->b2 = b2 / a0;
+		node->a1 = a1 / a0;
+		node->a2 = a2 / a0;
+	}
+
+	void updateNode(Node* node) {
+		float* p = node->parameters;
+		switch (node->type) {
+		case DspBiquad:
+			updateBiquad(node);
+			break;
+		case DspReverb: {
+			float room = p[0] < 0 ? 0 : (p[0] > 1 ? 1 : p[0]);
+			float damping = p[1] < 0 ? 0 : (p[1] > 1 ? 1 : p[1]);
+			node->feedback = room * 0.28f + 0.7f;
+			node->damping = damping * 0.4f;
+			break;
+		}
+		case DspPanner: {
+			float lateral = sinf(p[0]);
+			float angle = (lateral + 1) * pi / 4;
+			float distance = p[1] > 1 ? p[1] : 1;
+			node->leftGain = cosf(angle) / distance;
+			node->rightGain = sinf(angle) / distance;
+			node->itd = (int)(fabsf(lateral) * maxItd * sampleRate);
+			// The far ear loses highs, down to about 4 kHz when fully to the side
+			float cutoff = 20000.0f - fabsf(lateral) * 16000.0f;
+			if (cutoff > sampleRate * 0.45f) cutoff = sampleRate * 0.45f;
+			node->shadow = expf(-2 * pi * cutoff / sampleRate);
+			break;
+		}
+		case DspCompressor:
+			node->attack = expf(-1.0f / ((p[2] > 0.0001f ? p[2] : 0.0001f) * sampleRate));
+			node->release = expf(-1.0f / ((p[3] > 0.0001f ? p[3] : 0.0001f) * sampleRate));
+			break;
+		}
+		node->dirty = false;
+	}
+
+	// Filters both channels at once, one lane per channel. The recursion
+	// runs along time so the frames themselves stay sequential.
+	void processBiquad(Node* node, float* data, int frames) {
+#if defined(KROM_SSE2)
+		__m128 b0 = _mm_set1_ps(node->b0), b1 = _mm_set1_ps(node->b1), b2 = _mm_set1_ps(node->b2);
+		__m128 a1 = _mm_set1_ps(node->a1), a2 = _mm_set1_ps(node->a2);
+		__m128 z1 = _mm_setr_ps(node->z1[0], node->z1[1], 0, 0);
+		__m128 z2 = _mm_setr_ps(node->z2[0], node->z2[1], 0, 0);
+		for (int i = 0; i < frames; ++i) {
+			__m128 x = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)&data[i * 2]));
+			__m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+			z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+			z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+			_mm_storel_epi64((__m128i*)&data[i * 2], _mm_castps_si128(y));
+		}
+		float state[4];
+		_mm_storeu_ps(state, z1);
+		node->z1[0] = state[0];
+		node->z1[1] = state[1];
+		_mm_storeu_ps(state, z2);
+		node->z2[0] = state[0];
+		node->z2[1] = state[1];
+#elif defined(KROM_NEON)
+		float32x2_t b0 = vdup_n_f32(node->b0), b1 = vdup_n_f32(node->b1), b2 = vdup_n_f32(node->b2);
+		float32x2_t a1 = vdup_n_f32(node->a1), a2 = vdup_n_f32(node->a2);
+		float32x2_t z1 = vld1_f32(node->z1), z2 = vld1_f32(node->z2);
+		for (int i = 0; i < frames; ++i) {
+			float32x2_t x = vld1_f32(&data[i * 2]);
+			float32x2_t y = vmla_f32(z1, b0, x);
+			z1 = vmls_f32(vmla_f32(z2, b1, x), a1, y);
+			z2 = vmls_f32(vmul_f32(b2, x), a2, y);
+			vst1_f32(&data[i * 2], y);
+		}
+		vst1_f32(node->z1, z1);
+		vst1_f32(node->z2, z2);
+#else
+		for (int i = 0; i < frames; ++i) {
+			for (int c = 0; c < 2; ++c) {
+				float x = data[i * 2 + c];
+				float y = node->b0 * x + node->z1[c];
+				node->z1[c] = node->b1 * x - node->a1 * y + node->z2[c];
+				node->z2[c] = node->b2 * x - node->a2 * y;
+				data[i * 2 + c] = y;
+			}
+		}
+#endif
+	}
+
+	void processDelay(Node* node, float* data, int frames) {
+		int length = (int)node->line.size() / 2;
+		int delay = (int)(node->parameters[0] * sampleRate);
+		if (delay < 1) delay = 1;
+		if (delay > length - 1) delay = length - 1;
+		float feedback = node->parameters[1], wet = node->parameters[2], dry = node->parameters[3];
+		float* line = node->line.data();
+		int position = node->position;
+		for (int i = 0; i < frames; ++i) {
+			int read = position - delay;
+			if (read < 0) read += length;
+			for (int c = 0; c < 2; ++c) {
+				float x = data[i * 2 + c];
+				float delayed = line[read * 2 + c];
+				line[position * 2 + c] = x + delayed * feedback;
+				data[i * 2 + c] = x * dry + delayed * wet;
+			}
+			if (++position == length) position = 0;
+		}
+		node->position = position;
+	}
+
+	float processComb(Comb& comb, float input, float feedback, float damping) {
+		float output = comb.buffer[comb.index];
+		comb.filter = output * (1 - damping) + comb.filter * damping;
+		comb.buffer[comb.index] = input + comb.filter * feedback;
+		if (++comb.index == (int)comb.buffer.size()) comb.index = 0;
+		return output;
+	}
+
+	float processAllpass(Allpass& allpass, float input) {
+		float delayed = allpass.buffer[allpass.index];
+		allpass.buffer[allpass.index] = input + delayed * 0.5f;
+		if (++allpass.index == (int)allpass.buffer.size()) allpass.index = 0;
+		return delayed - input;
+	}
+
+	// Schroeder reverb with parallel damped combs followed by allpasses, the
+	// right channel uses slightly longer lines to decorrelate the tails.
+	void processReverb(Node* node, float* data, int frames) {
+		float wet = node->parameters[2], dry = node->parameters[3];
+		for (int i = 0; i < frames; ++i) {
+			float input = (data[i * 2] + data[i * 2 + 1]) * 0.015f;
+			for (int c = 0; c < 2; ++c) {
+				float sum = 0;
+				for (int k = 0; k < combCount; ++k) {
+					sum += processComb(node->combs[c * combCount + k], input, node->feedback, node->damping);
+				}
+				for (int k = 0; k < allpassCount; ++k) {
+					sum = processAllpass(node->allpasses[c * allpassCount + k], sum);
+				}
+				data[i * 2 + c] = data[i * 2 + c] * dry + sum * wet;
+			}
+		}
+	}
+
+	// Places a mono downmix around the listener: level differences from an
+	// equal power pan, a short delay and a head shadow lowpass on the far
+	// ear, and attenuation by distance.
+	void processPanner(Node* node, float* data, int frames) {
+		int length = (int)node->line.size();
+		float* line = node->line.data();
+		int position = node->position;
+		bool rightIsFar = sinf(node->parameters[0]) < 0;
+		float nearGain = rightIsFar ? node->leftGain : node->rightGain;
+		float farGain = rightIsFar ? node->rightGain : node->leftGain;
+		float shadow = node->shadow;
+		float state = node->shadowState;
+		for (int i = 0; i < frames; ++i) {
+			float mono = (data[i * 2] + data[i * 2 + 1]) * 0.5f;
+			line[position] = mono;
+			int read = position - node->itd;
+			if (read < 0) read += length;
+			state = line[read] * (1 - shadow) + state * shadow;
+			if (++position == length) position = 0;
+			float nearSample = mono * nearGain;
+			float farSample = state * farGain;
+			data[i * 2 + 0] = rightIsFar ? nearSample : farSample;
+			data[i * 2 + 1] = rightIsFar ? farSample : nearSample;
+		}
+		node->position = position;
+		node->shadowState = state;
+	}
+
+	// Feed forward peak compressor, both channels share one envelope so the
+	// stereo image does not move.
+	void processCompressor(Node* node, float* data, int frames) {
+		float threshold = node->parameters[0];
+		float slope = node->parameters[1] > 1 ? 1 - 1 / node->parameters[1] : 0;
+		float makeup = node->parameters[4];
+		float envelope = node->envelope;
+		for (int i = 0; i < frames; ++i) {
+			float left = fabsf(data[i * 2]), right = fabsf(data[i * 2 + 1]);
+			float level = left > right ? left : right;
+			float coefficient = level > envelope ? node->attack : node->release;
+			envelope = level + coefficient * (envelope - level);
+			float over = 20 * log10f(envelope + 1e-9f) - threshold;
+			float gain = powf(10.0f, ((over > 0 ? -over * slope : 0) + makeup) / 20);
+			data[i * 2] *= gain;
+			data[i * 2 + 1] *= gain;
+		}
+		node->envelope = envelope;
+	}
+
+	// Orders nodes by their distance from the master output, every node then
+	// runs before the node it feeds.
+	void sortNodes() {
+		for (int i = 0; i < nodeCount; ++i) {
+			int depth = 0;
+			Node* node = nodes[i];
+			while (node->output != nullptr && depth < maxNodes) {
+				node = node->output;
+				++depth;
+			}
+			nodes[i]->depth = depth;
+		}
+		for (int i = 1; i < nodeCount; ++i) {
+			Node* node = nodes[i];
+			int j = i;
+			for (; j > 0 && nodes[j - 1]->depth < node->depth; --j) nodes[j] = nodes[j - 1];
+			nodes[j] = node;
+		}
+		sorted = true;
+	}
+}
+
+void dspInit(int rate) {
+	sampleRate = rate > 0 ? rate : 44100;
+}
+
+int dspCreateNode(int type) {
+	if (type < DspBiquad || type > DspCompressor || (int)targets.size() >= maxNodes) return 0;
+	Command command = makeCommand(CommandCreate, allocateId());
+	command.created = allocateNode(command.node, type);
+	targets[command.node] = 0;
+	pushCommand(command);
+	return command.node;
+}
+
+void dspDeleteNode(int node) {
+	if (targets.erase(node) == 0) return;
+	slotIds[nodeSlot(node)] = 0;
+	for (std::map<int, int>::iterator it = targets.begin(); it != targets.end(); ++it) {
+		if (it->second == node) it->second = 0;
+	}
+	pushCommand(makeCommand(CommandDelete, node));
+}
+
+bool dspConnect(int node, int target) {
+	if (targets.find(node) == targets.end()) return false;
+	if (target != 0) {
+		if (targets.find(target) == targets.end()) return false;
+		for (int next = target; next != 0; next = targets[next]) {
+			if (next == node) return false;
+		}
+	}
+	targets[node] = target;
+	Command command = makeCommand(CommandConnect, node);
+	command.target = target;
+	pushCommand(command);
+	return true;
+}
+
+void dspSetParameter(int node, int parameter, float value) {
+	if (parameter < 0 || parameter >= dspMaxParameters) return;
+	Command command = makeCommand(CommandParameter, node);
+	command.parameter = parameter;
+	command.value = value;
+	pushCommand(command);
+}
+
+void dspCollectGarbage() {
+	flushOverflow();
+	Node* node;
+	while (garbage.pop(&node)) {
+		delete node;
+	}
+}
+
+void dspUpdate() {
+	Command command;
+	while (garbage.space() > 0 && commands.pop(&command)) {
+		switch (command.type) {
+		case CommandCreate:
+			slots[nodeSlot(command.node)] = command.created;
+			nodes[nodeCount++] = command.created;
+			sorted = false;
+			break;
+		case CommandDelete: {
+			Node* deleted = findNode(command.node);
+			if (deleted == nullptr) break;
+			for (int n = 0; n < nodeCount; ++n) {
+				if (nodes[n]->output == deleted) nodes[n]->output = nullptr;
+			}
+			for (int n = 0; n < nodeCount; ++n) {
+				if (nodes[n] == deleted) {
+					for (int m = n + 1; m < nodeCount; ++m) nodes[m - 1] = nodes[m];
+					--nodeCount;
+					break;
+				}
+			}
+			slots[nodeSlot(command.node)] = nullptr;
+			garbage.push(deleted);
+			sorted = false;
+			break;
+		}
+		case CommandConnect: {
+			Node* node = findNode(command.node);
+			if (node != nullptr) node->output = findNode(command.target);
+			sorted = false;
+			break;
+		}
+		case CommandParameter: {
+			Node* node = findNode(command.node);
+			if (node != nullptr) {
+				node->parameters[command.parameter] = command.value;
+				node->dirty = true;
+			}
+			break;
+		}
+		}
+	}
+	if (!sorted) sortNodes();
+}
+
+void dspBeginBlock(int frames) {
+	for (int i = 0; i < nodeCount; ++i) {
+		memset(nodes[i]->input, 0, frames * 2 * sizeof(float));
+	}
+}
+
+float* dspNodeInput(int node) {
+	if (node == 0) return nullptr;
+	Node* found = findNode(node);
+	return found != nullptr ? found->input : nullptr;
+}
+
+void dspProcess(float* master, int frames) {
+	for (int i = 0; i < nodeCount; ++i) {
+		Node* node = nodes[i];
+		if (node->dirty) updateNode(node);
+		switch (node->type) {
+		case DspBiquad:
+			processBiquad(node, node->input, frames);
+			break;
+		case DspDelay:
+			processDelay(node, node->input, frames);
+			break;
+		case DspReverb:
+			processReverb(node, node->input, frames);
+			break;
+		case DspPanner:
+			processPanner(node, node->input, frames);
+			break;
+		case DspCompressor:
+			processCompressor(node, node->input, frames);
+			break;
+		}
+		mixStereo(node->output != nullptr ? node->output->input : master, node->input, 1, 1, frames);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// Native effect graph for the mixer. Every node processes interleaved stereo
+// blocks and sends its output to one other node or to the master output (0),
+// mixer voices feed a node or the master output. Nodes are created and
+// configured from the JS thread and evaluated on the audio thread.
+
+enum DspNodeType {
+	DspBiquad = 0,
+	DspDelay = 1,
+	DspReverb = 2,
+	DspPanner = 3,
+	DspCompressor = 4
+};
+
+enum DspFilterType {
+	DspLowpass = 0,
+	DspHighpass = 1,
+	DspBandpass = 2,
+	DspNotch = 3,
+	DspPeak = 4,
+	DspLowShelf = 5,
+	DspHighShelf = 6
+};
+
+// Parameters by node type:
+// Biquad: 0 filter type, 1 frequency in Hz, 2 Q, 3 gain in dB for peak and shelf filters
+// Delay: 0 time in seconds (at most 2), 1 feedback, 2 wet, 3 dry
+// Reverb: 0 room size in [0, 1], 1 damping in [0, 1], 2 wet, 3 dry
+// Panner: 0 azimuth in radians (0 is ahead, positive is to the right), 1 distance
+// Compressor: 0 threshold in dB, 1 ratio, 2 attack in seconds, 3 release in seconds, 4 makeup gain in dB
+const int dspMaxParameters = 5;
+
+void dspInit(int sampleRate);
+int dspCreateNode(int type);
+void dspDeleteNode(int node);
+bool dspConnect(int node, int target);
+void dspSetParameter(int node, int parameter, float value);
+
+// Frees deleted nodes, call regularly from the JS thread.
+void dspCollectGarbage();
+
+// Audio thread: dspUpdate applies queued changes once per mix, then every
+// block clears the node inputs, lets voices accumulate into them and
+// evaluates the graph into the master block.
+void dspUpdate();
+void dspBeginBlock(int frames);
+float* dspNodeInput(int node);
+void dspProcess(float* master, int frames);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Slot table for resources that are handed to JS as plain numbers. A handle
+// packs the slot index into the low 32 bits and the slot's generation into
+// the 21 bits above, so it stays exact in a double. Every slot belongs to an
+// owner (a pipeline or compute shader) and is freed together with it. Slots
+// are indexed by owner and name, so repeated lookups do not scan the table.
+// Debug builds check the generation and reject stale handles.
+template<typename T> class HandleTable {
+public:
+	// An existing slot with the same owner and name is reused.
+	double add(const T& value, void* owner, const char* name) {
+		Names& names = owners[owner];
+		typename Names::iterator existing = names.find(name);
+		if (existing != names.end()) {
+			slots[existing->second].value = value;
+			return handle(existing->second, slots[existing->second].generation);
+		}
+		uint32_t index;
+		if (freeSlots.empty()) {
+			index = (uint32_t)slots.size();
+			slots.push_back(Slot());
+			slots[index].generation = 1;
+		}
+		else {
+			index = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		Slot& slot = slots[index];
+		slot.value = value;
+		slot.used = true;
+		names[name] = index;
+		return handle(index, slot.generation);
+	}
+
+	// Returns 0 if the owner has no slot with that name.
+	double find(void* owner, const char* name) {
+		typename std::map<void*, Names>::iterator names = owners.find(owner);
+		if (names == owners.end()) return 0;
+		typename Names::iterator it = names->second.find(name);
+		if (it == names->second.end()) return 0;
+		return handle(it->second, slots[it->second].generation);
+	}
+
+	T* get(double value) {
+		// Also rejects NaN, converting it or out of range values is undefined
+		if (!(value >= 0) || value >= 9007199254740992.0) return nullptr;
+		uint64_t bits = (uint64_t)value;
+		uint32_t index = (uint32_t)(bits & 0xffffffff);
+		if (index >= slots.size()) return nullptr;
+#ifndef NDEBUG
+		if (!slots[index].used || slots[index].generation != (uint32_t)(bits >> 32)) return nullptr;
+#endif
+		return &slots[index].value;
+	}
+
+	void removeOwned(void* owner) {
+		typename std::map<void*, Names>::iterator names = owners.find(owner);
+		if (names == owners.end()) return;
+		for (typename Names::iterator it = names->second.begin(); it != names->second.end(); ++it) {
+			Slot& slot = slots[it->second];
+			slot.used = false;
+			slot.generation = (slot.generation + 1) & maxGeneration;
+			if (slot.generation == 0) slot.generation = 1;
+			freeSlots.push_back(it->second);
+		}
+		owners.erase(names);
+	}
+
+private:
+	static const uint32_t maxGeneration = (1 << 21) - 1;
+
+	struct Slot {
+		T value;
+		uint32_t generation;
+		bool used;
+	};
+
+	typedef std::map<std::string, uint32_t> Names;
+
+	double handle(uint32_t index, uint32_t generation) {
+		return (double)(((uint64_t)generation << 32) | index);
+	}
+
+	std::vector<Slot> slots;
+	std::vector<uint32_t> freeSlots;
+	std::map<void*, Names> owners;
+};
@@ -0,0 +1,25 @@
+#include "pch.h"
+#include "hash.h"
+
+namespace {
+	struct CrcTable {
+		uint32_t entries[256];
+
+		CrcTable() {
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t crc = i;
+				for (int bit = 0; bit < 8; ++bit) crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+				entries[i] = crc;
+			}
+		}
+	};
+
+	const CrcTable crcTable;
+}
+
+uint32_t crc32(const void* data, size_t size, uint32_t crc) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) crc = crcTable.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+const uint64_t hashSeed = 14695981039346656037ull;
+
+// 64 bit FNV-1a, pass the previous result as seed to hash several ranges.
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = hashSeed) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template<typename T> uint64_t hashValue(T value, uint64_t hash) {
+	return hashBytes(&value, sizeof(value), hash);
+}
+
+// CRC-32 as used by zip and png, pass the previous result as crc to checksum
+// several ranges.
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0);
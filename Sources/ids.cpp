@@ -0,0 +1,15 @@
+#include "pch.h"
+#include "ids.h"
+
+#include <ChakraCore.h>
+
+#include <string.h>
+
+JsPropertyIdRef ids[propertyIdCount];
+
+#define KROM_CREATE_ID(name) JsCreatePropertyId(#name, strlen(#name), &ids[name##_id]);\
+	JsAddRef(ids[name##_id], nullptr);
+
+void createIds() {
+	KROM_PROPERTY_IDS(KROM_CREATE_ID)
+}
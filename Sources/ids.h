@@ -0,0 +1,85 @@
+#pragma once
+
+typedef void *JsRef;
+typedef JsRef JsPropertyIdRef;
+
+// Every property name the bindings and the debug server look up. The ids are
+// created once in createIds() so hot bindings index this table instead of
+// going through JsCreatePropertyId for every call.
+#define KROM_PROPERTY_IDS(id) \
+	id(alphaBlendDestination) \
+	id(alphaBlendSource) \
+	id(blendDestination) \
+	id(blendSource) \
+	id(breakpointId) \
+	id(buffer) \
+	id(channels) \
+	id(colorWriteMaskAlpha) \
+	id(colorWriteMaskBlue) \
+	id(colorWriteMaskGreen) \
+	id(colorWriteMaskRed) \
+	id(column) \
+	id(conservativeRasterization) \
+	id(cullMode) \
+	id(data) \
+	id(depth) \
+	id(depthMode) \
+	id(depthWrite) \
+	id(elements) \
+	id(exception) \
+	id(fileName) \
+	id(filename) \
+	id(format) \
+	id(fsname) \
+	id(functionHandle) \
+	id(gsname) \
+	id(height) \
+	id(hits) \
+	id(index) \
+	id(instanced) \
+	id(Krom) \
+	id(length) \
+	id(line) \
+	id(lineCount) \
+	id(locals) \
+	id(misses) \
+	id(name) \
+	id(overruns) \
+	id(realHeight) \
+	id(realWidth) \
+	id(renderTarget_) \
+	id(sampleRate) \
+	id(scriptId) \
+	id(size) \
+	id(source) \
+	id(sourceLength) \
+	id(sourceText) \
+	id(stack) \
+	id(stencilBothPass) \
+	id(stencilDepthFail) \
+	id(stencilFail) \
+	id(stencilMode) \
+	id(stencilReadMask) \
+	id(stencilReferenceValue) \
+	id(stencilWriteMask) \
+	id(tcsname) \
+	id(tesname) \
+	id(texture_) \
+	id(type) \
+	id(underruns) \
+	id(value) \
+	id(vsname) \
+	id(width)
+
+#define KROM_PROPERTY_ID_ENUM(name) name##_id,
+
+enum PropertyId {
+	KROM_PROPERTY_IDS(KROM_PROPERTY_ID_ENUM)
+	propertyIdCount
+};
+
+#undef KROM_PROPERTY_ID_ENUM
+
+extern JsPropertyIdRef ids[propertyIdCount];
+
+void createIds();
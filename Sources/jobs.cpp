@@ -0,0 +1,75 @@
+#include "pch.h"
+#include "jobs.h"
+#include "semaphore.h"
+
+#include <Kore/Threads/Mutex.h>
+#include <Kore/Threads/Thread.h>
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+namespace {
+	struct Job {
+		JobFunction run;
+		JobFunction complete;
+		void* data;
+	};
+
+	const int maxThreads = 4;
+
+	Kore::Mutex mutex;
+	Semaphore* semaphore = nullptr;
+	std::deque<Job> queued;
+	std::vector<Job> finished;
+
+	void runJobs(void*) {
+		for (;;) {
+			semaphore->wait();
+			mutex.lock();
+			Job job = queued.front();
+			queued.pop_front();
+			mutex.unlock();
+			job.run(job.data);
+			mutex.lock();
+			finished.push_back(job);
+			mutex.unlock();
+		}
+	}
+
+	void startThreads() {
+		mutex.create();
+		semaphore = new Semaphore(0);
+		// Leaves a core for the main thread
+		int threads = (int)std::thread::hardware_concurrency() - 1;
+		if (threads < 1) threads = 1;
+		if (threads > maxThreads) threads = maxThreads;
+		for (int i = 0; i < threads; ++i) {
+			Kore::createAndRunThread(runJobs, nullptr);
+		}
+	}
+}
+
+void jobsSubmit(JobFunction run, JobFunction complete, void* data) {
+	if (semaphore == nullptr) startThreads();
+	Job job;
+	job.run = run;
+	job.complete = complete;
+	job.data = data;
+	mutex.lock();
+	queued.push_back(job);
+	mutex.unlock();
+	semaphore->signal();
+}
+
+int jobsComplete() {
+	if (semaphore == nullptr) return 0;
+	std::vector<Job> completed;
+	mutex.lock();
+	completed.swap(finished);
+	mutex.unlock();
+	for (size_t i = 0; i < completed.size(); ++i) {
+		completed[i].complete(completed[i].data);
+	}
+	return (int)completed.size();
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Small worker pool for blocking work like file reads and decoding. The
+// threads are started on first use.
+
+typedef void (*JobFunction)(void* data);
+
+// run is called on a worker thread, complete later on the thread that calls
+// jobsComplete.
+void jobsSubmit(JobFunction run, JobFunction complete, void* data);
+
+// Calls the complete functions of all finished jobs, returns their count.
+int jobsComplete();
@@ -0,0 +1,328 @@
+#include "pch.h"
+#include "kvstore.h"
+#include "hash.h"
+
+#include <Kore/Threads/Mutex.h>
+#include <Kore/Threads/Thread.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <unordered_map>
+
+#ifdef KORE_WINDOWS
+#include <Windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+	};
+
+	struct RecordHeader {
+		uint32_t crc;
+		uint32_t keySize;
+		uint32_t valueSize;
+	};
+
+	struct Location {
+		uint64_t offset; // of the value
+		uint32_t size;
+	};
+
+	struct Snapshot {
+		std::vector<std::pair<std::string, Location> > entries;
+		uint64_t end;
+	};
+
+	const uint32_t storeMagic = 0x31564b4b; // KKV1
+	const uint32_t storeVersion = 1;
+	const uint32_t deleted = 0xffffffff;
+	const uint32_t maxKeySize = 64 * 1024;
+	const uint64_t compactionThreshold = 1024 * 1024;
+
+	Kore::Mutex mutex;
+	std::string storePath;
+	FILE* file = nullptr;
+	uint64_t fileSize = 0;
+	uint64_t liveBytes = 0;
+	bool compacting = false;
+	std::unordered_map<std::string, Location> locations;
+
+	uint32_t recordCrc(const RecordHeader& header, const void* key, const void* value) {
+		uint32_t crc = crc32(&header.keySize, sizeof(uint32_t) * 2);
+		crc = crc32(key, header.keySize, crc);
+		return header.valueSize == deleted ? crc : crc32(value, header.valueSize, crc);
+	}
+
+	uint64_t recordSize(const std::string& key, uint32_t size) {
+		return sizeof(RecordHeader) + key.size() + (size == deleted ? 0 : size);
+	}
+
+	bool syncFile(FILE* f) {
+		if (fflush(f) != 0) return false;
+#ifdef KORE_WINDOWS
+		return _commit(_fileno(f)) == 0;
+#else
+		return fsync(fileno(f)) == 0;
+#endif
+	}
+
+	bool truncateFile(FILE* f, uint64_t size) {
+		fflush(f);
+#ifdef KORE_WINDOWS
+		return _chsize_s(_fileno(f), (__int64)size) == 0;
+#else
+		return ftruncate(fileno(f), (off_t)size) == 0;
+#endif
+	}
+
+	bool seekTo(FILE* f, uint64_t offset) {
+#ifdef KORE_WINDOWS
+		return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+		return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+	}
+
+	bool fileLength(FILE* f, uint64_t* length) {
+#ifdef KORE_WINDOWS
+		if (_fseeki64(f, 0, SEEK_END) != 0) return false;
+		__int64 end = _ftelli64(f);
+#else
+		if (fseeko(f, 0, SEEK_END) != 0) return false;
+		off_t end = ftello(f);
+#endif
+		if (end < 0) return false;
+		*length = (uint64_t)end;
+		return true;
+	}
+
+	// Appends a record and returns the offset of its value.
+	bool appendRecord(FILE* f, uint64_t& size, const std::string& key, const void* value, uint32_t valueSize, uint64_t* valueOffset) {
+		RecordHeader header;
+		header.keySize = (uint32_t)key.size();
+		header.valueSize = valueSize;
+		header.crc = recordCrc(header, key.data(), value);
+		if (!seekTo(f, size) || fwrite(&header, sizeof(header), 1, f) != 1 || (key.size() > 0 && fwrite(key.data(), key.size(), 1, f) != 1)) return false;
+		if (valueSize != deleted && valueSize > 0 && fwrite(value, valueSize, 1, f) != 1) return false;
+		if (valueOffset != nullptr) *valueOffset = size + sizeof(header) + key.size();
+		size += recordSize(key, valueSize);
+		return true;
+	}
+
+	// Replays the log into the index, returns the end of the last good record.
+	uint64_t replay() {
+		FileHeader fileHeader;
+		uint64_t length;
+		if (!fileLength(file, &length) || !seekTo(file, 0) || fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || fileHeader.magic != storeMagic || fileHeader.version != storeVersion) return 0;
+		uint64_t offset = sizeof(FileHeader);
+		std::vector<uint8_t> buffer;
+		for (;;) {
+			RecordHeader header;
+			if (fread(&header, sizeof(header), 1, file) != 1 || header.keySize > maxKeySize) break;
+			size_t valueSize = header.valueSize == deleted ? 0 : header.valueSize;
+			// A damaged header can claim more bytes than the file holds
+			if (header.keySize + (uint64_t)valueSize > length - offset - sizeof(header)) break;
+			buffer.resize(header.keySize + valueSize);
+			if (!buffer.empty() && fread(buffer.data(), buffer.size(), 1, file) != 1) break;
+			if (recordCrc(header, buffer.data(), buffer.data() + header.keySize) != header.crc) break;
+
+			std::string key((const char*)buffer.data(), header.keySize);
+			std::unordered_map<std::string, Location>::iterator it = locations.find(key);
+			if (it != locations.end()) {
+				liveBytes -= recordSize(key, it->second.size);
+				locations.erase(it);
+			}
+			if (header.valueSize != deleted) {
+				Location location;
+				location.offset = offset + sizeof(header) + header.keySize;
+				location.size = header.valueSize;
+				locations[key] = location;
+				liveBytes += recordSize(key, location.size);
+			}
+			offset += sizeof(header) + buffer.size();
+		}
+		return offset;
+	}
+
+	bool createStore(const char* path) {
+		file = fopen(path, "w+b");
+		if (file == nullptr) return false;
+		FileHeader header;
+		header.magic = storeMagic;
+		header.version = storeVersion;
+		fileSize = sizeof(header);
+		return fwrite(&header, sizeof(header), 1, file) == 1 && syncFile(file);
+	}
+
+	bool copyRange(FILE* from, uint64_t start, uint64_t end, FILE* to) {
+		char buffer[64 * 1024];
+		if (!seekTo(from, start)) return false;
+		while (start < end) {
+			size_t chunk = end - start < sizeof(buffer) ? (size_t)(end - start) : sizeof(buffer);
+			if (fread(buffer, chunk, 1, from) != 1 || fwrite(buffer, chunk, 1, to) != 1) return false;
+			start += chunk;
+		}
+		return true;
+	}
+
+	// Writes the records of a snapshot of the locations to a new log while the
+	// store keeps appending to the old one. Records appended in the meantime
+	// are copied over at the end, under the lock, and the new log replaces
+	// the old one.
+	void compact(void* data) {
+		Snapshot* snapshot = (Snapshot*)data;
+		std::string temp = storePath + ".tmp";
+		FILE* from = fopen(storePath.c_str(), "rb");
+		FILE* to = fopen(temp.c_str(), "w+b");
+		bool success = from != nullptr && to != nullptr;
+
+		std::map<std::string, uint64_t> moved;
+		uint64_t size = sizeof(FileHeader);
+		FileHeader fileHeader;
+		fileHeader.magic = storeMagic;
+		fileHeader.version = storeVersion;
+		success = success && fwrite(&fileHeader, sizeof(fileHeader), 1, to) == 1;
+		std::vector<uint8_t> value;
+		for (size_t i = 0; i < snapshot->entries.size() && success; ++i) {
+			const std::string& key = snapshot->entries[i].first;
+			const Location& location = snapshot->entries[i].second;
+			value.resize(location.size);
+			success = seekTo(from, location.offset) && (location.size == 0 || fread(value.data(), location.size, 1, from) == 1);
+			uint64_t offset;
+			success = success && appendRecord(to, size, key, value.data(), location.size, &offset);
+			moved[key] = offset;
+		}
+		success = success && syncFile(to);
+
+		mutex.lock();
+		if (success) {
+			fflush(file);
+			uint64_t tailStart = size;
+			success = seekTo(to, size) && copyRange(from, snapshot->end, fileSize, to) && syncFile(to);
+			size += fileSize - snapshot->end;
+			if (success) {
+				fclose(to);
+				to = nullptr;
+				fclose(from);
+				from = nullptr;
+				fclose(file);
+#ifdef KORE_WINDOWS
+				// rename does not replace files here. When the replace fails
+				// the old log is still complete and kvOpen removes the temp.
+				success = MoveFileExA(temp.c_str(), storePath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+				success = rename(temp.c_str(), storePath.c_str()) == 0;
+				if (!success) remove(temp.c_str());
+#endif
+				file = fopen(storePath.c_str(), "r+b");
+			}
+			if (success) {
+				for (std::unordered_map<std::string, Location>::iterator it = locations.begin(); it != locations.end(); ++it) {
+					if (it->second.offset >= snapshot->end) it->second.offset = tailStart + (it->second.offset - snapshot->end);
+					else it->second.offset = moved[it->first];
+				}
+				fileSize = size;
+			}
+		}
+		compacting = false;
+		mutex.unlock();
+
+		if (from != nullptr) fclose(from);
+		if (to != nullptr) {
+			fclose(to);
+			remove(temp.c_str());
+		}
+		delete snapshot;
+	}
+
+	void maybeCompact() {
+		if (compacting || fileSize < compactionThreshold || liveBytes * 2 > fileSize) return;
+		fflush(file);
+		Snapshot* snapshot = new Snapshot;
+		snapshot->entries.assign(locations.begin(), locations.end());
+		snapshot->end = fileSize;
+		compacting = true;
+		Kore::createAndRunThread(compact, snapshot);
+	}
+}
+
+bool kvOpen(const char* path) {
+	if (file != nullptr) return true;
+	mutex.create();
+	storePath = path;
+	std::string temp = storePath + ".tmp";
+	file = fopen(path, "r+b");
+	if (file == nullptr && rename(temp.c_str(), path) == 0) file = fopen(path, "r+b");
+	remove(temp.c_str());
+	if (file == nullptr) return createStore(path);
+
+	uint64_t end = replay();
+	if (end == 0) {
+		fclose(file);
+		locations.clear();
+		liveBytes = 0;
+		return createStore(path);
+	}
+	fileSize = end;
+	truncateFile(file, end);
+	return true;
+}
+
+bool kvGet(const std::string& key, std::vector<uint8_t>& value) {
+	if (file == nullptr) return false;
+	mutex.lock();
+	std::unordered_map<std::string, Location>::iterator it = locations.find(key);
+	bool found = it != locations.end();
+	if (found) {
+		value.resize(it->second.size);
+		found = seekTo(file, it->second.offset) && (it->second.size == 0 || fread(value.data(), it->second.size, 1, file) == 1);
+	}
+	mutex.unlock();
+	return found;
+}
+
+bool kvPut(const std::string& key, const void* value, uint32_t size) {
+	if (file == nullptr || key.size() > maxKeySize || size == deleted) return false;
+	mutex.lock();
+	Location location;
+	location.size = size;
+	bool written = appendRecord(file, fileSize, key, value, size, &location.offset);
+	if (written) {
+		std::unordered_map<std::string, Location>::iterator it = locations.find(key);
+		if (it != locations.end()) liveBytes -= recordSize(key, it->second.size);
+		locations[key] = location;
+		liveBytes += recordSize(key, size);
+		maybeCompact();
+	}
+	mutex.unlock();
+	return written;
+}
+
+bool kvDelete(const std::string& key) {
+	if (file == nullptr) return false;
+	mutex.lock();
+	std::unordered_map<std::string, Location>::iterator it = locations.find(key);
+	bool written = it != locations.end() && appendRecord(file, fileSize, key, nullptr, deleted, nullptr);
+	if (written) {
+		liveBytes -= recordSize(key, it->second.size);
+		locations.erase(it);
+		maybeCompact();
+	}
+	mutex.unlock();
+	return written;
+}
+
+bool kvFlush() {
+	if (file == nullptr) return true;
+	mutex.lock();
+	bool synced = syncFile(file);
+	mutex.unlock();
+	return synced;
+}
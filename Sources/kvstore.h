@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Append only key value store for small save records. Every put or delete
+// appends one record to a log, and an in-memory hash index maps each key to
+// its latest value in the log. Once most of the log is garbage, the live
+// records are rewritten on a background thread. Records carry a CRC. On
+// open, the log is replayed up to the first incomplete or damaged record
+// and cut there, so a crash loses at most the unflushed tail.
+
+bool kvOpen(const char* path);
+bool kvGet(const std::string& key, std::vector<uint8_t>& value);
+bool kvPut(const std::string& key, const void* value, uint32_t size);
+bool kvDelete(const std::string& key);
+
+// Makes all previous writes durable.
+bool kvFlush();
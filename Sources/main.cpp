@@ -27,6 +27,7 @@
 
 #include <Kore/IO/FileReader.h>
 #include <Kore/IO/FileWriter.h>
+#include <Kore/IO/BufferReader.h>
 #include <Kore/Graphics4/Graphics.h>
 #include <Kore/Graphics4/PipelineState.h>
 
@@ -48,17 +49,34 @@
 #include <Kore/Threads/Mutex.h>
 
 #include <kinc/io/filereader.h>
+#define STB_VORBIS_HEADER_ONLY
+#include <kinc/libs/stb_vorbis.c>
 
+#include "capture.h"
 #include "debug.h"
 #include "debug_server.h"
+#include "dsp.h"
+#include "handles.h"
+#include "hash.h"
+#include "ids.h"
+#include "jobs.h"
+#include "kvstore.h"
+#include "mapping.h"
+#include "mixer.h"
+#include "pack.h"
+#include "pcm.h"
+#include "savewriter.h"
+#include "semaphore.h"
 
 #include <assert.h>
 #include <stdarg.h>
 #include <fstream>
 #include <map>
+#include <set>
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 
 #ifdef KORE_WINDOWS
 #include <Windows.h> // AttachConsole
@@ -125,12 +143,28 @@ namespace {
 	std::map<std::string, bool> shaderChanges;
 	std::map<std::string, std::string> shaderFileNames;
 
+	const int maxGamepads = 12;
+	const int maxGamepadAxes = 16;
+	const int maxGamepadButtons = 32;
+
 	Kore::Mutex mutex;
-	Kore::Mutex audioMutex;
-	int audioSamples = 0;
+	Kore::Mutex inputMutex;
+	// Samples requested by the Audio2 callback since the last audio callback
+	// into JS. It is the only state shared with the audio thread, the ring
+	// itself has one writer (writeAudioBuffer) and one reader (Audio2).
+	std::atomic<int> audioSamples(0);
+	std::atomic<int> audioUnderruns(0);
+	std::atomic<int> audioOverruns(0);
+	// Set with release semantics once audioSemaphore exists, so the Audio2
+	// callback never sees the flag without the semaphore
+	std::atomic<bool> audioWorker(false);
+	std::atomic<bool> mixerEnabled(false);
 	int audioReadLocation = 0;
 
 	void update();
+	void warmupPipelines();
+	void writeCacheFile(const std::string& path, const void* header, size_t headerSize, const void* data, size_t size);
+	void startPredecode();
 	void initAudioBuffer();
 	void updateAudio(int samples);
 	void dropFiles(wchar_t* filePath);
@@ -152,22 +186,13 @@ namespace {
 	void penDown(int window, int x, int y, float pressure);
 	void penUp(int window, int x, int y, float pressure);
 	void penMove(int window, int x, int y, float pressure);
-	void gamepad1Axis(int axis, float value);
-	void gamepad1Button(int button, float value);
-	void gamepad2Axis(int axis, float value);
-	void gamepad2Button(int button, float value);
-	void gamepad3Axis(int axis, float value);
-	void gamepad3Button(int button, float value);
-	void gamepad4Axis(int axis, float value);
-	void gamepad4Button(int button, float value);
+	void registerGamepads();
 
 	const int tempStringSize = 1024 * 1024 - 1;
 	char tempString[tempStringSize + 1];
 	char tempStringVS[tempStringSize + 1];
 	char tempStringFS[tempStringSize + 1];
 
-	JsPropertyIdRef buffer_id;
-
 	void sendLogMessageArgs(const char* format, va_list args) {
 		char msg[4096];
 		vsnprintf(msg, sizeof(msg) - 2, format, args);
@@ -237,12 +262,15 @@ namespace {
 		frame.verticalSync = vSync;
 		frame.samplesPerPixel = samplesPerPixel;
 		Kore::System::init(title, width, height, &win, &frame);
+		warmupPipelines();
+		startPredecode();
 
 		mutex.create();
-		audioMutex.create();
+		inputMutex.create();
 		if (enableSound) {
 			Kore::Audio2::audioCallback = updateAudio;
 			Kore::Audio2::init();
+			dspInit(Kore::Audio2::samplesPerSecond);
 			initAudioBuffer();
 		}
 		Kore::Random::init((int)(Kore::System::time() * 1000));
@@ -268,14 +296,7 @@ namespace {
 		Kore::Pen::the()->Press = penDown;
 		Kore::Pen::the()->Release = penUp;
 		Kore::Pen::the()->Move = penMove;
-		Kore::Gamepad::get(0)->Axis = gamepad1Axis;
-		Kore::Gamepad::get(0)->Button = gamepad1Button;
-		Kore::Gamepad::get(1)->Axis = gamepad2Axis;
-		Kore::Gamepad::get(1)->Button = gamepad2Button;
-		Kore::Gamepad::get(2)->Axis = gamepad3Axis;
-		Kore::Gamepad::get(2)->Button = gamepad3Button;
-		Kore::Gamepad::get(3)->Axis = gamepad4Axis;
-		Kore::Gamepad::get(3)->Button = gamepad4Button;
+		registerGamepads();
 
 		return JS_INVALID_REFERENCE;
 	}
@@ -343,6 +364,153 @@ namespace {
 		return JS_INVALID_REFERENCE;
 	}
 
+	// Krom.getInputState returns a buffer with this layout. The handlers below
+	// keep it current, so JS can poll input without any callbacks. Mouse
+	// movement and wheel are accumulated until JS writes zero to them.
+	struct InputState {
+		Kore::u8 keys[256];
+		Kore::s32 mouseX;
+		Kore::s32 mouseY;
+		Kore::s32 mouseMovementX;
+		Kore::s32 mouseMovementY;
+		Kore::s32 mouseButtons;
+		Kore::s32 mouseWheel;
+		Kore::s32 penX;
+		Kore::s32 penY;
+		Kore::s32 penDown;
+		float penPressure;
+		float gamepadAxes[maxGamepads][maxGamepadAxes];
+		float gamepadButtons[maxGamepads][maxGamepadButtons];
+	};
+
+	InputState inputState;
+	bool inputStateEnabled = false;
+	JsValueRef inputStateBuffer;
+
+	JsValueRef CALLBACK krom_get_input_state(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (!inputStateEnabled) {
+			memset(&inputState, 0, sizeof(inputState));
+			JsCreateExternalArrayBuffer(&inputState, sizeof(inputState), nullptr, nullptr, &inputStateBuffer);
+			JsAddRef(inputStateBuffer, nullptr);
+			inputStateEnabled = true;
+		}
+		return inputStateBuffer;
+	}
+
+	// With an input buffer callback set, input events are not passed to JS one
+	// by one. They are collected as fixed size records in a ring and handed to
+	// the callback once per frame, before the update callback runs.
+	enum InputEventType {
+		InputKeyDown = 1,
+		InputKeyUp,
+		InputKeyPress,
+		InputMouseDown,
+		InputMouseUp,
+		InputMouseMove,
+		InputMouseWheel,
+		InputPenDown,
+		InputPenUp,
+		InputPenMove,
+		InputGamepadAxis,
+		InputGamepadButton
+	};
+
+	// 32 bytes: type, window or gamepad index, four event specific ints,
+	// a float value (pen pressure, gamepad values) and padding.
+	struct InputEvent {
+		Kore::s32 type;
+		Kore::s32 source;
+		Kore::s32 data[4];
+		float value;
+		Kore::s32 padding;
+	};
+
+	const int inputRingSize = 4096;
+	InputEvent inputRing[inputRingSize];
+	InputEvent inputDelivery[inputRingSize];
+	int inputRingStart = 0;
+	int inputRingCount = 0;
+	int inputOverflows = 0;
+	bool inputBuffered = false;
+	bool coalesceInputMoves = false;
+	JsValueRef inputBufferFunction;
+	JsValueRef inputDeliveryBuffer;
+
+	void pushInput(int type, int source, int a, int b = 0, int c = 0, int d = 0, float value = 0) {
+		inputMutex.lock();
+		if (coalesceInputMoves && (type == InputMouseMove || type == InputPenMove) && inputRingCount > 0) {
+			InputEvent& last = inputRing[(inputRingStart + inputRingCount - 1) % inputRingSize];
+			if (last.type == type && last.source == source) {
+				last.data[0] = a;
+				last.data[1] = b;
+				last.data[2] += c;
+				last.data[3] += d;
+				last.value = value;
+				inputMutex.unlock();
+				return;
+			}
+		}
+		if (inputRingCount == inputRingSize) {
+			inputRingStart = (inputRingStart + 1) % inputRingSize;
+			--inputRingCount;
+			++inputOverflows;
+		}
+		InputEvent& event = inputRing[(inputRingStart + inputRingCount) % inputRingSize];
+		event.type = type;
+		event.source = source;
+		event.data[0] = a;
+		event.data[1] = b;
+		event.data[2] = c;
+		event.data[3] = d;
+		event.value = value;
+		event.padding = 0;
+		++inputRingCount;
+		inputMutex.unlock();
+	}
+
+	// Runs with the JS context set.
+	void deliverInput() {
+		inputMutex.lock();
+		int count = inputRingCount;
+		for (int i = 0; i < count; ++i) {
+			inputDelivery[i] = inputRing[(inputRingStart + i) % inputRingSize];
+		}
+		inputRingStart = 0;
+		inputRingCount = 0;
+		if (inputOverflows > 0) {
+			sendLogMessage("Input buffer overflow, %i events dropped.", inputOverflows);
+			inputOverflows = 0;
+		}
+		inputMutex.unlock();
+
+		if (count == 0) return;
+		JsValueRef args[3];
+		JsGetUndefinedValue(&args[0]);
+		args[1] = inputDeliveryBuffer;
+		JsIntToNumber(count, &args[2]);
+		JsValueRef result;
+		JsCallFunction(inputBufferFunction, args, 3, &result);
+	}
+
+	JsValueRef CALLBACK krom_set_input_buffer_callback(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueType type;
+		JsGetValueType(arguments[1], &type);
+		if (type != JsFunction) {
+			inputBuffered = false;
+			return JS_INVALID_REFERENCE;
+		}
+		inputBufferFunction = arguments[1];
+		JsAddRef(inputBufferFunction, nullptr);
+		coalesceInputMoves = false;
+		if (argumentCount > 2) JsBooleanToBool(arguments[2], &coalesceInputMoves);
+		if (inputDeliveryBuffer == JS_INVALID_REFERENCE) {
+			JsCreateExternalArrayBuffer(inputDelivery, sizeof(inputDelivery), nullptr, nullptr, &inputDeliveryBuffer);
+			JsAddRef(inputDeliveryBuffer, nullptr);
+		}
+		inputBuffered = true;
+		return JS_INVALID_REFERENCE;
+	}
+
 	JsValueRef CALLBACK krom_set_keyboard_down_callback(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		keyboardDownFunction = arguments[1];
 		JsAddRef(keyboardDownFunction, nullptr);
@@ -450,11 +618,44 @@ namespace {
 		return JS_INVALID_REFERENCE;
 	}
 
+	// Resources whose JS object was garbage collected are deleted in update()
+	// after Graphics4::end(), so a collection during a frame never frees
+	// something that is still bound. Explicit deletes clear the external data,
+	// which turns the finalizer into a no-op.
+	enum ResourceType {
+		ResourceIndexBuffer,
+		ResourceVertexBuffer,
+		ResourceShader,
+		ResourcePipeline,
+		ResourceTexture,
+		ResourceRenderTarget,
+		ResourceComputeShader
+	};
+
+	struct QueuedDeletion {
+		ResourceType type;
+		void* resource;
+	};
+
+	std::vector<QueuedDeletion> deletionQueue;
+
+	void deleteLater(ResourceType type, void* resource) {
+		if (resource == nullptr) return;
+		QueuedDeletion deletion;
+		deletion.type = type;
+		deletion.resource = resource;
+		deletionQueue.push_back(deletion);
+	}
+
+	template<ResourceType type> void CALLBACK finalizeResource(void* data) {
+		deleteLater(type, data);
+	}
+
 	JsValueRef CALLBACK krom_create_indexbuffer(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		int count;
 		JsNumberToInt(arguments[1], &count);
 		JsValueRef ib;
-		JsCreateExternalObject(new Kore::Graphics4::IndexBuffer(count), nullptr, &ib);
+		JsCreateExternalObject(new Kore::Graphics4::IndexBuffer(count), finalizeResource<ResourceIndexBuffer>, &ib);
 		return ib;
 	}
 
@@ -462,6 +663,7 @@ namespace {
 		Kore::Graphics4::IndexBuffer* buffer;
 		JsGetExternalData(arguments[1], (void**)&buffer);
 		delete buffer;
+		JsSetExternalData(arguments[1], nullptr);
 		return JS_INVALID_REFERENCE;
 	}
 
@@ -512,7 +714,7 @@ namespace {
 
 	JsValueRef CALLBACK krom_create_vertexbuffer(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		JsValueRef lengthObj;
-		JsGetProperty(arguments[2], getId("length"), &lengthObj);
+		JsGetProperty(arguments[2], ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 
@@ -525,13 +727,13 @@ namespace {
 			JsIntToNumber(i, &index);
 			JsGetIndexedProperty(arguments[2], index, &element);
 			JsValueRef str;
-			JsGetProperty(element, getId("name"), &str);
+			JsGetProperty(element, ids[name_id], &str);
 			char* name = new char[256]; // TODO
 			size_t strLength;
 			JsCopyString(str, name, 255, &strLength);
 			name[strLength] = 0;
 			JsValueRef dataObj;
-			JsGetProperty(element, getId("data"), &dataObj);
+			JsGetProperty(element, ids[data_id], &dataObj);
 			int data;
 			JsNumberToInt(dataObj, &data);
 			structure.add(name, convertVertexData(data));
@@ -543,7 +745,7 @@ namespace {
 		JsNumberToInt(arguments[4], &value4);
 		Kore::Graphics4::VertexBuffer* buffer = new Kore::Graphics4::VertexBuffer(value1, structure, (Kore::Graphics4::Usage)value3, value4);
 		JsValueRef obj;
-		JsCreateExternalObject(buffer, nullptr, &obj);
+		JsCreateExternalObject(buffer, finalizeResource<ResourceVertexBuffer>, &obj);
 		return obj;
 	}
 
@@ -551,6 +753,7 @@ namespace {
 		Kore::Graphics4::VertexBuffer* buffer;
 		JsGetExternalData(arguments[1], (void**)&buffer);
 		delete buffer;
+		JsSetExternalData(arguments[1], nullptr);
 		return JS_INVALID_REFERENCE;
 	}
 
@@ -582,14 +785,14 @@ namespace {
 	JsValueRef CALLBACK krom_set_vertexbuffers(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		Kore::Graphics4::VertexBuffer* vertexBuffers[8] = { nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
 		JsValueRef lengthObj;
-		JsGetProperty(arguments[1], getId("length"), &lengthObj);
+		JsGetProperty(arguments[1], ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 		for (int i = 0; i < length; ++i) {
 			JsValueRef index, obj, bufObj;
 			JsIntToNumber(i, &index);
 			JsGetIndexedProperty(arguments[1], index, &obj);
-			JsGetProperty(obj, getId("buffer"), &bufObj);
+			JsGetProperty(obj, ids[buffer_id], &bufObj);
 			Kore::Graphics4::VertexBuffer* buffer;
 			JsGetExternalData(bufObj, (void**)&buffer);
 			vertexBuffers[i] = buffer;
@@ -617,6 +820,73 @@ namespace {
 		return JS_INVALID_REFERENCE;
 	}
 
+	bool pipelineManifest = true;
+	bool resetPipelineManifest = false;
+
+	// Shader bytes are only kept until they are written to the pipeline
+	// manifest or the last shader object using them is deleted.
+	struct ShaderSource {
+		Kore::Graphics4::ShaderType type;
+		bool fromSource;
+		int shaders;
+		std::vector<Kore::u8> data;
+	};
+
+	std::map<Kore::Graphics4::Shader*, Kore::u64> shaderHashes;
+	std::map<Kore::u64, ShaderSource*> shaderSources;
+	std::map<Kore::u64, Kore::Graphics4::Shader*> warmShaders;
+	std::map<Kore::u64, bool> manifestShaders;
+
+	void releaseShaderSource(Kore::u64 hash) {
+		std::map<Kore::u64, ShaderSource*>::iterator source = shaderSources.find(hash);
+		if (source == shaderSources.end() || --source->second->shaders > 0) return;
+		delete source->second;
+		shaderSources.erase(source);
+	}
+
+	// Pipelines are cached by shader contents, so a cache hit can hand out a
+	// pipeline that was compiled from other shader objects. Shaders are
+	// therefore referenced by their JS object and by every cached pipeline
+	// using them, and only deleted when the last reference is gone.
+	std::map<Kore::Graphics4::Shader*, int> shaderReferences;
+
+	void retainShader(Kore::Graphics4::Shader* shader) {
+		if (shader != nullptr) ++shaderReferences[shader];
+	}
+
+	void releaseShader(Kore::Graphics4::Shader* shader) {
+		if (shader == nullptr) return;
+		std::map<Kore::Graphics4::Shader*, int>::iterator it = shaderReferences.find(shader);
+		if (it != shaderReferences.end() && --it->second > 0) return;
+		if (it != shaderReferences.end()) shaderReferences.erase(it);
+		std::map<Kore::Graphics4::Shader*, Kore::u64>::iterator hash = shaderHashes.find(shader);
+		if (hash != shaderHashes.end()) {
+			std::map<Kore::u64, Kore::Graphics4::Shader*>::iterator warm = warmShaders.find(hash->second);
+			if (warm != warmShaders.end() && warm->second == shader) warmShaders.erase(warm);
+			else releaseShaderSource(hash->second);
+			shaderHashes.erase(hash);
+		}
+		delete shader;
+	}
+
+	void registerShader(Kore::Graphics4::Shader* shader, Kore::Graphics4::ShaderType type, Kore::u8* data, unsigned length, bool fromSource) {
+		Kore::u64 hash = hashBytes(data, length, hashValue((int)type, hashSeed));
+		shaderHashes[shader] = hash;
+		shaderReferences[shader] = 1;
+		if (!pipelineManifest || manifestShaders[hash]) return;
+		std::map<Kore::u64, ShaderSource*>::iterator it = shaderSources.find(hash);
+		if (it != shaderSources.end()) {
+			++it->second->shaders;
+			return;
+		}
+		ShaderSource* source = new ShaderSource;
+		source->type = type;
+		source->fromSource = fromSource;
+		source->shaders = 1;
+		source->data.assign(data, data + length);
+		shaderSources[hash] = source;
+	}
+
 	std::string replace(std::string str, char a, char b) {
 		for (size_t i = 0; i < str.size(); ++i) {
 			if (str[i] == a) str[i] = b;
@@ -629,10 +899,11 @@ namespace {
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &content, &bufferLength);
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(content, (int)bufferLength, Kore::Graphics4::VertexShader);
+		registerShader(shader, Kore::Graphics4::VertexShader, content, bufferLength, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
-		JsSetProperty(value, getId("name"), arguments[2], false);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
+		JsSetProperty(value, ids[name_id], arguments[2], false);
 		return value;
 	}
 
@@ -641,12 +912,13 @@ namespace {
 		JsCopyString(arguments[1], tempStringVS, tempStringSize, &length);
 		tempStringVS[length] = 0;
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(tempStringVS, Kore::Graphics4::VertexShader);
+		registerShader(shader, Kore::Graphics4::VertexShader, (Kore::u8*)tempStringVS, (unsigned)length, true);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
 		JsValueRef string;
 		JsCreateString("", 0, &string);
-		JsSetProperty(value, getId("name"), string, false);
+		JsSetProperty(value, ids[name_id], string, false);
 		return value;
 	}
 
@@ -655,10 +927,11 @@ namespace {
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &content, &bufferLength);
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(content, (int)bufferLength, Kore::Graphics4::FragmentShader);
+		registerShader(shader, Kore::Graphics4::FragmentShader, content, bufferLength, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
-		JsSetProperty(value, getId("name"), arguments[2], false);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
+		JsSetProperty(value, ids[name_id], arguments[2], false);
 		return value;
 	}
 
@@ -667,12 +940,13 @@ namespace {
 		JsCopyString(arguments[1], tempStringFS, tempStringSize, &length);
 		tempStringFS[length] = 0;
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(tempStringFS, Kore::Graphics4::FragmentShader);
+		registerShader(shader, Kore::Graphics4::FragmentShader, (Kore::u8*)tempStringFS, (unsigned)length, true);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
 		JsValueRef string;
 		JsCreateString("", 0, &string);
-		JsSetProperty(value, getId("name"), string, false);
+		JsSetProperty(value, ids[name_id], string, false);
 		return value;
 	}
 
@@ -681,10 +955,11 @@ namespace {
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &content, &bufferLength);
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(content, (int)bufferLength, Kore::Graphics4::GeometryShader);
+		registerShader(shader, Kore::Graphics4::GeometryShader, content, bufferLength, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
-		JsSetProperty(value, getId("name"), arguments[2], false);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
+		JsSetProperty(value, ids[name_id], arguments[2], false);
 		return value;
 	}
 
@@ -693,10 +968,11 @@ namespace {
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &content, &bufferLength);
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(content, (int)bufferLength, Kore::Graphics4::TessellationControlShader);
+		registerShader(shader, Kore::Graphics4::TessellationControlShader, content, bufferLength, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
-		JsSetProperty(value, getId("name"), arguments[2], false);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
+		JsSetProperty(value, ids[name_id], arguments[2], false);
 		return value;
 	}
 
@@ -705,34 +981,670 @@ namespace {
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &content, &bufferLength);
 		Kore::Graphics4::Shader* shader = new Kore::Graphics4::Shader(content, (int)bufferLength, Kore::Graphics4::TessellationEvaluationShader);
+		registerShader(shader, Kore::Graphics4::TessellationEvaluationShader, content, bufferLength, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
-		JsSetProperty(value, getId("name"), arguments[2], false);
+		JsCreateExternalObject(shader, finalizeResource<ResourceShader>, &value);
+		JsSetProperty(value, ids[name_id], arguments[2], false);
 		return value;
 	}
 
+	HandleTable<Kore::Graphics4::ConstantLocation> constantLocations;
+	HandleTable<Kore::Graphics4::TextureUnit> textureUnits;
+	HandleTable<Kore::ComputeConstantLocation> computeConstantLocations;
+	HandleTable<Kore::ComputeTextureUnit> computeTextureUnits;
+
+	template<typename T> T* getHandle(HandleTable<T>& table, JsValueRef value) {
+		double handle = -1;
+		JsNumberToDouble(value, &handle);
+		T* resource = table.get(handle);
+#ifndef NDEBUG
+		if (resource == nullptr) sendLogMessage("Invalid or stale handle %.0f.", handle);
+#endif
+		return resource;
+	}
+
+	void releasePipelineHandles(Kore::Graphics4::PipelineState* pipeline) {
+		constantLocations.removeOwned(pipeline);
+		textureUnits.removeOwned(pipeline);
+	}
+
+	// Compiled pipelines are shared between all pipeline objects with identical
+	// shaders, vertex layouts and render state. Entries stay alive after their
+	// last pipeline object is deleted so recreated pipelines (for example after a
+	// scene reload) do not compile again. Entries are evicted when one of their
+	// shaders is deleted, entries that were used and are unused again are freed
+	// after a minute. Warmed up entries stay until they are used.
+	struct CachedPipeline {
+		Kore::Graphics4::PipelineState* pipeline;
+		Kore::u64 key;
+		int references;
+		bool used;
+		bool evicted;
+		double unusedSince;
+	};
+
+	std::map<Kore::u64, CachedPipeline*> pipelineCache;
+	std::map<Kore::Graphics4::PipelineState*, CachedPipeline*> cachedPipelines;
+	int pipelineCacheHits = 0;
+	int pipelineCacheMisses = 0;
+
+	bool usesShader(Kore::Graphics4::PipelineState* pipeline, Kore::Graphics4::Shader* shader) {
+		return pipeline->vertexShader == shader || pipeline->fragmentShader == shader || pipeline->geometryShader == shader
+			|| pipeline->tessellationControlShader == shader || pipeline->tessellationEvaluationShader == shader;
+	}
+
+	void deleteCachedPipeline(CachedPipeline* cached) {
+		Kore::Graphics4::PipelineState* pipeline = cached->pipeline;
+		cachedPipelines.erase(pipeline);
+		releasePipelineHandles(pipeline);
+		Kore::Graphics4::Shader* shaders[5] = { pipeline->vertexShader, pipeline->fragmentShader, pipeline->geometryShader,
+			pipeline->tessellationControlShader, pipeline->tessellationEvaluationShader };
+		delete pipeline;
+		delete cached;
+		for (int i = 0; i < 5; ++i) {
+			releaseShader(shaders[i]);
+		}
+	}
+
+	// Returns false if the pipeline is not owned by the cache.
+	bool releaseCachedPipeline(Kore::Graphics4::PipelineState* pipeline) {
+		std::map<Kore::Graphics4::PipelineState*, CachedPipeline*>::iterator it = cachedPipelines.find(pipeline);
+		if (it == cachedPipelines.end()) return false;
+		CachedPipeline* cached = it->second;
+		--cached->references;
+		if (cached->references <= 0 && cached->evicted) {
+			deleteCachedPipeline(cached);
+		}
+		else if (cached->references <= 0) {
+			cached->unusedSince = Kore::System::time();
+		}
+		return true;
+	}
+
+	void evictCachedPipelines(Kore::Graphics4::Shader* shader) {
+		std::map<Kore::u64, CachedPipeline*>::iterator it = pipelineCache.begin();
+		while (it != pipelineCache.end()) {
+			CachedPipeline* cached = it->second;
+			if (usesShader(cached->pipeline, shader)) {
+				pipelineCache.erase(it++);
+				cached->evicted = true;
+				if (cached->references <= 0) {
+					deleteCachedPipeline(cached);
+				}
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	// Pipelines of other shader objects can still use the shader, so this
+	// only drops the reference of its JS object.
+	void deleteShader(Kore::Graphics4::Shader* shader) {
+		evictCachedPipelines(shader);
+		releaseShader(shader);
+	}
+
+	const double unusedPipelineSeconds = 60;
+	double lastPipelineSweep = 0;
+
+	void freeUnusedPipelines() {
+		double now = Kore::System::time();
+		if (now - lastPipelineSweep < 1) return;
+		lastPipelineSweep = now;
+		std::map<Kore::u64, CachedPipeline*>::iterator it = pipelineCache.begin();
+		while (it != pipelineCache.end()) {
+			CachedPipeline* cached = it->second;
+			if (cached->used && cached->references <= 0 && now - cached->unusedSince > unusedPipelineSeconds) {
+				pipelineCache.erase(it++);
+				deleteCachedPipeline(cached);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	void deletePipeline(Kore::Graphics4::PipelineState* pipeline) {
+		if (!releaseCachedPipeline(pipeline)) {
+			releasePipelineHandles(pipeline);
+			delete pipeline;
+		}
+	}
+
+	void deleteComputeShader(Kore::ComputeShader* shader) {
+		computeConstantLocations.removeOwned(shader);
+		computeTextureUnits.removeOwned(shader);
+		delete shader;
+	}
+
+	void deleteQueuedResources() {
+		for (size_t i = 0; i < deletionQueue.size(); ++i) {
+			void* resource = deletionQueue[i].resource;
+			switch (deletionQueue[i].type) {
+			case ResourceIndexBuffer:
+				delete (Kore::Graphics4::IndexBuffer*)resource;
+				break;
+			case ResourceVertexBuffer:
+				delete (Kore::Graphics4::VertexBuffer*)resource;
+				break;
+			case ResourceShader:
+				deleteShader((Kore::Graphics4::Shader*)resource);
+				break;
+			case ResourcePipeline:
+				deletePipeline((Kore::Graphics4::PipelineState*)resource);
+				break;
+			case ResourceTexture:
+				delete (Kore::Graphics4::Texture*)resource;
+				break;
+			case ResourceRenderTarget:
+				delete (Kore::Graphics4::RenderTarget*)resource;
+				break;
+			case ResourceComputeShader:
+				deleteComputeShader((Kore::ComputeShader*)resource);
+				break;
+			}
+		}
+		deletionQueue.clear();
+	}
+
+	Kore::u64 shaderHash(Kore::Graphics4::Shader* shader) {
+		if (shader == nullptr) return 0;
+		std::map<Kore::Graphics4::Shader*, Kore::u64>::iterator it = shaderHashes.find(shader);
+		return it == shaderHashes.end() ? (Kore::u64)(size_t)shader : it->second;
+	}
+
+	const int pipelineStateSize = 47;
+
+	void getPipelineState(Kore::Graphics4::PipelineState* pipeline, int* state) {
+		state[0] = pipeline->cullMode;
+		state[1] = pipeline->depthWrite;
+		state[2] = pipeline->depthMode;
+		state[3] = pipeline->stencilMode;
+		state[4] = pipeline->stencilBothPass;
+		state[5] = pipeline->stencilDepthFail;
+		state[6] = pipeline->stencilFail;
+		state[7] = pipeline->stencilReferenceValue;
+		state[8] = pipeline->stencilReadMask;
+		state[9] = pipeline->stencilWriteMask;
+		state[10] = pipeline->blendSource;
+		state[11] = pipeline->blendDestination;
+		state[12] = pipeline->alphaBlendSource;
+		state[13] = pipeline->alphaBlendDestination;
+		for (int i = 0; i < 8; ++i) {
+			state[14 + i * 4 + 0] = pipeline->colorWriteMaskRed[i];
+			state[14 + i * 4 + 1] = pipeline->colorWriteMaskGreen[i];
+			state[14 + i * 4 + 2] = pipeline->colorWriteMaskBlue[i];
+			state[14 + i * 4 + 3] = pipeline->colorWriteMaskAlpha[i];
+		}
+		state[46] = pipeline->conservativeRasterization;
+	}
+
+	void setPipelineState(Kore::Graphics4::PipelineState* pipeline, const int* state) {
+		pipeline->cullMode = (Kore::Graphics4::CullMode)state[0];
+		pipeline->depthWrite = state[1] != 0;
+		pipeline->depthMode = (Kore::Graphics4::ZCompareMode)state[2];
+		pipeline->stencilMode = (Kore::Graphics4::ZCompareMode)state[3];
+		pipeline->stencilBothPass = (Kore::Graphics4::StencilAction)state[4];
+		pipeline->stencilDepthFail = (Kore::Graphics4::StencilAction)state[5];
+		pipeline->stencilFail = (Kore::Graphics4::StencilAction)state[6];
+		pipeline->stencilReferenceValue = state[7];
+		pipeline->stencilReadMask = state[8];
+		pipeline->stencilWriteMask = state[9];
+		pipeline->blendSource = (Kore::Graphics4::BlendingOperation)state[10];
+		pipeline->blendDestination = (Kore::Graphics4::BlendingOperation)state[11];
+		pipeline->alphaBlendSource = (Kore::Graphics4::BlendingOperation)state[12];
+		pipeline->alphaBlendDestination = (Kore::Graphics4::BlendingOperation)state[13];
+		for (int i = 0; i < 8; ++i) {
+			pipeline->colorWriteMaskRed[i] = state[14 + i * 4 + 0] != 0;
+			pipeline->colorWriteMaskGreen[i] = state[14 + i * 4 + 1] != 0;
+			pipeline->colorWriteMaskBlue[i] = state[14 + i * 4 + 2] != 0;
+			pipeline->colorWriteMaskAlpha[i] = state[14 + i * 4 + 3] != 0;
+		}
+		pipeline->conservativeRasterization = state[46] != 0;
+	}
+
+	Kore::u64 pipelineKey(Kore::Graphics4::PipelineState* pipeline, Kore::u64 layoutHash) {
+		int state[pipelineStateSize];
+		getPipelineState(pipeline, state);
+		Kore::u64 key = hashBytes(state, sizeof(state), layoutHash);
+		key = hashValue(shaderHash(pipeline->vertexShader), key);
+		key = hashValue(shaderHash(pipeline->fragmentShader), key);
+		key = hashValue(shaderHash(pipeline->geometryShader), key);
+		key = hashValue(shaderHash(pipeline->tessellationControlShader), key);
+		key = hashValue(shaderHash(pipeline->tessellationEvaluationShader), key);
+		return key;
+	}
+
+	CachedPipeline* addCachedPipeline(Kore::Graphics4::PipelineState* pipeline, Kore::u64 key, int references) {
+		CachedPipeline* entry = new CachedPipeline;
+		entry->pipeline = pipeline;
+		entry->key = key;
+		entry->references = references;
+		entry->used = references > 0;
+		entry->evicted = false;
+		entry->unusedSince = Kore::System::time();
+		pipelineCache[key] = entry;
+		cachedPipelines[pipeline] = entry;
+		retainShader(pipeline->vertexShader);
+		retainShader(pipeline->fragmentShader);
+		retainShader(pipeline->geometryShader);
+		retainShader(pipeline->tessellationControlShader);
+		retainShader(pipeline->tessellationEvaluationShader);
+		return entry;
+	}
+
+	template<typename T> void appendValue(std::vector<Kore::u8>& buffer, T value) {
+		Kore::u8* bytes = (Kore::u8*)&value;
+		buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+	}
+
+	// The pipeline manifest in the save path records every pipeline compiled in
+	// a session, together with the shaders it uses, so the next session can
+	// compile them into the pipeline cache before the first frame. It is an
+	// append-only sequence of shader and pipeline records following a header
+	// with the number of the session that wrote it. Pipeline records end with
+	// the number of the last session that used them.
+	const Kore::u32 pipelineManifestMagic = 0x4d50524b; // KRPM
+	const Kore::u32 pipelineManifestVersion = 2;
+	const Kore::u8 manifestShaderRecord = 'S';
+	const Kore::u8 manifestPipelineRecord = 'P';
+	const Kore::u32 manifestSessions = 8;
+
+	FILE* pipelineManifestFile = nullptr;
+	Kore::u32 manifestSession = 1;
+	std::map<Kore::u64, bool> manifestPipelines;
+	std::map<Kore::u64, bool> sessionPipelines;
+
+	std::string pipelineManifestPath() {
+		return std::string(Kore::System::savePath()) + "pipelines.manifest";
+	}
+
+	Kore::u64 pipelineShader(Kore::Graphics4::PipelineState* pipeline, int stage) {
+		switch (stage) {
+		case 0:
+			return shaderHash(pipeline->vertexShader);
+		case 1:
+			return shaderHash(pipeline->fragmentShader);
+		case 2:
+			return shaderHash(pipeline->geometryShader);
+		case 3:
+			return shaderHash(pipeline->tessellationControlShader);
+		case 4:
+			return shaderHash(pipeline->tessellationEvaluationShader);
+		}
+		return 0;
+	}
+
+	void recordPipeline(Kore::Graphics4::PipelineState* pipeline, Kore::u64 key, const std::vector<Kore::u8>& layout) {
+		if (pipelineManifestFile == nullptr || manifestPipelines[key]) return;
+
+		std::vector<Kore::u8> record;
+		Kore::u64 shaders[5];
+		for (int i = 0; i < 5; ++i) {
+			shaders[i] = pipelineShader(pipeline, i);
+			if (shaders[i] == 0 || manifestShaders[shaders[i]]) continue;
+			std::map<Kore::u64, ShaderSource*>::iterator source = shaderSources.find(shaders[i]);
+			if (source == shaderSources.end()) return; // Hot reloaded shaders are not recorded
+			appendValue(record, manifestShaderRecord);
+			appendValue(record, shaders[i]);
+			appendValue(record, (int)source->second->type);
+			appendValue(record, (Kore::u8)source->second->fromSource);
+			appendValue(record, (Kore::u32)source->second->data.size());
+			record.insert(record.end(), source->second->data.begin(), source->second->data.end());
+		}
+
+		appendValue(record, manifestPipelineRecord);
+		appendValue(record, key);
+		for (int i = 0; i < 5; ++i) {
+			appendValue(record, shaders[i]);
+		}
+		appendValue(record, (Kore::u32)layout.size());
+		record.insert(record.end(), layout.begin(), layout.end());
+		int state[pipelineStateSize];
+		getPipelineState(pipeline, state);
+		for (int i = 0; i < pipelineStateSize; ++i) {
+			appendValue(record, state[i]);
+		}
+		appendValue(record, manifestSession);
+
+		fwrite(record.data(), 1, record.size(), pipelineManifestFile);
+		fflush(pipelineManifestFile);
+		for (int i = 0; i < 5; ++i) {
+			if (shaders[i] == 0 || manifestShaders[shaders[i]]) continue;
+			manifestShaders[shaders[i]] = true;
+			std::map<Kore::u64, ShaderSource*>::iterator source = shaderSources.find(shaders[i]);
+			delete source->second;
+			shaderSources.erase(source);
+		}
+		manifestPipelines[key] = true;
+	}
+
+	struct ManifestReader {
+		const Kore::u8* data;
+		size_t size;
+		size_t position;
+
+		bool read(void* value, size_t length) {
+			if (position + length > size) return false;
+			memcpy(value, &data[position], length);
+			position += length;
+			return true;
+		}
+	};
+
+	Kore::Graphics4::Shader* warmShader(Kore::u64 hash) {
+		if (hash == 0) return nullptr;
+		std::map<Kore::u64, Kore::Graphics4::Shader*>::iterator it = warmShaders.find(hash);
+		if (it != warmShaders.end()) return it->second;
+		std::map<Kore::u64, ShaderSource*>::iterator source = shaderSources.find(hash);
+		if (source == shaderSources.end()) return nullptr;
+		Kore::Graphics4::Shader* shader;
+		if (source->second->fromSource) {
+			std::string text(source->second->data.begin(), source->second->data.end());
+			shader = new Kore::Graphics4::Shader(text.c_str(), source->second->type);
+		}
+		else {
+			shader = new Kore::Graphics4::Shader(source->second->data.data(), (int)source->second->data.size(), source->second->type);
+		}
+		shaderHashes[shader] = hash;
+		shaderReferences[shader] = 0;
+		warmShaders[hash] = shader;
+		return shader;
+	}
+
+	// Kore only reads the layout while compiling, so readLayout's structures
+	// are freed again right after.
+	void deleteLayout(Kore::Graphics4::PipelineState* pipeline) {
+		for (int i1 = 0; i1 < 4 && pipeline->inputLayout[i1] != nullptr; ++i1) {
+			Kore::Graphics4::VertexStructure* structure = pipeline->inputLayout[i1];
+			for (int i2 = 0; i2 < structure->size; ++i2) {
+				delete[] structure->elements[i2].name;
+			}
+			delete structure;
+			pipeline->inputLayout[i1] = nullptr;
+		}
+	}
+
+	bool readLayout(ManifestReader& reader, Kore::Graphics4::PipelineState* pipeline) {
+		pipeline->inputLayout[0] = nullptr;
+		int size;
+		if (!reader.read(&size, sizeof(size)) || size < 0 || size > 4) return false;
+		for (int i1 = 0; i1 < size; ++i1) {
+			Kore::u8 instanced;
+			int length;
+			if (!reader.read(&instanced, sizeof(instanced)) || !reader.read(&length, sizeof(length)) || length < 0 || length > 16) return false;
+			Kore::Graphics4::VertexStructure* structure = new Kore::Graphics4::VertexStructure;
+			structure->instanced = instanced != 0;
+			pipeline->inputLayout[i1] = structure;
+			pipeline->inputLayout[i1 + 1] = nullptr;
+			for (int i2 = 0; i2 < length; ++i2) {
+				int data, nameLength;
+				char name[256];
+				if (!reader.read(&data, sizeof(data)) || !reader.read(&nameLength, sizeof(nameLength)) || nameLength < 0 || nameLength > 255
+					|| !reader.read(name, nameLength)) return false;
+				char* copy = new char[nameLength + 1];
+				memcpy(copy, name, nameLength);
+				copy[nameLength] = 0;
+				structure->add(copy, convertVertexData(data));
+			}
+		}
+		return true;
+	}
+
+	bool readManifestRecord(ManifestReader& reader) {
+		Kore::u8 type;
+		if (!reader.read(&type, sizeof(type))) return false;
+		if (type == manifestShaderRecord) {
+			Kore::u64 hash;
+			int shaderType;
+			Kore::u8 fromSource;
+			Kore::u32 length;
+			if (!reader.read(&hash, sizeof(hash)) || !reader.read(&shaderType, sizeof(shaderType)) || !reader.read(&fromSource, sizeof(fromSource))
+				|| !reader.read(&length, sizeof(length)) || reader.position + length > reader.size) return false;
+			if (shaderSources.find(hash) == shaderSources.end()) {
+				ShaderSource* source = new ShaderSource;
+				source->type = (Kore::Graphics4::ShaderType)shaderType;
+				source->fromSource = fromSource != 0;
+				source->data.assign(&reader.data[reader.position], &reader.data[reader.position + length]);
+				shaderSources[hash] = source;
+			}
+			reader.position += length;
+			manifestShaders[hash] = true;
+			return true;
+		}
+		else if (type == manifestPipelineRecord) {
+			Kore::u64 key;
+			Kore::u64 shaders[5];
+			Kore::u32 layoutLength;
+			int state[pipelineStateSize];
+			Kore::u32 lastSession;
+			if (!reader.read(&key, sizeof(key)) || !reader.read(shaders, sizeof(shaders)) || !reader.read(&layoutLength, sizeof(layoutLength))
+				|| reader.position + layoutLength > reader.size) return false;
+			ManifestReader layoutReader;
+			layoutReader.data = &reader.data[reader.position];
+			layoutReader.size = layoutLength;
+			layoutReader.position = 0;
+			reader.position += layoutLength;
+			if (!reader.read(state, sizeof(state)) || !reader.read(&lastSession, sizeof(lastSession))) return false;
+
+			if (manifestPipelines[key]) return true;
+			manifestPipelines[key] = true;
+
+			Kore::Graphics4::PipelineState* pipeline = new Kore::Graphics4::PipelineState;
+			pipeline->vertexShader = warmShader(shaders[0]);
+			pipeline->fragmentShader = warmShader(shaders[1]);
+			pipeline->geometryShader = warmShader(shaders[2]);
+			pipeline->tessellationControlShader = warmShader(shaders[3]);
+			pipeline->tessellationEvaluationShader = warmShader(shaders[4]);
+			bool shadersFound = pipeline->vertexShader != nullptr && pipeline->fragmentShader != nullptr;
+			if (!shadersFound || !readLayout(layoutReader, pipeline)) {
+				Kore::Graphics4::Shader* shaders[5] = { pipeline->vertexShader, pipeline->fragmentShader, pipeline->geometryShader,
+					pipeline->tessellationControlShader, pipeline->tessellationEvaluationShader };
+				if (shadersFound) deleteLayout(pipeline);
+				delete pipeline;
+				for (int i = 0; i < 5; ++i) {
+					// Warm shaders no cached pipeline uses yet
+					if (shaders[i] != nullptr && shaderReferences[shaders[i]] == 0) releaseShader(shaders[i]);
+				}
+				return true;
+			}
+			setPipelineState(pipeline, state);
+			pipeline->compile();
+			deleteLayout(pipeline);
+			addCachedPipeline(pipeline, pipelineKey(pipeline, hashBytes(layoutReader.data, layoutReader.size)), 0);
+			return true;
+		}
+		return false;
+	}
+
+	// Returns false if the file is missing or has an unknown header. reader
+	// is positioned at the first record, session is the session that wrote
+	// the header.
+	bool openManifest(const std::string& path, std::vector<Kore::u8>& data, ManifestReader& reader, Kore::u32& session) {
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == nullptr) return false;
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		data.resize(size > 0 ? size : 0);
+		if (size > 0 && fread(data.data(), 1, size, file) != (size_t)size) data.clear();
+		fclose(file);
+
+		reader.data = data.data();
+		reader.size = data.size();
+		reader.position = 0;
+		Kore::u32 magic, version;
+		return reader.read(&magic, sizeof(magic)) && reader.read(&version, sizeof(version)) && magic == pipelineManifestMagic && version == pipelineManifestVersion
+			&& reader.read(&session, sizeof(session));
+	}
+
+	void warmupPipelines() {
+		if (!pipelineManifest) return;
+		std::string path = pipelineManifestPath();
+
+		bool valid = false;
+		if (!resetPipelineManifest) {
+			std::vector<Kore::u8> data;
+			ManifestReader reader;
+			Kore::u32 session;
+			if (openManifest(path, data, reader, session)) {
+				valid = true;
+				manifestSession = session + 1;
+				double start = Kore::System::time();
+				size_t end = reader.position;
+				while (readManifestRecord(reader)) {
+					end = reader.position;
+				}
+				sendLogMessage("Precompiled %i pipelines in %f seconds.", (int)pipelineCache.size(), Kore::System::time() - start);
+
+				// Records appended after an unreadable one could never be read
+				if (end < data.size()) {
+					FILE* file = fopen(path.c_str(), "wb");
+					valid = file != nullptr && fwrite(data.data(), 1, end, file) == end;
+					if (file != nullptr) fclose(file);
+				}
+
+				// Shaders of the manifest are already on disk
+				std::map<Kore::u64, ShaderSource*>::iterator source = shaderSources.begin();
+				while (source != shaderSources.end()) {
+					if (manifestShaders[source->first]) {
+						delete source->second;
+						shaderSources.erase(source++);
+					}
+					else {
+						++source;
+					}
+				}
+			}
+		}
+
+		if (valid) {
+			pipelineManifestFile = fopen(path.c_str(), "ab");
+		}
+		else {
+			pipelineManifestFile = fopen(path.c_str(), "wb");
+			if (pipelineManifestFile != nullptr) {
+				fwrite(&pipelineManifestMagic, sizeof(pipelineManifestMagic), 1, pipelineManifestFile);
+				fwrite(&pipelineManifestVersion, sizeof(pipelineManifestVersion), 1, pipelineManifestFile);
+				fwrite(&manifestSession, sizeof(manifestSession), 1, pipelineManifestFile);
+				fflush(pipelineManifestFile);
+			}
+		}
+	}
+
+	// Skips the next record, returning its type, its hash or key and for
+	// pipelines the hashes of its shaders and the last session using it.
+	bool skipManifestRecord(ManifestReader& reader, Kore::u8& type, Kore::u64& hash, Kore::u64* shaders, Kore::u32& lastSession) {
+		if (!reader.read(&type, sizeof(type)) || !reader.read(&hash, sizeof(hash))) return false;
+		if (type == manifestShaderRecord) {
+			int shaderType;
+			Kore::u8 fromSource;
+			Kore::u32 length;
+			if (!reader.read(&shaderType, sizeof(shaderType)) || !reader.read(&fromSource, sizeof(fromSource)) || !reader.read(&length, sizeof(length))
+				|| reader.position + length > reader.size) return false;
+			reader.position += length;
+			return true;
+		}
+		else if (type == manifestPipelineRecord) {
+			Kore::u32 layoutLength;
+			if (!reader.read(shaders, sizeof(Kore::u64) * 5) || !reader.read(&layoutLength, sizeof(layoutLength))
+				|| reader.position + layoutLength + sizeof(int) * pipelineStateSize > reader.size) return false;
+			reader.position += layoutLength + sizeof(int) * pipelineStateSize;
+			return reader.read(&lastSession, sizeof(lastSession));
+		}
+		return false;
+	}
+
+	// The manifest is only appended to while running. At shutdown it is
+	// rewritten with the pipelines used in the last manifestSessions sessions
+	// and their shaders, so a short session does not drop the pipelines of
+	// the others while pipelines of older builds and content no longer used
+	// still age out.
+	void compactPipelineManifest() {
+		if (pipelineManifestFile == nullptr) return;
+		fclose(pipelineManifestFile);
+		pipelineManifestFile = nullptr;
+
+		std::string path = pipelineManifestPath();
+		std::vector<Kore::u8> data;
+		ManifestReader reader;
+		Kore::u32 session;
+		if (!openManifest(path, data, reader, session)) return;
+
+		std::map<Kore::u64, std::pair<size_t, size_t> > shaderRecords;
+		std::map<Kore::u64, bool> shadersWritten;
+		std::map<Kore::u64, bool> pipelinesWritten;
+		std::vector<Kore::u8> records;
+		for (;;) {
+			size_t start = reader.position;
+			Kore::u8 type;
+			Kore::u64 hash;
+			Kore::u64 shaders[5];
+			Kore::u32 lastSession = 0;
+			if (!skipManifestRecord(reader, type, hash, shaders, lastSession)) break;
+			if (type == manifestShaderRecord) {
+				shaderRecords[hash] = std::make_pair(start, reader.position);
+				continue;
+			}
+			if (sessionPipelines[hash]) lastSession = manifestSession;
+			if (pipelinesWritten[hash] || lastSession + manifestSessions <= manifestSession) continue;
+			pipelinesWritten[hash] = true;
+			bool complete = true;
+			for (int i = 0; i < 5; ++i) {
+				complete = complete && (shaders[i] == 0 || shaderRecords.find(shaders[i]) != shaderRecords.end());
+			}
+			if (!complete) continue;
+			for (int i = 0; i < 5; ++i) {
+				if (shaders[i] == 0 || shadersWritten[shaders[i]]) continue;
+				shadersWritten[shaders[i]] = true;
+				std::pair<size_t, size_t> range = shaderRecords[shaders[i]];
+				records.insert(records.end(), &data[range.first], &data[0] + range.second);
+			}
+			records.insert(records.end(), &data[start], &data[0] + reader.position - sizeof(lastSession));
+			appendValue(records, lastSession);
+		}
+
+		Kore::u32 header[3] = { pipelineManifestMagic, pipelineManifestVersion, manifestSession };
+		writeCacheFile(path, header, sizeof(header), records.data(), records.size());
+	}
+
 	JsValueRef CALLBACK krom_delete_shader(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		Kore::Graphics4::Shader* shader;
 		JsGetExternalData(arguments[1], (void**)&shader);
-		delete shader;
+		deleteShader(shader);
+		JsSetExternalData(arguments[1], nullptr);
 		return JS_INVALID_REFERENCE;
 	}
 
 	JsValueRef CALLBACK krom_create_pipeline(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		Kore::Graphics4::PipelineState* pipeline = new Kore::Graphics4::PipelineState;
 		JsValueRef pipelineObj;
-		JsCreateExternalObject(pipeline, nullptr, &pipelineObj);
+		JsCreateExternalObject(pipeline, finalizeResource<ResourcePipeline>, &pipelineObj);
 		return pipelineObj;
 	}
 
 	JsValueRef CALLBACK krom_delete_pipeline(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {		
 		Kore::Graphics4::PipelineState* pipeline;
 		JsGetExternalData(arguments[1], (void**)&pipeline);
-		delete pipeline;
+		deletePipeline(pipeline);
+		JsSetExternalData(arguments[1], nullptr);
 		return JS_INVALID_REFERENCE;
 	}
 
+	JsValueRef CALLBACK krom_get_pipeline_cache_stats(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef stats, hits, misses, size;
+		JsCreateObject(&stats);
+		JsIntToNumber(pipelineCacheHits, &hits);
+		JsIntToNumber(pipelineCacheMisses, &misses);
+		JsIntToNumber((int)pipelineCache.size(), &size);
+		JsSetProperty(stats, ids[hits_id], hits, false);
+		JsSetProperty(stats, ids[misses_id], misses, false);
+		JsSetProperty(stats, ids[size_id], size, false);
+		return stats;
+	}
+
 	void recompilePipeline(JsValueRef projobj) {
 		JsValueRef zero, one, two, three, four, five, six, seven;
 		JsIntToNumber(0, &zero);
@@ -811,12 +1723,12 @@ namespace {
 
 #define getPipeInt(name) JsValueRef name##Obj;\
 	int name;\
-	JsGetProperty(arguments[12], getId(#name), &name##Obj);\
+	JsGetProperty(arguments[12], ids[name##_id], &name##Obj);\
 	JsNumberToInt(name##Obj, &name)
 
 #define getPipeBool(name) JsValueRef name##Obj;\
 	bool name;\
-	JsGetProperty(arguments[12], getId(#name), &name##Obj);\
+	JsGetProperty(arguments[12], ids[name##_id], &name##Obj);\
 	JsBooleanToBool(name##Obj, &name)
 
 	JsValueRef CALLBACK krom_compile_pipeline(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
@@ -827,37 +1739,45 @@ namespace {
 
 		Kore::Graphics4::PipelineState* pipeline;
 		JsGetExternalData(progobj, (void**)&pipeline);
+		if (releaseCachedPipeline(pipeline)) {
+			pipeline = new Kore::Graphics4::PipelineState;
+			JsSetExternalData(progobj, pipeline);
+		}
 
 		Kore::Graphics4::VertexStructure s0, s1, s2, s3;
 		Kore::Graphics4::VertexStructure* structures[4] = { &s0, &s1, &s2, &s3 };
 
 		int size;
 		JsNumberToInt(arguments[6], &size);
+		std::vector<Kore::u8> layout;
+		appendValue(layout, size);
 		for (int i1 = 0; i1 < size; ++i1) {
 			JsValueRef jsstructure = arguments[i1 + 2];
 			
 			JsValueRef instancedObj;
-			JsGetProperty(jsstructure, getId("instanced"), &instancedObj);
+			JsGetProperty(jsstructure, ids[instanced_id], &instancedObj);
 			bool instanced;
 			JsBooleanToBool(instancedObj, &instanced);
 			structures[i1]->instanced = instanced;
+			appendValue(layout, (Kore::u8)instanced);
 
 			JsValueRef elementsObj;
-			JsGetProperty(jsstructure, getId("elements"), &elementsObj);
+			JsGetProperty(jsstructure, ids[elements_id], &elementsObj);
 
 			JsValueRef lengthObj;
-			JsGetProperty(elementsObj, getId("length"), &lengthObj);
+			JsGetProperty(elementsObj, ids[length_id], &lengthObj);
 			int length;
 			JsNumberToInt(lengthObj, &length);
+			appendValue(layout, length);
 			for (int i2 = 0; i2 < length; ++i2) {
 				JsValueRef index;
 				JsIntToNumber(i2, &index);
 				JsValueRef element;
 				JsGetIndexedProperty(elementsObj, index, &element);
 				JsValueRef str;
-				JsGetProperty(element, getId("name"), &str);
+				JsGetProperty(element, ids[name_id], &str);
 				JsValueRef dataObj;
-				JsGetProperty(element, getId("data"), &dataObj);
+				JsGetProperty(element, ids[data_id], &dataObj);
 				int data;
 				JsNumberToInt(dataObj, &data);
 				char* name = new char[256]; // TODO
@@ -865,6 +1785,9 @@ namespace {
 				JsCopyString(str, name, 255, &length);
 				name[length] = 0;
 				structures[i1]->add(name, convertVertexData(data));
+				appendValue(layout, data);
+				appendValue(layout, (int)length);
+				layout.insert(layout.end(), name, name + length);
 			}
 		}
 
@@ -888,8 +1811,8 @@ namespace {
 		JsCreateExternalObject(vertexShader, nullptr, &vsObj);
 		JsSetIndexedProperty(progobj, three, vsObj);
 		JsValueRef vsname;
-		JsGetProperty(arguments[7], getId("name"), &vsname);
-		JsSetProperty(progobj, getId("vsname"), vsname, false);
+		JsGetProperty(arguments[7], ids[name_id], &vsname);
+		JsSetProperty(progobj, ids[vsname_id], vsname, false);
 
 		Kore::Graphics4::Shader* fragmentShader;
 		JsGetExternalData(arguments[8], (void**)&fragmentShader);
@@ -897,8 +1820,8 @@ namespace {
 		JsCreateExternalObject(fragmentShader, nullptr, &fsObj);
 		JsSetIndexedProperty(progobj, four, fsObj);
 		JsValueRef fsname;
-		JsGetProperty(arguments[8], getId("name"), &fsname);
-		JsSetProperty(progobj, getId("fsname"), fsname, false);
+		JsGetProperty(arguments[8], ids[name_id], &fsname);
+		JsSetProperty(progobj, ids[fsname_id], fsname, false);
 
 		pipeline->vertexShader = vertexShader;
 		pipeline->fragmentShader = fragmentShader;
@@ -912,8 +1835,8 @@ namespace {
 			JsCreateExternalObject(geometryShader, nullptr, &gsObj);
 			JsSetIndexedProperty(progobj, five, gsObj);
 			JsValueRef gsname;
-			JsGetProperty(arguments[9], getId("name"), &gsname);
-			JsSetProperty(progobj, getId("gsname"), gsname, false);
+			JsGetProperty(arguments[9], ids[name_id], &gsname);
+			JsSetProperty(progobj, ids[gsname_id], gsname, false);
 			pipeline->geometryShader = geometryShader;
 		}
 
@@ -926,8 +1849,8 @@ namespace {
 			JsCreateExternalObject(tessellationControlShader, nullptr, &tcsObj);
 			JsSetIndexedProperty(progobj, six, tcsObj);
 			JsValueRef tcsname;
-			JsGetProperty(arguments[10], getId("name"), &tcsname);
-			JsSetProperty(progobj, getId("tcsname"), tcsname, false);
+			JsGetProperty(arguments[10], ids[name_id], &tcsname);
+			JsSetProperty(progobj, ids[tcsname_id], tcsname, false);
 			pipeline->tessellationControlShader = tessellationControlShader;
 		}
 
@@ -940,8 +1863,8 @@ namespace {
 			JsCreateExternalObject(tessellationEvaluationShader, nullptr, &tesObj);
 			JsSetIndexedProperty(progobj, seven, tesObj);
 			JsValueRef tesname;
-			JsGetProperty(arguments[11], getId("name"), &tesname);
-			JsSetProperty(progobj, getId("tesname"), tesname, false);
+			JsGetProperty(arguments[11], ids[name_id], &tesname);
+			JsSetProperty(progobj, ids[tesname_id], tesname, false);
 			pipeline->tessellationEvaluationShader = tessellationEvaluationShader;
 		}
 		
@@ -982,10 +1905,10 @@ namespace {
 		pipeline->alphaBlendDestination = (Kore::Graphics4::BlendingOperation)alphaBlendDestination;
 
 		JsValueRef maskRed, maskGreen, maskBlue, maskAlpha;
-		JsGetProperty(arguments[12], getId("colorWriteMaskRed"), &maskRed);
-		JsGetProperty(arguments[12], getId("colorWriteMaskGreen"), &maskGreen);
-		JsGetProperty(arguments[12], getId("colorWriteMaskBlue"), &maskBlue);
-		JsGetProperty(arguments[12], getId("colorWriteMaskAlpha"), &maskAlpha);
+		JsGetProperty(arguments[12], ids[colorWriteMaskRed_id], &maskRed);
+		JsGetProperty(arguments[12], ids[colorWriteMaskGreen_id], &maskGreen);
+		JsGetProperty(arguments[12], ids[colorWriteMaskBlue_id], &maskBlue);
+		JsGetProperty(arguments[12], ids[colorWriteMaskAlpha_id], &maskAlpha);
 
 		for (int i = 0; i < 8; ++i) {
 			bool b;
@@ -1012,29 +1935,44 @@ namespace {
 		getPipeBool(conservativeRasterization);
 		pipeline->conservativeRasterization = conservativeRasterization;
 
+		Kore::u64 key = pipelineKey(pipeline, hashBytes(layout.data(), layout.size()));
+		sessionPipelines[key] = true;
+		std::map<Kore::u64, CachedPipeline*>::iterator cached = pipelineCache.find(key);
+		if (cached != pipelineCache.end()) {
+			++pipelineCacheHits;
+			delete pipeline;
+			++cached->second->references;
+			cached->second->used = true;
+			JsSetExternalData(progobj, cached->second->pipeline);
+			return JS_INVALID_REFERENCE;
+		}
+
+		++pipelineCacheMisses;
 		pipeline->compile();
 
+		addCachedPipeline(pipeline, key, 1);
+		recordPipeline(pipeline, key, layout);
+
 		return JS_INVALID_REFERENCE;
 	}
 
 	std::string shadersdir;
 
-	JsValueRef CALLBACK krom_set_pipeline(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		JsValueRef progobj = arguments[1];
+	void setPipeline(JsValueRef progobj) {
 		Kore::Graphics4::PipelineState* pipeline;
 		JsGetExternalData(progobj, (void**)&pipeline);
 
 		if (debugMode) {
 			char vsname[256];
 			JsValueRef vsnameObj;
-			JsGetProperty(progobj, getId("vsname"), &vsnameObj);
+			JsGetProperty(progobj, ids[vsname_id], &vsnameObj);
 			size_t vslength;
 			JsCopyString(vsnameObj, vsname, 255, &vslength);
 			vsname[vslength] = 0;
 
 			char fsname[256];
 			JsValueRef fsnameObj;
-			JsGetProperty(progobj, getId("fsname"), &fsnameObj);
+			JsGetProperty(progobj, ids[fsname_id], &fsnameObj);
 			size_t fslength;
 			JsCopyString(fsnameObj, fsname, 255, &fslength);
 			fsname[fslength] = 0;
@@ -1072,7 +2010,7 @@ namespace {
 			}
 
 			JsValueRef gsnameObj;
-			JsGetProperty(progobj, getId("gsname"), &gsnameObj);
+			JsGetProperty(progobj, ids[gsname_id], &gsnameObj);
 			JsValueType gsnameType;
 			JsGetValueType(gsnameObj, &gsnameType);
 			if (gsnameType != JsNull && gsnameType != JsUndefined) {
@@ -1097,7 +2035,7 @@ namespace {
 			}
 
 			JsValueRef tcsnameObj;
-			JsGetProperty(progobj, getId("tcsname"), &tcsnameObj);
+			JsGetProperty(progobj, ids[tcsname_id], &tcsnameObj);
 			JsValueType tcsnameType;
 			JsGetValueType(tcsnameObj, &tcsnameType);
 			if (tcsnameType != JsNull && tcsnameType != JsUndefined) {
@@ -1122,7 +2060,7 @@ namespace {
 			}
 
 			JsValueRef tesnameObj;
-			JsGetProperty(progobj, getId("tesname"), &tesnameObj);
+			JsGetProperty(progobj, ids[tesname_id], &tesnameObj);
 			JsValueType tesnameType;
 			JsGetValueType(tesnameObj, &tesnameType);
 			if (tesnameType != JsNull && tesnameType != JsUndefined) {
@@ -1153,129 +2091,1449 @@ namespace {
 		}
 
 		Kore::Graphics4::setPipeline(pipeline);
+	}
+
+	JsValueRef CALLBACK krom_set_pipeline(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		setPipeline(arguments[1]);
 		return JS_INVALID_REFERENCE;
 	}
 
-	JsValueRef CALLBACK krom_load_image(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		char filename[256];
-		size_t length;
-		JsCopyString(arguments[1], filename, 255, &length);
-		filename[length] = 0;
-		bool readable;
-		JsBooleanToBool(arguments[2], &readable);
-		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(filename, readable);
+	std::string assetPath(const char* filename) {
+		if (filename[0] == '/' || filename[0] == '\\' || (filename[0] != 0 && filename[1] == ':')) return filename;
+		return std::string(kinc_internal_get_files_location()) + "/" + filename;
+	}
 
-		JsValueRef obj;
-		JsCreateExternalObject(texture, nullptr, &obj);
-		JsValueRef width, height, realWidth, realHeight;
-		JsIntToNumber(texture->width, &width);
-		JsSetProperty(obj, getId("width"), width, false);
-		JsIntToNumber(texture->height, &height);
-		JsSetProperty(obj, getId("height"), height, false);
-		JsIntToNumber(texture->texWidth, &realWidth);
-		JsSetProperty(obj, getId("realWidth"), realWidth, false);
-		JsIntToNumber(texture->texHeight, &realHeight);
-		JsSetProperty(obj, getId("realHeight"), realHeight, false);
-		JsSetProperty(obj, getId("filename"), arguments[1], false);
-		return obj;
+	// Assets resolve through krom.pack first. In watch mode loose files
+	// override packed ones, so hot reloading keeps working.
+	std::string packPath;
+	bool packOpened = false;
+
+	bool findPacked(const char* filename, PackFile* file) {
+		if (!packOpened) return false;
+		Kore::u64 modified, size;
+		if (watch && fileStats(assetPath(filename).c_str(), &modified, &size)) return false;
+		return packFind(filename, file);
 	}
 
-	JsValueRef CALLBACK krom_unload_image(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		JsValueType type;
-		JsGetValueType(arguments[1], &type);
-		if (type == JsNull || type == JsUndefined) return JS_INVALID_REFERENCE;
+	// Files loaded during a session are recorded in order in krom.trace next
+	// to krom.bin. The next launch replays the trace on a thread while the
+	// JS code starts up. It warms the page cache and fills the decode caches.
+	enum TraceType {
+		TraceImage,
+		TraceBlob,
+		TraceSound,
+		TraceStorage
+	};
 
-		JsValueRef tex, rt;
-		JsGetProperty(arguments[1], getId("texture_"), &tex);
-		JsGetProperty(arguments[1], getId("renderTarget_"), &rt);
-		JsValueType texType, rtType;
-		JsGetValueType(tex, &texType);
-		JsGetValueType(rt, &rtType);
+	struct TraceEntry {
+		TraceType type;
+		int format;
+		std::string name;
+	};
 
-		if (texType == JsObject) {
-			Kore::Graphics4::Texture* texture;
-			JsGetExternalData(tex, (void**)&texture);
-			delete texture;
+	const char* traceTypeNames[] = {"image", "blob", "sound", "storage"};
+
+	bool accessTrace = true;
+	std::string tracePath;
+	std::vector<TraceEntry> traceEntries;
+	std::set<std::string> tracedNames;
+	bool traceWritten = false;
+
+	void traceAccess(TraceType type, const char* name, int format = 0) {
+		if (!accessTrace) return;
+		char key[32];
+		snprintf(key, sizeof(key), "%d %d ", type, format);
+		if (!tracedNames.insert(key + std::string(name)).second) return;
+		TraceEntry entry;
+		entry.type = type;
+		entry.format = format;
+		entry.name = name;
+		traceEntries.push_back(entry);
+	}
+
+	void writeAccessTrace() {
+		if (!accessTrace || traceWritten || traceEntries.empty()) return;
+		traceWritten = true;
+		std::string temp = tracePath + ".tmp";
+		FILE* file = fopen(temp.c_str(), "w");
+		if (file == nullptr) return;
+		for (size_t i = 0; i < traceEntries.size(); ++i) {
+			const TraceEntry& entry = traceEntries[i];
+			if (entry.type == TraceSound) fprintf(file, "%s %d %s\n", traceTypeNames[entry.type], entry.format, entry.name.c_str());
+			else fprintf(file, "%s %s\n", traceTypeNames[entry.type], entry.name.c_str());
 		}
-		else if (rtType == JsObject) {
-			Kore::Graphics4::RenderTarget* renderTarget;
-			JsGetExternalData(rt, (void**)&renderTarget);
-			delete renderTarget;
+		bool written = fclose(file) == 0;
+		remove(tracePath.c_str());
+		if (!written || rename(temp.c_str(), tracePath.c_str()) != 0) remove(temp.c_str());
+	}
+
+	std::vector<TraceEntry> readAccessTrace() {
+		std::vector<TraceEntry> entries;
+		std::ifstream input(tracePath.c_str());
+		std::string line;
+		while (std::getline(input, line)) {
+			size_t space = line.find(' ');
+			if (space == std::string::npos) continue;
+			std::string type = line.substr(0, space);
+			TraceEntry entry;
+			entry.format = 0;
+			entry.name = line.substr(space + 1);
+			int found = -1;
+			for (int i = 0; i < 4; ++i) {
+				if (type == traceTypeNames[i]) found = i;
+			}
+			if (found < 0) continue;
+			entry.type = (TraceType)found;
+			if (entry.type == TraceSound) {
+				space = entry.name.find(' ');
+				if (space == std::string::npos) continue;
+				entry.format = atoi(entry.name.substr(0, space).c_str());
+				entry.name = entry.name.substr(space + 1);
+			}
+			if (!entry.name.empty()) entries.push_back(entry);
 		}
+		return entries;
+	}
 
-		return JS_INVALID_REFERENCE;
+	const char* fileExtension(const char* filename) {
+		const char* extension = strrchr(filename, '.');
+		return extension != nullptr ? extension + 1 : "";
 	}
 
-	JsValueRef CALLBACK krom_load_sound(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		char filename[256];
-		size_t length;
-		JsCopyString(arguments[1], filename, 255, &length);
-		filename[length] = 0;
+	Kore::Graphics4::Texture* loadTextureFile(const char* filename, bool readable) {
+		PackFile packed;
+		if (findPacked(filename, &packed)) {
+			std::vector<Kore::u8> contents(packed.size);
+			if (packRead(packed, contents.data())) return new Kore::Graphics4::Texture(contents.data(), (int)contents.size(), fileExtension(filename), readable);
+		}
+		return new Kore::Graphics4::Texture(filename, readable);
+	}
 
-		Kore::Sound* sound = new Kore::Sound(filename);
+	std::atomic<int> cacheWrites(0);
 
-		JsValueRef array;
-		JsCreateArrayBuffer(sound->size * 2 * sizeof(float), &array);
+	// Cache files are written to a temp file first so a crash never leaves a
+	// partial file behind. Several threads can write caches at once.
+	void writeCacheFile(const std::string& path, const void* header, size_t headerSize, const void* data, size_t size) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%d.tmp", cacheWrites++);
+		std::string temp = path + suffix;
+		FILE* file = fopen(temp.c_str(), "wb");
+		if (file == nullptr) return;
+		bool written = fwrite(header, headerSize, 1, file) == 1 && (size == 0 || fwrite(data, size, 1, file) == 1);
+		written = fclose(file) == 0 && written;
+#ifdef KORE_WINDOWS
+		// rename does not replace existing files on Windows
+		if (written) remove(path.c_str());
+#endif
+		if (!written || rename(temp.c_str(), path.c_str()) != 0) remove(temp.c_str());
+	}
+
+	// Decoded images are cached in the save path as a small header followed by
+	// the texels in the layout Texture uploads, keyed by a hash of the file
+	// contents. A hit is mapped and uploaded without decoding. Kore generates
+	// mipmaps on the GPU, so only the top level is stored. Entries are never
+	// evicted, so the cache is only used when enabled with --texturecache.
+	struct TextureCacheHeader {
+		Kore::u32 magic;
+		Kore::u32 version;
+		Kore::u32 width;
+		Kore::u32 height;
+		Kore::u32 format;
+		Kore::u32 size;
+	};
 
-		Kore::u8* tobytes;
-		unsigned bufferLength;
-		JsGetArrayBufferStorage(array, &tobytes, &bufferLength);
-		float* to = (float*)tobytes;
+	const Kore::u32 textureCacheMagic = 0x5845544b; // KTEX
+	const Kore::u32 textureCacheVersion = 1;
+	bool textureCache = false;
+
+	// Texels of an image, either mapped from the texture cache or owned by a
+	// decoded image. Filled on any thread, uploaded on the JS thread.
+	struct DecodedImage {
+		FileMapping* mapping;
+		Kore::Graphics4::Image* image;
+		Kore::u8* pixels;
+		int width;
+		int height;
+		Kore::Graphics4::Image::Format format;
+	};
 
-		Kore::s16* left = (Kore::s16*)&sound->left[0];
-		Kore::s16* right = (Kore::s16*)&sound->right[0];
-		for (int i = 0; i < sound->size; i += 1) {
-			to[i * 2 + 0] = (float)(left [i] / 32767.0);
-			to[i * 2 + 1] = (float)(right[i] / 32767.0);
+	FileMapping* mapCachedTexture(const std::string& path) {
+		FileMapping* mapping = new FileMapping;
+		if (!mapFile(path.c_str(), mapping)) {
+			delete mapping;
+			return nullptr;
+		}
+		TextureCacheHeader* header = (TextureCacheHeader*)mapping->data;
+		if (mapping->size < sizeof(TextureCacheHeader) || header->magic != textureCacheMagic || header->version != textureCacheVersion
+			|| mapping->size != sizeof(TextureCacheHeader) + (size_t)header->size
+			|| header->size != (Kore::u64)header->width * header->height * Kore::Graphics4::Image::sizeOf((Kore::Graphics4::Image::Format)header->format)) {
+			unmapFile(mapping);
+			delete mapping;
+			return nullptr;
+		}
+		return mapping;
+	}
+
+	bool decodeImage(const char* filename, DecodedImage* decoded) {
+		decoded->mapping = nullptr;
+		decoded->image = nullptr;
+
+		const Kore::u8* source = nullptr;
+		size_t sourceSize = 0;
+		std::vector<Kore::u8> contents;
+		FileMapping sourceMapping;
+		bool sourceMapped = false;
+		PackFile packed;
+		if (findPacked(filename, &packed)) {
+			if (packCompressed(packed)) {
+				contents.resize(packed.size);
+				if (!packRead(packed, contents.data())) return false;
+				source = contents.data();
+			}
+			else {
+				source = packed.data;
+			}
+			sourceSize = packed.size;
+		}
+		else if (mapFile(assetPath(filename).c_str(), &sourceMapping)) {
+			sourceMapped = true;
+			source = sourceMapping.data;
+			sourceSize = sourceMapping.size;
+		}
+		else {
+			Kore::FileReader reader;
+			if (!reader.open(filename)) return false;
+			contents.resize(reader.size());
+			reader.read(contents.data(), (int)contents.size());
+			reader.close();
+			source = contents.data();
+			sourceSize = contents.size();
 		}
 
-		delete sound;
+		std::string cachePath;
+		if (textureCache) {
+			char name[64];
+			snprintf(name, sizeof(name), "texture-%016llx.tex", (unsigned long long)hashBytes(source, sourceSize));
+			cachePath = std::string(Kore::System::savePath()) + name;
+			decoded->mapping = mapCachedTexture(cachePath);
+		}
+
+		if (decoded->mapping != nullptr) {
+			TextureCacheHeader* header = (TextureCacheHeader*)decoded->mapping->data;
+			decoded->pixels = &decoded->mapping->data[sizeof(TextureCacheHeader)];
+			decoded->width = header->width;
+			decoded->height = header->height;
+			decoded->format = (Kore::Graphics4::Image::Format)header->format;
+		}
+		else {
+			Kore::BufferReader reader(source, (int)sourceSize);
+			Kore::Graphics4::Image* image = new Kore::Graphics4::Image(reader, fileExtension(filename), true);
+			decoded->image = image;
+			decoded->pixels = image->format == Kore::Graphics4::Image::RGBA128 && image->hdrData != nullptr ? (Kore::u8*)image->hdrData : image->data;
+			decoded->width = image->width;
+			decoded->height = image->height;
+			decoded->format = image->format;
+			Kore::u64 size = (Kore::u64)image->width * image->height * Kore::Graphics4::Image::sizeOf(image->format);
+			// Textures too large for the header are not cached
+			if (!cachePath.empty() && image->compression == Kore::Graphics4::ImageCompressionNone && size <= 0xffffffffu) {
+				TextureCacheHeader header;
+				header.magic = textureCacheMagic;
+				header.version = textureCacheVersion;
+				header.width = image->width;
+				header.height = image->height;
+				header.format = image->format;
+				header.size = (Kore::u32)size;
+				writeCacheFile(cachePath, &header, sizeof(header), decoded->pixels, (size_t)size);
+			}
+		}
+
+		if (sourceMapped) unmapFile(&sourceMapping);
+		return true;
+	}
+
+	void releaseDecodedImage(DecodedImage& decoded) {
+		delete decoded.image;
+		decoded.image = nullptr;
+		if (decoded.mapping != nullptr) {
+			unmapFile(decoded.mapping);
+			delete decoded.mapping;
+			decoded.mapping = nullptr;
+		}
+	}
+
+	// Readable textures keep pointing at the texels they were created from
+	// and delete them with the texture. Decoded texels are handed over to the
+	// texture, texels mapped from the cache are copied.
+	Kore::u8* takePixels(DecodedImage& decoded) {
+		if (decoded.image != nullptr) {
+			if (decoded.pixels == (Kore::u8*)decoded.image->hdrData) decoded.image->hdrData = nullptr;
+			else decoded.image->data = nullptr;
+			return decoded.pixels;
+		}
+		size_t size = (size_t)decoded.width * decoded.height * Kore::Graphics4::Image::sizeOf(decoded.format);
+		Kore::u8* pixels;
+		if (decoded.format == Kore::Graphics4::Image::RGBA128 || decoded.format == Kore::Graphics4::Image::RGBA64
+			|| decoded.format == Kore::Graphics4::Image::A32 || decoded.format == Kore::Graphics4::Image::A16) {
+			pixels = (Kore::u8*)new float[(size + sizeof(float) - 1) / sizeof(float)];
+		}
+		else {
+			pixels = new Kore::u8[size];
+		}
+		memcpy(pixels, decoded.pixels, size);
+		return pixels;
+	}
+
+	// Uploads and releases decoded texels. Compressed texture formats are
+	// not decoded on the CPU and take the regular path.
+	Kore::Graphics4::Texture* createTexture(DecodedImage& decoded, const char* filename, bool readable) {
+		Kore::Graphics4::Texture* texture;
+		if (decoded.pixels == nullptr || (decoded.image != nullptr && decoded.image->compression != Kore::Graphics4::ImageCompressionNone)) {
+			texture = loadTextureFile(filename, readable);
+		}
+		else {
+			Kore::u8* pixels = readable ? takePixels(decoded) : decoded.pixels;
+			texture = new Kore::Graphics4::Texture(pixels, decoded.width, decoded.height, decoded.format, readable);
+		}
+		releaseDecodedImage(decoded);
+		return texture;
+	}
+
+	Kore::Graphics4::Texture* loadTexture(const char* filename, bool readable) {
+		DecodedImage decoded;
+		if (decodeImage(filename, &decoded)) return createTexture(decoded, filename, readable);
+		return loadTextureFile(filename, readable);
+	}
+
+	JsValueRef createTextureObject(Kore::Graphics4::Texture* texture, JsValueRef filename) {
+		JsValueRef obj;
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &obj);
+		JsValueRef width, height, realWidth, realHeight;
+		JsIntToNumber(texture->width, &width);
+		JsSetProperty(obj, ids[width_id], width, false);
+		JsIntToNumber(texture->height, &height);
+		JsSetProperty(obj, ids[height_id], height, false);
+		JsIntToNumber(texture->texWidth, &realWidth);
+		JsSetProperty(obj, ids[realWidth_id], realWidth, false);
+		JsIntToNumber(texture->texHeight, &realHeight);
+		JsSetProperty(obj, ids[realHeight_id], realHeight, false);
+		JsSetProperty(obj, ids[filename_id], filename, false);
+		return obj;
+	}
+
+	JsValueRef CALLBACK krom_load_image(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		char filename[256];
+		size_t length;
+		JsCopyString(arguments[1], filename, 255, &length);
+		filename[length] = 0;
+		bool readable;
+		JsBooleanToBool(arguments[2], &readable);
+		traceAccess(TraceImage, filename);
+		Kore::Graphics4::Texture* texture = loadTexture(filename, readable);
+		return createTextureObject(texture, arguments[1]);
+	}
+
+	JsValueRef CALLBACK krom_unload_image(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueType type;
+		JsGetValueType(arguments[1], &type);
+		if (type == JsNull || type == JsUndefined) return JS_INVALID_REFERENCE;
+
+		JsValueRef tex, rt;
+		JsGetProperty(arguments[1], ids[texture__id], &tex);
+		JsGetProperty(arguments[1], ids[renderTarget__id], &rt);
+		JsValueType texType, rtType;
+		JsGetValueType(tex, &texType);
+		JsGetValueType(rt, &rtType);
+
+		if (texType == JsObject) {
+			Kore::Graphics4::Texture* texture;
+			JsGetExternalData(tex, (void**)&texture);
+			delete texture;
+			JsSetExternalData(tex, nullptr);
+		}
+		else if (rtType == JsObject) {
+			Kore::Graphics4::RenderTarget* renderTarget;
+			JsGetExternalData(rt, (void**)&renderTarget);
+			delete renderTarget;
+			JsSetExternalData(rt, nullptr);
+		}
+
+		return JS_INVALID_REFERENCE;
+	}
+
+	void CALLBACK unmapArrayBuffer(void* data) {
+		FileMapping* mapping = (FileMapping*)data;
+		unmapFile(mapping);
+		delete mapping;
+	}
+
+	// Decoded sounds are cached in the save path as a small header followed by
+	// the interleaved float samples, keyed by the source path, size and
+	// modification time. A hit is mapped straight into an ArrayBuffer.
+	// Decoded samples take about ten times the space of the compressed files
+	// and stale entries are never evicted, so the cache is only used when
+	// enabled with --soundcache.
+	enum SoundFormat {
+		SoundFormatFloat = 0,     // interleaved stereo floats
+		SoundFormatInt16 = 1,     // interleaved stereo 16 bit integers
+		SoundFormatCompressed = 2 // the undecoded file, for sound streams
+	};
+
+	int soundSampleSize(int format) {
+		return format == SoundFormatInt16 ? 2 : 4;
+	}
+
+	struct SoundCacheHeader {
+		Kore::u32 magic;
+		Kore::u32 version;
+		Kore::u32 samples;
+		Kore::u32 format;
+	};
+
+	const Kore::u32 soundCacheMagic = 0x4d43504b; // KPCM
+	const Kore::u32 soundCacheVersion = 2;
+	bool soundCache = false;
+
+	std::string soundCachePath(const char* filename, int format) {
+		std::string path = assetPath(filename);
+		Kore::u64 modified, size;
+		PackFile packed;
+		if (!fileStats(findPacked(filename, &packed) ? packPath.c_str() : path.c_str(), &modified, &size)) return "";
+		Kore::u64 key = hashValue(format, hashValue(size, hashValue(modified, hashBytes(path.c_str(), path.size()))));
+		char name[64];
+		snprintf(name, sizeof(name), "sound-%016llx.pcm", (unsigned long long)key);
+		return std::string(Kore::System::savePath()) + name;
+	}
+
+	FileMapping* mapCachedSound(const std::string& path, int format) {
+		FileMapping* mapping = new FileMapping;
+		if (!mapFile(path.c_str(), mapping)) {
+			delete mapping;
+			return nullptr;
+		}
+		SoundCacheHeader* header = (SoundCacheHeader*)mapping->data;
+		if (mapping->size < sizeof(SoundCacheHeader) || header->magic != soundCacheMagic || header->version != soundCacheVersion || header->format != (Kore::u32)format
+			|| mapping->size != sizeof(SoundCacheHeader) + (size_t)header->samples * 2 * soundSampleSize(format)) {
+			unmapArrayBuffer(mapping);
+			return nullptr;
+		}
+		return mapping;
+	}
+
+	void writeCachedSound(const std::string& path, void* samples, int count, int format) {
+		SoundCacheHeader header;
+		header.magic = soundCacheMagic;
+		header.version = soundCacheVersion;
+		header.samples = count;
+		header.format = format;
+		writeCacheFile(path, &header, sizeof(header), samples, (size_t)count * 2 * soundSampleSize(format));
+	}
+
+	// File contents or decoded samples, either mapped from the sound cache or
+	// allocated with malloc. Filled on any thread, turned into an ArrayBuffer
+	// on the JS thread.
+	struct AssetData {
+		FileMapping* mapping;
+		void* data;
+		unsigned size;
+	};
+
+	bool readFile(const char* filename, AssetData* asset) {
+		asset->mapping = nullptr;
+		PackFile packed;
+		if (findPacked(filename, &packed)) {
+			asset->size = packed.size;
+			asset->data = malloc(asset->size > 0 ? asset->size : 1);
+			if (packRead(packed, asset->data)) return true;
+			free(asset->data);
+			return false;
+		}
+		Kore::FileReader reader;
+		if (!reader.open(filename)) return false;
+		asset->size = reader.size();
+		asset->data = malloc(asset->size > 0 ? asset->size : 1);
+		reader.read(asset->data, asset->size);
+		reader.close();
+		return true;
+	}
+
+	// Maps the file instead of reading it, the pages are only read when
+	// touched and stay shared with other processes until they are written.
+	// Falls back to reading for files that cannot be mapped, like assets
+	// inside an apk. Uncompressed packed files get their own view of the
+	// pack, so writes to one load are not seen by others.
+	bool mapAsset(const char* filename, AssetData* asset) {
+		PackFile packed;
+		if (findPacked(filename, &packed)) {
+			if (packCompressed(packed)) return readFile(filename, asset);
+			FileMapping* mapping = new FileMapping;
+			if (mapFileRange(packPath.c_str(), packed.offset, packed.size, mapping)) {
+				asset->mapping = mapping;
+				asset->data = mapping->data;
+				asset->size = packed.size;
+				return true;
+			}
+			delete mapping;
+			return readFile(filename, asset);
+		}
+		FileMapping* mapping = new FileMapping;
+		if (mapFile(assetPath(filename).c_str(), mapping)) {
+			if (mapping->size <= 0xffffffffu) {
+				asset->mapping = mapping;
+				asset->data = mapping->data;
+				asset->size = (unsigned)mapping->size;
+				return true;
+			}
+			unmapFile(mapping);
+		}
+		delete mapping;
+		return readFile(filename, asset);
+	}
+
+	// Kore::Sound only reads loose files, packed sounds are decoded from
+	// memory. The packer leaves wav files loose.
+	bool decodePackedSound(const PackFile& packed, int format, const std::string& cachePath, AssetData* asset) {
+		std::vector<Kore::u8> contents(packed.size);
+		if (!packRead(packed, contents.data())) return false;
+		int channels, rate;
+		short* decoded;
+		int frames = stb_vorbis_decode_memory(contents.data(), (int)contents.size(), &channels, &rate, &decoded);
+		if (frames < 0) return false;
+
+		Kore::s16* stereo = decoded;
+		if (channels != 2) {
+			stereo = (Kore::s16*)malloc(frames * 2 * sizeof(Kore::s16) + 1);
+			for (int i = 0; i < frames; ++i) {
+				stereo[i * 2 + 0] = decoded[i * channels];
+				stereo[i * 2 + 1] = decoded[i * channels + (channels > 1 ? 1 : 0)];
+			}
+			free(decoded);
+		}
+
+		asset->size = frames * 2 * soundSampleSize(format);
+		if (format == SoundFormatInt16) {
+			asset->data = stereo;
+		}
+		else {
+			asset->data = malloc(asset->size > 0 ? asset->size : 1);
+			convertPcm16(stereo, (float*)asset->data, frames * 2);
+			free(stereo);
+		}
 
+		if (!cachePath.empty()) {
+			writeCachedSound(cachePath, asset->data, frames, format);
+		}
+		return true;
+	}
+
+	bool decodeSound(const char* filename, int format, AssetData* asset) {
+		if (format == SoundFormatCompressed) return readFile(filename, asset);
+
+		std::string cachePath;
+		if (soundCache) {
+			cachePath = soundCachePath(filename, format);
+			if (!cachePath.empty()) {
+				asset->mapping = mapCachedSound(cachePath, format);
+				if (asset->mapping != nullptr) {
+					asset->data = &asset->mapping->data[sizeof(SoundCacheHeader)];
+					asset->size = (unsigned)(asset->mapping->size - sizeof(SoundCacheHeader));
+					return true;
+				}
+			}
+		}
+
+		asset->mapping = nullptr;
+		PackFile packed;
+		if (findPacked(filename, &packed)) return decodePackedSound(packed, format, cachePath, asset);
+
+		Kore::Sound* sound = new Kore::Sound(filename);
+		asset->size = sound->size * 2 * soundSampleSize(format);
+		asset->data = malloc(asset->size > 0 ? asset->size : 1);
+
+		if (format == SoundFormatInt16) {
+			interleavePcm16((Kore::s16*)&sound->left[0], (Kore::s16*)&sound->right[0], (Kore::s16*)asset->data, sound->size);
+		}
+		else {
+			convertPcm((Kore::s16*)&sound->left[0], (Kore::s16*)&sound->right[0], (float*)asset->data, sound->size);
+		}
+
+		if (!cachePath.empty()) {
+			writeCachedSound(cachePath, asset->data, sound->size, format);
+		}
+
+		delete sound;
+		return true;
+	}
+
+	void CALLBACK freeArrayBuffer(void* data) {
+		free(data);
+	}
+
+	JsValueRef createAssetBuffer(AssetData& asset) {
+		JsValueRef array;
+		if (asset.mapping != nullptr) JsCreateExternalArrayBuffer(asset.data, asset.size, unmapArrayBuffer, asset.mapping, &array);
+		else JsCreateExternalArrayBuffer(asset.data, asset.size, freeArrayBuffer, asset.data, &array);
 		return array;
 	}
 
+	int soundFormatArgument(JsValueRef* arguments, unsigned short argumentCount, int index) {
+		int format = SoundFormatFloat;
+		if (argumentCount > index) JsNumberToInt(arguments[index], &format);
+		if (format != SoundFormatInt16 && format != SoundFormatCompressed) format = SoundFormatFloat;
+		return format;
+	}
+
+	JsValueRef CALLBACK krom_load_sound(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		char filename[256];
+		size_t length;
+		JsCopyString(arguments[1], filename, 255, &length);
+		filename[length] = 0;
+
+		int format = soundFormatArgument(arguments, argumentCount, 2);
+		traceAccess(TraceSound, filename, format);
+		AssetData asset;
+		if (!decodeSound(filename, format, &asset)) return JS_INVALID_REFERENCE;
+		return createAssetBuffer(asset);
+	}
+
+	// Sound streams decode OGG files incrementally, so long music tracks do
+	// not have to be decoded into memory up front like loadSound does. A
+	// stream either reads its file through Kore::SoundStream or decodes
+	// compressed bytes that loadSound returned, which lets several voices
+	// share one resident copy of a compressed sound.
+	struct AudioStream {
+		Kore::SoundStream* file;
+		stb_vorbis* memory;
+		int channels;
+		bool looping;
+	};
+
+	void CALLBACK finalizeAudioStream(void* data) {
+		AudioStream* stream = (AudioStream*)data;
+		if (stream == nullptr) return;
+		delete stream->file;
+		if (stream->memory != nullptr) stb_vorbis_close(stream->memory);
+		delete stream;
+	}
+
+	// Decodes up to frames frames from a memory stream as interleaved stereo.
+	int readMemoryStream(AudioStream* stream, float* to, int frames) {
+		int written = 0;
+		bool rewound = false;
+		while (written < frames) {
+			int read = stb_vorbis_get_samples_float_interleaved(stream->memory, stream->channels, &to[written * 2], (frames - written) * stream->channels);
+			if (stream->channels == 1) {
+				for (int i = read - 1; i >= 0; --i) {
+					to[(written + i) * 2 + 1] = to[written * 2 + i];
+					to[(written + i) * 2 + 0] = to[written * 2 + i];
+				}
+			}
+			written += read;
+			if (read > 0) {
+				rewound = false;
+			}
+			else {
+				if (!stream->looping || rewound) break;
+				stb_vorbis_seek_start(stream->memory);
+				rewound = true;
+			}
+		}
+		return written;
+	}
+
+	JsValueRef CALLBACK krom_create_sound_stream(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		bool looping = false;
+		if (argumentCount > 2) JsBooleanToBool(arguments[2], &looping);
+
+		AudioStream* stream = new AudioStream;
+		stream->file = nullptr;
+		stream->memory = nullptr;
+		stream->looping = looping;
+		int sampleRate;
+		double streamLength;
+
+		JsValueType type;
+		JsGetValueType(arguments[1], &type);
+		if (type == JsArrayBuffer) {
+			Kore::u8* data;
+			unsigned dataLength;
+			JsGetArrayBufferStorage(arguments[1], &data, &dataLength);
+			int error;
+			stream->memory = stb_vorbis_open_memory(data, dataLength, &error, nullptr);
+			if (stream->memory == nullptr) {
+				delete stream;
+				return JS_INVALID_REFERENCE;
+			}
+			stb_vorbis_info info = stb_vorbis_get_info(stream->memory);
+			// Reads are decoded straight into stereo sized buffers
+			if (info.channels > 2) {
+				stb_vorbis_close(stream->memory);
+				delete stream;
+				return JS_INVALID_REFERENCE;
+			}
+			stream->channels = info.channels;
+			sampleRate = info.sample_rate;
+			streamLength = stb_vorbis_stream_length_in_seconds(stream->memory);
+		}
+		else {
+			char filename[256];
+			size_t length;
+			JsCopyString(arguments[1], filename, 255, &length);
+			filename[length] = 0;
+			stream->file = new Kore::SoundStream(filename, looping);
+			stream->channels = stream->file->channels();
+			sampleRate = stream->file->sampleRate();
+			streamLength = stream->file->length();
+		}
+
+		JsValueRef obj;
+		JsCreateExternalObject(stream, finalizeAudioStream, &obj);
+		if (stream->memory != nullptr) {
+			// Keeps the compressed bytes alive as long as the stream
+			JsSetProperty(obj, ids[buffer_id], arguments[1], false);
+		}
+		JsValueRef channels, rate, lengthValue;
+		JsIntToNumber(stream->channels, &channels);
+		JsSetProperty(obj, ids[channels_id], channels, false);
+		JsIntToNumber(sampleRate, &rate);
+		JsSetProperty(obj, ids[sampleRate_id], rate, false);
+		JsDoubleToNumber(streamLength, &lengthValue);
+		JsSetProperty(obj, ids[length_id], lengthValue, false);
+		return obj;
+	}
+
+	// Decodes up to frames stereo frames as interleaved floats into the buffer
+	// and returns how many were written, less than requested once a stream
+	// that does not loop has ended. Mono streams are written to both channels.
+	JsValueRef CALLBACK krom_read_sound_stream(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		AudioStream* stream;
+		JsGetExternalData(arguments[1], (void**)&stream);
+
+		Kore::u8* bytes;
+		unsigned bufferLength;
+		JsGetArrayBufferStorage(arguments[2], &bytes, &bufferLength);
+		float* to = (float*)bytes;
+
+		int frames;
+		JsNumberToInt(arguments[3], &frames);
+		if (frames > (int)(bufferLength / (2 * sizeof(float)))) frames = bufferLength / (2 * sizeof(float));
+
+		int written = 0;
+		if (stream != nullptr && stream->memory != nullptr) {
+			written = readMemoryStream(stream, to, frames);
+		}
+		else if (stream != nullptr) {
+			bool mono = stream->channels == 1;
+			for (; written < frames && !stream->file->ended(); ++written) {
+				float left = stream->file->nextSample();
+				to[written * 2 + 0] = left;
+				to[written * 2 + 1] = mono ? left : stream->file->nextSample();
+			}
+		}
+
+		JsValueRef value;
+		JsIntToNumber(written, &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_reset_sound_stream(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		AudioStream* stream;
+		JsGetExternalData(arguments[1], (void**)&stream);
+		if (stream != nullptr && stream->memory != nullptr) stb_vorbis_seek_start(stream->memory);
+		else if (stream != nullptr) stream->file->reset();
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_delete_sound_stream(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		AudioStream* stream;
+		JsGetExternalData(arguments[1], (void**)&stream);
+		finalizeAudioStream(stream);
+		JsSetExternalData(arguments[1], nullptr);
+		return JS_INVALID_REFERENCE;
+	}
+
+	// Copies samples from a JS ring buffer of floats or 16 bit integers into
+	// the Audio2 ring. sourceLocation is the read position in samples.
+	void writeAudio(Kore::u8* buffer, unsigned bufferLength, int samples, int format, int& sourceLocation) {
+		int sampleSize = soundSampleSize(format);
+		int sourceSamples = bufferLength / sampleSize;
+		if (samples <= 0 || sourceSamples == 0) return;
+		if (sourceLocation >= sourceSamples) sourceLocation = 0;
+
+		Kore::Audio2::Buffer& ring = Kore::Audio2::buffer;
+		int ringSamples = ring.dataSize / 4;
+		int readLocation = ring.readLocation / 4;
+		int writeLocation = ring.writeLocation / 4;
+		int space = (readLocation - writeLocation - 1 + ringSamples) % ringSamples;
+		int count = samples;
+		if (count > space) {
+			++audioOverruns;
+			count = space;
+		}
+
+		int from = sourceLocation;
+		float* to = (float*)ring.data;
+		while (count > 0) {
+			int segment = count;
+			if (segment > sourceSamples - from) segment = sourceSamples - from;
+			if (segment > ringSamples - writeLocation) segment = ringSamples - writeLocation;
+			if (format == SoundFormatInt16) {
+				convertPcm16(&((Kore::s16*)buffer)[from], &to[writeLocation], segment);
+			}
+			else {
+				memcpy(&to[writeLocation], &((float*)buffer)[from], segment * 4);
+			}
+			from += segment;
+			if (from >= sourceSamples) from = 0;
+			writeLocation += segment;
+			if (writeLocation >= ringSamples) writeLocation = 0;
+			count -= segment;
+		}
+		// Samples dropped because the ring was full are skipped in the source too.
+		sourceLocation = (int)((sourceLocation + (Kore::u64)samples) % sourceSamples);
+
+		std::atomic_thread_fence(std::memory_order_release);
+		ring.writeLocation = writeLocation * 4;
+	}
+
 	JsValueRef CALLBACK krom_write_audio_buffer(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (audioWorker) return JS_INVALID_REFERENCE; // The worker owns the ring
+
 		Kore::u8* buffer;
 		unsigned bufferLength;
 		JsGetArrayBufferStorage(arguments[1], &buffer, &bufferLength);
 
 		int samples;
 		JsNumberToInt(arguments[2], &samples);
+		int format = SoundFormatFloat;
+		if (argumentCount > 3) JsNumberToInt(arguments[3], &format);
+		writeAudio(buffer, bufferLength, samples, format, audioReadLocation);
 
-		for (int i = 0; i < samples; ++i) {
-			float value = *(float*)&buffer[audioReadLocation];
-			audioReadLocation += 4;
-			if (audioReadLocation >= bufferLength) audioReadLocation = 0;
+		return JS_INVALID_REFERENCE;
+	}
+
+	// Sound buffers that mixer voices play from, kept alive until the mixer
+	// reports the voice as finished.
+	std::map<int, JsValueRef> mixerBuffers;
 
-			*(float*)&Kore::Audio2::buffer.data[Kore::Audio2::buffer.writeLocation] = value;
-			Kore::Audio2::buffer.writeLocation += 4;
-			if (Kore::Audio2::buffer.writeLocation >= Kore::Audio2::buffer.dataSize) Kore::Audio2::buffer.writeLocation = 0;
+	void releaseMixerBuffers() {
+		int voices[64];
+		int count;
+		while ((count = mixerTakeFinished(voices, 64)) > 0) {
+			for (int i = 0; i < count; ++i) {
+				std::map<int, JsValueRef>::iterator it = mixerBuffers.find(voices[i]);
+				if (it == mixerBuffers.end()) continue;
+				JsRelease(it->second, nullptr);
+				mixerBuffers.erase(it);
+			}
 		}
+	}
 
+	JsValueRef CALLBACK krom_set_mixer_enabled(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		bool enabled;
+		JsBooleanToBool(arguments[1], &enabled);
+		mixerEnabled = enabled && enableSound && !audioWorker;
+		if (!mixerEnabled) mixerStopAll();
 		return JS_INVALID_REFERENCE;
 	}
 
-	JsValueRef CALLBACK krom_load_blob(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+	float numberArgument(JsValueRef* arguments, unsigned short argumentCount, int index, float defaultValue) {
+		if (argumentCount <= index) return defaultValue;
+		double value;
+		if (JsNumberToDouble(arguments[index], &value) != JsNoError) return defaultValue;
+		return (float)value;
+	}
+
+	void throwError(const char* message) {
+		JsValueRef messageObj, error;
+		JsCreateString(message, strlen(message), &messageObj);
+		JsCreateError(messageObj, &error);
+		JsSetException(error);
+	}
+
+	// mixerPlay(buffer, format, volume, pan, pitch, loop) plays a buffer from
+	// loadSound in the float or int16 format and returns a voice id. It throws
+	// for the compressed format, those buffers are still Ogg Vorbis files.
+	JsValueRef CALLBACK krom_mixer_play(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (!mixerEnabled) return JS_INVALID_REFERENCE;
+		Kore::u8* data;
+		unsigned dataLength;
+		if (JsGetArrayBufferStorage(arguments[1], &data, &dataLength) != JsNoError) return JS_INVALID_REFERENCE;
+		int format = SoundFormatFloat;
+		if (argumentCount > 2) JsNumberToInt(arguments[2], &format);
+		if (format == SoundFormatCompressed) {
+			throwError("mixerPlay can not play compressed sounds.");
+			return JS_INVALID_REFERENCE;
+		}
+		if (format != SoundFormatInt16) format = SoundFormatFloat;
+		int frames = dataLength / (2 * soundSampleSize(format));
+		if (frames == 0) return JS_INVALID_REFERENCE;
+		bool loop = false;
+		if (argumentCount > 6) JsBooleanToBool(arguments[6], &loop);
+
+		int voice = mixerPlay(data, frames, format == SoundFormatInt16, numberArgument(arguments, argumentCount, 3, 1),
+			numberArgument(arguments, argumentCount, 4, 0), numberArgument(arguments, argumentCount, 5, 1), loop);
+		JsAddRef(arguments[1], nullptr);
+		mixerBuffers[voice] = arguments[1];
+
+		JsValueRef value;
+		JsIntToNumber(voice, &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_mixer_set_voice(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int voice;
+		JsNumberToInt(arguments[1], &voice);
+		mixerSetVoice(voice, numberArgument(arguments, argumentCount, 2, 1), numberArgument(arguments, argumentCount, 3, 0), numberArgument(arguments, argumentCount, 4, 1));
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_mixer_stop(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int voice;
+		JsNumberToInt(arguments[1], &voice);
+		mixerStop(voice);
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_mixer_stop_all(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		mixerStopAll();
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_mixer_set_voice_output(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int voice, node;
+		JsNumberToInt(arguments[1], &voice);
+		JsNumberToInt(arguments[2], &node);
+		mixerSetVoiceOutput(voice, node);
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_mixer_voice_count(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsIntToNumber(mixerVoiceCount(), &value);
+		return value;
+	}
+
+	// Effect graph nodes are plain ids, see dsp.h for the parameters of
+	// every node type. dspConnect(node, 0) sends a node to the master output.
+	JsValueRef CALLBACK krom_dsp_create_node(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (!enableSound) return JS_INVALID_REFERENCE;
+		int type;
+		JsNumberToInt(arguments[1], &type);
+		int node = dspCreateNode(type);
+		if (node == 0) return JS_INVALID_REFERENCE;
+		JsValueRef value;
+		JsIntToNumber(node, &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_dsp_delete_node(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int node;
+		JsNumberToInt(arguments[1], &node);
+		dspDeleteNode(node);
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_dsp_connect(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int node, target;
+		JsNumberToInt(arguments[1], &node);
+		JsNumberToInt(arguments[2], &target);
+		JsValueRef value;
+		JsBoolToBoolean(dspConnect(node, target), &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_dsp_set_parameter(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		int node, parameter;
+		JsNumberToInt(arguments[1], &node);
+		JsNumberToInt(arguments[2], &parameter);
+		dspSetParameter(node, parameter, numberArgument(arguments, argumentCount, 3, 0));
+		return JS_INVALID_REFERENCE;
+	}
+
+	// The audio worker is a second Chakra runtime on its own thread. It is
+	// woken by the Audio2 callback instead of waiting for the next frame, so
+	// a slow frame on the main thread does not starve the audio ring. The
+	// worker only sees a minimal Krom object. It shares memory with the main
+	// runtime through the channel, an external ArrayBuffer that both runtimes
+	// create over the same native allocation.
+	Semaphore* audioSemaphore = nullptr;
+	JsRuntimeHandle audioRuntime;
+	JsContextRef audioContext;
+	JsValueRef audioWorkerFunction;
+	int audioWorkerReadLocation = 0;
+	std::string audioWorkerScript;
+	Kore::u8* audioChannel = nullptr;
+	unsigned audioChannelSize = 0;
+	// Messages from the worker, sent from the main thread because the debug
+	// connection is not thread safe
+	Kore::Mutex audioLogMutex;
+	std::vector<std::string> audioLogMessages;
+
+	void queueAudioWorkerLog(const char* format, ...) {
+		char message[4096];
+		va_list args;
+		va_start(args, format);
+		vsnprintf(message, sizeof(message), format, args);
+		va_end(args);
+		audioLogMutex.lock();
+		audioLogMessages.push_back(message);
+		audioLogMutex.unlock();
+	}
+
+	void deliverAudioWorkerLog() {
+		std::vector<std::string> messages;
+		audioLogMutex.lock();
+		messages.swap(audioLogMessages);
+		audioLogMutex.unlock();
+		for (size_t i = 0; i < messages.size(); ++i) {
+			sendLogMessage("%s", messages[i].c_str());
+		}
+	}
+
+	JsValueRef CALLBACK krom_audio_worker_log(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (argumentCount < 2) return JS_INVALID_REFERENCE;
+		JsValueRef stringValue;
+		JsConvertValueToString(arguments[1], &stringValue);
+		char message[512];
+		size_t length;
+		if (JsCopyString(stringValue, message, 511, &length) != JsNoError) length = 0;
+		message[length] = 0;
+		queueAudioWorkerLog("%s", message);
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_audio_worker_set_callback(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		audioWorkerFunction = arguments[1];
+		JsAddRef(audioWorkerFunction, nullptr);
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_audio_worker_write(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		Kore::u8* buffer;
+		unsigned bufferLength;
+		JsGetArrayBufferStorage(arguments[1], &buffer, &bufferLength);
+
+		int samples;
+		JsNumberToInt(arguments[2], &samples);
+		int format = SoundFormatFloat;
+		if (argumentCount > 3) JsNumberToInt(arguments[3], &format);
+		writeAudio(buffer, bufferLength, samples, format, audioWorkerReadLocation);
+
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_audio_worker_get_channel(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef channel;
+		JsCreateExternalArrayBuffer(audioChannel, audioChannelSize, nullptr, nullptr, &channel);
+		return channel;
+	}
+
+	JsValueRef CALLBACK krom_audio_worker_get_samples_per_second(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsIntToNumber(Kore::Audio2::samplesPerSecond, &value);
+		return value;
+	}
+
+	void logAudioWorkerException() {
+		bool except;
+		JsHasException(&except);
+		if (!except) return;
+		JsValueRef exception, string;
+		JsGetAndClearException(&exception);
+		JsConvertValueToString(exception, &string);
+		char message[512];
+		size_t length;
+		if (JsCopyString(string, message, 511, &length) != JsNoError) length = 0;
+		message[length] = 0;
+		queueAudioWorkerLog("Uncaught exception in audio worker: %s", message);
+	}
+
+	void addAudioWorkerFunction(JsValueRef krom, const char* name, JsNativeFunction function) {
+		JsPropertyIdRef id;
+		JsValueRef func;
+		JsCreateFunction(function, nullptr, &func);
+		JsCreatePropertyId(name, strlen(name), &id);
+		JsSetProperty(krom, id, func, false);
+	}
+
+	void runAudioWorker(void*) {
+		JsCreateRuntime(JsRuntimeAttributeNone, nullptr, &audioRuntime);
+		JsCreateContext(audioRuntime, &audioContext);
+		JsSetCurrentContext(audioContext);
+
+		// Property ids belong to a runtime, so the shared ids table can not be used here.
+		JsValueRef krom;
+		JsCreateObject(&krom);
+		addAudioWorkerFunction(krom, "log", krom_audio_worker_log);
+		addAudioWorkerFunction(krom, "setAudioCallback", krom_audio_worker_set_callback);
+		addAudioWorkerFunction(krom, "writeAudioBuffer", krom_audio_worker_write);
+		addAudioWorkerFunction(krom, "getChannel", krom_audio_worker_get_channel);
+		addAudioWorkerFunction(krom, "getSamplesPerSecond", krom_audio_worker_get_samples_per_second);
+		JsValueRef global;
+		JsGetGlobalObject(&global);
+		JsPropertyIdRef kromId;
+		JsCreatePropertyId("Krom", strlen("Krom"), &kromId);
+		JsSetProperty(global, kromId, krom, false);
+
+		JsValueRef script, source, result;
+		JsCreateExternalArrayBuffer((void*)audioWorkerScript.c_str(), (unsigned)audioWorkerScript.size(), nullptr, nullptr, &script);
+		JsCreateString("audio.js", strlen("audio.js"), &source);
+		JsRun(script, 1, source, JsParseScriptAttributeNone, &result);
+		logAudioWorkerException();
+
+		JsValueRef undef;
+		JsGetUndefinedValue(&undef);
+		for (;;) {
+			audioSemaphore->wait();
+			int samples = audioSamples.exchange(0);
+			if (samples <= 0 || audioWorkerFunction == JS_INVALID_REFERENCE) continue;
+			JsValueRef args[2];
+			args[0] = undef;
+			JsIntToNumber(samples, &args[1]);
+			JsCallFunction(audioWorkerFunction, args, 2, &result);
+			logAudioWorkerException();
+		}
+	}
+
+	JsValueRef CALLBACK krom_start_audio_worker(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		if (audioWorker || mixerEnabled || !enableSound) return JS_INVALID_REFERENCE;
+
 		char filename[256];
 		size_t length;
 		JsCopyString(arguments[1], filename, 255, &length);
 		filename[length] = 0;
+		int channelSize = 0;
+		if (argumentCount > 2) JsNumberToInt(arguments[2], &channelSize);
 
 		Kore::FileReader reader;
-		if (!reader.open(filename)) return JS_INVALID_REFERENCE;
+		if (!reader.open(filename)) {
+			sendLogMessage("Could not load audio worker %s.", filename);
+			return JS_INVALID_REFERENCE;
+		}
+		audioWorkerScript.assign((const char*)reader.readAll(), reader.size());
+		reader.close();
 
-		JsValueRef array;
-		JsCreateArrayBuffer(reader.size(), &array);
+		audioChannelSize = channelSize > 0 ? channelSize : 0;
+		audioChannel = new Kore::u8[audioChannelSize > 0 ? audioChannelSize : 1];
+		memset(audioChannel, 0, audioChannelSize);
 
-		Kore::u8* contents;
-		unsigned contentsLength;
-		JsGetArrayBufferStorage(array, &contents, &contentsLength);
+		JsValueRef channel;
+		JsCreateExternalArrayBuffer(audioChannel, audioChannelSize, nullptr, nullptr, &channel);
 
-		memcpy(contents, reader.readAll(), reader.size());
+		audioLogMutex.create();
+		audioSemaphore = new Semaphore(0);
+		audioWorker.store(true, std::memory_order_release);
+		Kore::createAndRunThread(runAudioWorker, nullptr);
+		return channel;
+	}
 
-		reader.close();
+	JsValueRef CALLBACK krom_get_audio_stats(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef stats, underruns, overruns;
+		JsCreateObject(&stats);
+		JsIntToNumber(audioUnderruns, &underruns);
+		JsIntToNumber(audioOverruns, &overruns);
+		JsSetProperty(stats, ids[underruns_id], underruns, false);
+		JsSetProperty(stats, ids[overruns_id], overruns, false);
+		return stats;
+	}
 
-		return array;
+	// loadBlob(filename, mapped) returns the contents of a file. Mapped blobs
+	// are backed by the file itself, so even very large files load instantly.
+	JsValueRef CALLBACK krom_load_blob(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		char filename[256];
+		size_t length;
+		JsCopyString(arguments[1], filename, 255, &length);
+		filename[length] = 0;
+
+		bool mapped = false;
+		if (argumentCount > 2) JsBooleanToBool(arguments[2], &mapped);
+
+		traceAccess(TraceBlob, filename);
+		AssetData asset;
+		if (!(mapped ? mapAsset(filename, &asset) : readFile(filename, &asset))) return JS_INVALID_REFERENCE;
+		return createAssetBuffer(asset);
+	}
+
+	// The async loads read and decode files on the job threads. Textures are
+	// created and the callbacks called in update(), before the next frame.
+	// Callbacks get the same value as the blocking load or null on failure.
+	enum AssetType {
+		AssetImage,
+		AssetBlob,
+		AssetSound
+	};
+
+	struct AssetLoad {
+		AssetType type;
+		std::string filename;
+		JsValueRef name;
+		JsValueRef callback;
+		bool readable;
+		bool mapped;
+		int format;
+		bool loaded;
+		DecodedImage image;
+		AssetData data;
+	};
+
+	void loadAsset(void* data) {
+		AssetLoad* load = (AssetLoad*)data;
+		const char* filename = load->filename.c_str();
+		switch (load->type) {
+		case AssetImage:
+			load->loaded = decodeImage(filename, &load->image);
+			break;
+		case AssetBlob:
+			load->loaded = load->mapped ? mapAsset(filename, &load->data) : readFile(filename, &load->data);
+			break;
+		case AssetSound:
+			load->loaded = decodeSound(filename, load->format, &load->data);
+			break;
+		}
+	}
+
+	void completeAsset(void* data) {
+		AssetLoad* load = (AssetLoad*)data;
+		JsValueRef args[2];
+		JsGetUndefinedValue(&args[0]);
+		JsGetNullValue(&args[1]);
+		if (load->loaded) {
+			if (load->type == AssetImage) {
+				Kore::Graphics4::Texture* texture = createTexture(load->image, load->filename.c_str(), load->readable);
+				args[1] = createTextureObject(texture, load->name);
+			}
+			else {
+				args[1] = createAssetBuffer(load->data);
+			}
+		}
+		JsValueRef result;
+		JsCallFunction(load->callback, args, 2, &result);
+		JsRelease(load->callback, nullptr);
+		JsRelease(load->name, nullptr);
+		delete load;
+	}
+
+	void loadAsync(AssetType type, JsValueRef name, JsValueRef callback, bool readable, bool mapped, int format) {
+		char filename[256];
+		size_t length;
+		JsCopyString(name, filename, 255, &length);
+		filename[length] = 0;
+
+		if (type == AssetImage) traceAccess(TraceImage, filename);
+		else if (type == AssetBlob) traceAccess(TraceBlob, filename);
+		else traceAccess(TraceSound, filename, format);
+
+		AssetLoad* load = new AssetLoad;
+		load->type = type;
+		load->filename = filename;
+		load->name = name;
+		load->callback = callback;
+		load->readable = readable;
+		load->mapped = mapped;
+		load->format = format;
+		load->loaded = false;
+		JsAddRef(name, nullptr);
+		JsAddRef(callback, nullptr);
+		jobsSubmit(loadAsset, completeAsset, load);
+	}
+
+	// loadImageAsync(filename, readable, callback)
+	JsValueRef CALLBACK krom_load_image_async(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		bool readable;
+		JsBooleanToBool(arguments[2], &readable);
+		loadAsync(AssetImage, arguments[1], arguments[3], readable, false, 0);
+		return JS_INVALID_REFERENCE;
+	}
+
+	// loadBlobAsync(filename, callback, mapped)
+	JsValueRef CALLBACK krom_load_blob_async(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		bool mapped = false;
+		if (argumentCount > 3) JsBooleanToBool(arguments[3], &mapped);
+		loadAsync(AssetBlob, arguments[1], arguments[2], false, mapped, 0);
+		return JS_INVALID_REFERENCE;
+	}
+
+	// loadSoundAsync(filename, format, callback)
+	JsValueRef CALLBACK krom_load_sound_async(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		loadAsync(AssetSound, arguments[1], arguments[3], false, false, soundFormatArgument(arguments, argumentCount, 2));
+		return JS_INVALID_REFERENCE;
+	}
+
+	// loadImages(filenames, readable, callback) decodes a batch of images in
+	// parallel on the job threads. Once all are decoded the textures are
+	// created in order and the callback gets an array of image objects like
+	// loadImage returns, with null for images that failed to load.
+	struct ImageBatch {
+		JsValueRef names;
+		JsValueRef callback;
+		bool readable;
+		int remaining;
+		std::vector<std::string> filenames;
+		std::vector<DecodedImage> images;
+		std::vector<char> loaded;
+	};
+
+	struct BatchImage {
+		ImageBatch* batch;
+		int index;
+	};
+
+	void decodeBatchImage(void* data) {
+		BatchImage* item = (BatchImage*)data;
+		ImageBatch* batch = item->batch;
+		batch->loaded[item->index] = decodeImage(batch->filenames[item->index].c_str(), &batch->images[item->index]);
+	}
+
+	void completeImageBatch(ImageBatch* batch) {
+		JsValueRef args[2];
+		JsGetUndefinedValue(&args[0]);
+		JsCreateArray((unsigned)batch->filenames.size(), &args[1]);
+		for (size_t i = 0; i < batch->filenames.size(); ++i) {
+			JsValueRef index, name, image;
+			JsIntToNumber((int)i, &index);
+			if (batch->loaded[i]) {
+				JsGetIndexedProperty(batch->names, index, &name);
+				Kore::Graphics4::Texture* texture = createTexture(batch->images[i], batch->filenames[i].c_str(), batch->readable);
+				image = createTextureObject(texture, name);
+			}
+			else {
+				JsGetNullValue(&image);
+			}
+			JsSetIndexedProperty(args[1], index, image);
+		}
+		JsValueRef result;
+		JsCallFunction(batch->callback, args, 2, &result);
+		JsRelease(batch->callback, nullptr);
+		JsRelease(batch->names, nullptr);
+		delete batch;
+	}
+
+	void completeBatchImage(void* data) {
+		BatchImage* item = (BatchImage*)data;
+		ImageBatch* batch = item->batch;
+		delete item;
+		if (--batch->remaining == 0) completeImageBatch(batch);
+	}
+
+	JsValueRef CALLBACK krom_load_images(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef lengthObj;
+		JsGetProperty(arguments[1], ids[length_id], &lengthObj);
+		int length = 0;
+		JsNumberToInt(lengthObj, &length);
+		if (length < 0) length = 0;
+
+		ImageBatch* batch = new ImageBatch;
+		batch->names = arguments[1];
+		batch->callback = arguments[3];
+		JsBooleanToBool(arguments[2], &batch->readable);
+		batch->remaining = length;
+		batch->filenames.resize(length);
+		batch->images.resize(length);
+		batch->loaded.resize(length, 0);
+		for (int i = 0; i < length; ++i) {
+			JsValueRef index, name;
+			JsIntToNumber(i, &index);
+			JsGetIndexedProperty(arguments[1], index, &name);
+			char filename[256];
+			size_t filenameLength;
+			JsCopyString(name, filename, 255, &filenameLength);
+			filename[filenameLength] = 0;
+			batch->filenames[i] = filename;
+			traceAccess(TraceImage, filename);
+		}
+		JsAddRef(batch->names, nullptr);
+		JsAddRef(batch->callback, nullptr);
+
+		if (length == 0) {
+			completeImageBatch(batch);
+			return JS_INVALID_REFERENCE;
+		}
+		for (int i = 0; i < length; ++i) {
+			BatchImage* item = new BatchImage;
+			item->batch = batch;
+			item->index = i;
+			jobsSubmit(decodeBatchImage, completeBatchImage, item);
+		}
+		return JS_INVALID_REFERENCE;
+	}
+
+	void touchPages(const void* data, size_t size) {
+		const volatile Kore::u8* bytes = (const volatile Kore::u8*)data;
+		Kore::u8 sum = 0;
+		for (size_t i = 0; i < size; i += 4096) sum += bytes[i];
+		(void)sum;
+	}
+
+	void warmFile(const std::string& path) {
+		FileMapping mapping;
+		if (!mapFile(path.c_str(), &mapping)) return;
+		touchPages(mapping.data, mapping.size);
+		unmapFile(&mapping);
+	}
+
+	void warmAsset(const char* filename) {
+		PackFile packed;
+		if (findPacked(filename, &packed)) touchPages(packed.data, packed.storedSize);
+		else warmFile(assetPath(filename));
+	}
+
+	Semaphore* predecodeSemaphore = nullptr;
+
+	// Reading the source files needs nothing from Kore. The caches live in
+	// the save path, which is only known after System::init, so decoding
+	// waits for startPredecode.
+	void prefetchAssets(void* data) {
+		std::vector<TraceEntry>* entries = (std::vector<TraceEntry>*)data;
+		for (size_t i = 0; i < entries->size(); ++i) {
+			if ((*entries)[i].type != TraceStorage) warmAsset((*entries)[i].name.c_str());
+		}
+		predecodeSemaphore->wait();
+		for (size_t i = 0; i < entries->size(); ++i) {
+			const TraceEntry& entry = (*entries)[i];
+			const char* name = entry.name.c_str();
+			switch (entry.type) {
+			case TraceImage:
+				if (textureCache) {
+					DecodedImage decoded;
+					if (decodeImage(name, &decoded)) {
+						touchPages(decoded.pixels, decoded.width * decoded.height * Kore::Graphics4::Image::sizeOf(decoded.format));
+						releaseDecodedImage(decoded);
+					}
+				}
+				break;
+			case TraceSound:
+				if (soundCache && entry.format != SoundFormatCompressed) {
+					AssetData asset;
+					if (decodeSound(name, entry.format, &asset)) {
+						touchPages(asset.data, asset.size);
+						if (asset.mapping != nullptr) unmapArrayBuffer(asset.mapping);
+						else free(asset.data);
+					}
+				}
+				break;
+			case TraceStorage:
+				warmFile(std::string(Kore::System::savePath()) + name);
+				break;
+			case TraceBlob:
+				break;
+			}
+		}
+		delete entries;
+	}
+
+	void startPrefetch() {
+		if (!accessTrace) return;
+		std::vector<TraceEntry>* entries = new std::vector<TraceEntry>(readAccessTrace());
+		if (entries->empty()) {
+			delete entries;
+			return;
+		}
+		predecodeSemaphore = new Semaphore(0);
+		Kore::createAndRunThread(prefetchAssets, entries);
+	}
+
+	void startPredecode() {
+		if (predecodeSemaphore != nullptr) predecodeSemaphore->signal();
 	}
 
 	JsValueRef CALLBACK krom_get_constant_location(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
@@ -1286,10 +3544,11 @@ namespace {
 		size_t length;
 		JsCopyString(arguments[2], name, 255, &length);
 		name[length] = 0;
-		Kore::Graphics4::ConstantLocation location = pipeline->getConstantLocation(name);
+		double handle = constantLocations.find(pipeline, name);
+		if (handle == 0) handle = constantLocations.add(pipeline->getConstantLocation(name), pipeline, name);
 
 		JsValueRef obj;
-		JsCreateExternalObject(new Kore::Graphics4::ConstantLocation(location), nullptr, &obj);
+		JsDoubleToNumber(handle, &obj);
 		return obj;
 	}
 
@@ -1301,45 +3560,51 @@ namespace {
 		size_t length;
 		JsCopyString(arguments[2], name, 255, &length);
 		name[length] = 0;
-		Kore::Graphics4::TextureUnit unit = pipeline->getTextureUnit(name);
+		double handle = textureUnits.find(pipeline, name);
+		if (handle == 0) handle = textureUnits.add(pipeline->getTextureUnit(name), pipeline, name);
 
 		JsValueRef obj;
-		JsCreateExternalObject(new Kore::Graphics4::TextureUnit(unit), nullptr, &obj);
+		JsDoubleToNumber(handle, &obj);
 		return obj;
 	}
 
-	JsValueRef CALLBACK krom_set_texture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
-
+	void setTexture(Kore::Graphics4::TextureUnit* unit, JsValueRef textureObj) {
 		Kore::Graphics4::Texture* texture;
 		bool imageChanged = false;
 		if (debugMode) {
 			JsValueRef filenameObj;
-			JsGetProperty(arguments[2], getId("filename"), &filenameObj);
+			JsGetProperty(textureObj, ids[filename_id], &filenameObj);
 			size_t length;
 			if (JsCopyString(filenameObj, tempString, tempStringSize, &length) == JsNoError) {
 				tempString[length] = 0;
 				if (imageChanges[tempString]) {
 					imageChanges[tempString] = false;
 					sendLogMessage("Image %s changed.", tempString);
+					Kore::Graphics4::Texture* oldTexture;
+					JsGetExternalData(textureObj, (void**)&oldTexture);
+					deleteLater(ResourceTexture, oldTexture);
 					texture = new Kore::Graphics4::Texture(tempString);
-					JsSetExternalData(arguments[2], texture);
+					JsSetExternalData(textureObj, texture);
 					imageChanged = true;
 				}
 			}
 		}
 		if (!imageChanged) {
-			JsGetExternalData(arguments[2], (void**)&texture);
+			JsGetExternalData(textureObj, (void**)&texture);
 		}
 		Kore::Graphics4::setTexture(*unit, texture);
+	}
 
+	JsValueRef CALLBACK krom_set_texture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
+		setTexture(unit, arguments[2]);
 		return JS_INVALID_REFERENCE;
 	}
 
 	JsValueRef CALLBACK krom_set_render_target(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(arguments[2], (void**)&renderTarget);
@@ -1349,8 +3614,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_depth(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(arguments[2], (void**)&renderTarget);
@@ -1360,8 +3625,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_image_texture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::Texture* texture;
 		JsGetExternalData(arguments[2], (void**)&texture);
@@ -1407,8 +3672,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_parameters(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 		int u, v, min, max, mip;
 		JsNumberToInt(arguments[2], &u);
 		JsNumberToInt(arguments[3], &v);
@@ -1424,8 +3689,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_3d_parameters(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 		int u, v, w, min, max, mip;
 		JsNumberToInt(arguments[2], &u);
 		JsNumberToInt(arguments[3], &v);
@@ -1443,8 +3708,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_compare_mode(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 		bool enabled;
 		JsBooleanToBool(arguments[2], &enabled);
 		Kore::Graphics4::setTextureCompareMode(*unit, enabled);
@@ -1452,8 +3717,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_cube_map_compare_mode(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::TextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::Graphics4::TextureUnit* unit = getHandle(textureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 		bool enabled;
 		JsBooleanToBool(arguments[2], &enabled);
 		Kore::Graphics4::setCubeMapCompareMode(*unit, enabled);
@@ -1461,8 +3726,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_bool(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		bool value;
 		JsBooleanToBool(arguments[2], &value);
 		Kore::Graphics4::setBool(*location, value);
@@ -1470,8 +3735,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_int(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		int value;
 		JsNumberToInt(arguments[2], &value);
 		Kore::Graphics4::setInt(*location, value);
@@ -1479,8 +3744,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value;
 		JsNumberToDouble(arguments[2], &value);
 		Kore::Graphics4::setFloat(*location, value);
@@ -1488,8 +3753,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float2(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -1498,8 +3763,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float3(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2, value3;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -1509,8 +3774,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float4(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2, value3, value4;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -1521,8 +3786,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_floats(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -1535,8 +3800,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_matrix(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -1555,8 +3820,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_matrix3(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::Graphics4::ConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::Graphics4::ConstantLocation* location = getHandle(constantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -1669,18 +3934,53 @@ namespace {
 		return value;
 	}
 
+	// Saves are written behind by savewriter.h on its own thread, from a copy
+	// of the buffer. The optional callback gets whether the write reached the
+	// disk and is called from update().
+	std::map<int, JsValueRef> saveCallbacks;
+
+	void queueSave(const char* path, JsValueRef buffer, JsValueRef* arguments, unsigned short argumentCount, int callbackIndex) {
+		Kore::u8* content;
+		unsigned bufferLength;
+		if (JsGetArrayBufferStorage(buffer, &content, &bufferLength) != JsNoError) return;
+		void* data = malloc(bufferLength > 0 ? bufferLength : 1);
+		memcpy(data, content, bufferLength);
+		int id = saveWrite(path, data, bufferLength);
+
+		if (argumentCount > callbackIndex) {
+			JsValueType type;
+			JsGetValueType(arguments[callbackIndex], &type);
+			if (type == JsFunction) {
+				JsAddRef(arguments[callbackIndex], nullptr);
+				saveCallbacks[id] = arguments[callbackIndex];
+			}
+		}
+	}
+
+	void deliverSaves() {
+		SaveResult results[16];
+		int count;
+		while ((count = saveTakeFinished(results, 16)) > 0) {
+			for (int i = 0; i < count; ++i) {
+				std::map<int, JsValueRef>::iterator it = saveCallbacks.find(results[i].id);
+				if (it == saveCallbacks.end()) continue;
+				JsValueRef args[2];
+				JsGetUndefinedValue(&args[0]);
+				JsBoolToBoolean(results[i].success, &args[1]);
+				JsValueRef result;
+				JsCallFunction(it->second, args, 2, &result);
+				JsRelease(it->second, nullptr);
+				saveCallbacks.erase(it);
+			}
+		}
+	}
+
 	JsValueRef CALLBACK krom_write_storage(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		size_t length;
 		JsCopyString(arguments[1], tempString, tempStringSize, &length);
 		tempString[length] = 0;
 
-		Kore::u8* buffer;
-		unsigned bufferLength;
-		JsGetArrayBufferStorage(arguments[2], &buffer, &bufferLength);
-		
-		Kore::FileWriter writer;
-		if (!writer.open(tempString)) return JS_INVALID_REFERENCE;
-		writer.write(buffer, (int)bufferLength);
+		queueSave((std::string(Kore::System::savePath()) + tempString).c_str(), arguments[2], arguments, argumentCount, 3);
 		return JS_INVALID_REFERENCE;
 	}
 
@@ -1689,6 +3989,18 @@ namespace {
 		JsCopyString(arguments[1], tempString, tempStringSize, &length);
 		tempString[length] = 0;
 
+		traceAccess(TraceStorage, tempString);
+		std::vector<unsigned char> pending;
+		if (saveReadPending((std::string(Kore::System::savePath()) + tempString).c_str(), pending)) {
+			JsValueRef buffer;
+			JsCreateArrayBuffer((unsigned)pending.size(), &buffer);
+			Kore::u8* bufferData;
+			unsigned bufferLength;
+			JsGetArrayBufferStorage(buffer, &bufferData, &bufferLength);
+			if (!pending.empty()) memcpy(bufferData, pending.data(), pending.size());
+			return buffer;
+		}
+
 		Kore::FileReader reader;
 		if (!reader.open(tempString, Kore::FileReader::Save)) return JS_INVALID_REFERENCE;
 
@@ -1704,6 +4016,63 @@ namespace {
 		return buffer;
 	}
 
+	// The key value store lives in krom.kv in the save path and is opened on
+	// first use. kvGet returns an ArrayBuffer or null.
+	bool openStore() {
+		static bool opened = false;
+		static bool available = false;
+		if (!opened) {
+			opened = true;
+			available = kvOpen((std::string(Kore::System::savePath()) + "krom.kv").c_str());
+			if (!available) Kore::log(Kore::Warning, "Could not open the key value store.");
+		}
+		return available;
+	}
+
+	std::string keyArgument(JsValueRef value) {
+		size_t length;
+		JsCopyString(value, tempString, tempStringSize, &length);
+		return std::string(tempString, length);
+	}
+
+	JsValueRef CALLBACK krom_kv_get(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		std::vector<Kore::u8> value;
+		if (!openStore() || !kvGet(keyArgument(arguments[1]), value)) {
+			JsValueRef null;
+			JsGetNullValue(&null);
+			return null;
+		}
+		JsValueRef buffer;
+		JsCreateArrayBuffer((unsigned)value.size(), &buffer);
+		Kore::u8* bufferData;
+		unsigned bufferLength;
+		JsGetArrayBufferStorage(buffer, &bufferData, &bufferLength);
+		if (!value.empty()) memcpy(bufferData, value.data(), value.size());
+		return buffer;
+	}
+
+	JsValueRef CALLBACK krom_kv_put(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		Kore::u8* content;
+		unsigned bufferLength;
+		bool written = openStore() && JsGetArrayBufferStorage(arguments[2], &content, &bufferLength) == JsNoError
+			&& kvPut(keyArgument(arguments[1]), content, bufferLength);
+		JsValueRef value;
+		JsBoolToBoolean(written, &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_kv_delete(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsBoolToBoolean(openStore() && kvDelete(keyArgument(arguments[1])), &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_kv_flush(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsBoolToBoolean(kvFlush(), &value);
+		return value;
+	}
+
 	JsValueRef CALLBACK krom_create_render_target(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		int value1, value2, value3, value4, value5;
 		JsNumberToInt(arguments[1], &value1);
@@ -1714,14 +4083,16 @@ namespace {
 		Kore::Graphics4::RenderTarget* renderTarget = new Kore::Graphics4::RenderTarget(value1, value2, value3, false, (Kore::Graphics4::RenderTargetFormat)value4, value5);
 
 		JsValueRef value;
-		JsCreateExternalObject(renderTarget, nullptr, &value);
+		JsCreateExternalObject(renderTarget, finalizeResource<ResourceRenderTarget>, &value);
 
-		JsValueRef width, height;
+		JsValueRef width, height, format;
 		JsIntToNumber(renderTarget->width, &width);
 		JsIntToNumber(renderTarget->height, &height);
+		JsIntToNumber(value4, &format);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[format_id], format, false);
 
 		return value;
 	}
@@ -1735,14 +4106,16 @@ namespace {
 		Kore::Graphics4::RenderTarget* renderTarget = new Kore::Graphics4::RenderTarget(value1, value2, false, (Kore::Graphics4::RenderTargetFormat)value3, value4);
 
 		JsValueRef value;
-		JsCreateExternalObject(renderTarget, nullptr, &value);
+		JsCreateExternalObject(renderTarget, finalizeResource<ResourceRenderTarget>, &value);
 
-		JsValueRef width, height;
+		JsValueRef width, height, format;
 		JsIntToNumber(renderTarget->width, &width);
 		JsIntToNumber(renderTarget->height, &height);
+		JsIntToNumber(value3, &format);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[format_id], format, false);
 		
 		return value;
 	}
@@ -1755,7 +4128,7 @@ namespace {
 		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(value1, value2, (Kore::Graphics4::Image::Format)value3, false);
 
 		JsValueRef value;
-		JsCreateExternalObject(texture, nullptr, &value);
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &value);
 
 		JsValueRef width, height, realWidth, realHeight;
 		JsIntToNumber(texture->width, &width);
@@ -1763,10 +4136,10 @@ namespace {
 		JsIntToNumber(texture->texWidth, &realWidth);
 		JsIntToNumber(texture->texHeight, &realHeight);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
-		JsSetProperty(value, getId("realWidth"), realWidth, false);
-		JsSetProperty(value, getId("realHeight"), realHeight, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[realWidth_id], realWidth, false);
+		JsSetProperty(value, ids[realHeight_id], realHeight, false);
 		
 		return value;
 	}
@@ -1780,7 +4153,7 @@ namespace {
 		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(value1, value2, value3, (Kore::Graphics4::Image::Format)value4, false);
 
 		JsValueRef tex;
-		JsCreateExternalObject(texture, nullptr, &tex);
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &tex);
 
 		JsValueRef width, height, depth, realWidth, realHeight;
 		JsIntToNumber(texture->width, &width);
@@ -1789,11 +4162,11 @@ namespace {
 		JsIntToNumber(texture->texWidth, &realWidth);
 		JsIntToNumber(texture->texHeight, &realHeight);
 
-		JsSetProperty(tex, getId("width"), width, false);
-		JsSetProperty(tex, getId("height"), height, false);
-		JsSetProperty(tex, getId("depth"), depth, false);
-		JsSetProperty(tex, getId("realWidth"), realWidth, false);
-		JsSetProperty(tex, getId("realHeight"), realHeight, false);
+		JsSetProperty(tex, ids[width_id], width, false);
+		JsSetProperty(tex, ids[height_id], height, false);
+		JsSetProperty(tex, ids[depth_id], depth, false);
+		JsSetProperty(tex, ids[realWidth_id], realWidth, false);
+		JsSetProperty(tex, ids[realHeight_id], realHeight, false);
 
 		return tex;
 	}
@@ -1813,7 +4186,7 @@ namespace {
 		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(content, value2, value3, (Kore::Graphics4::Image::Format)value4, value5);
 
 		JsValueRef value;
-		JsCreateExternalObject(texture, nullptr, &value);
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &value);
 		
 		JsValueRef width, height, realWidth, realHeight;
 		JsIntToNumber(texture->width, &width);
@@ -1821,10 +4194,10 @@ namespace {
 		JsIntToNumber(texture->texWidth, &realWidth);
 		JsIntToNumber(texture->texHeight, &realHeight);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
-		JsSetProperty(value, getId("realWidth"), realWidth, false);
-		JsSetProperty(value, getId("realHeight"), realHeight, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[realWidth_id], realWidth, false);
+		JsSetProperty(value, ids[realHeight_id], realHeight, false);
 
 		return value;
 	}
@@ -1845,7 +4218,7 @@ namespace {
 		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(content, value2, value3, value4, (Kore::Graphics4::Image::Format)value5, value6);
 
 		JsValueRef value;
-		JsCreateExternalObject(texture, nullptr, &value);
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &value);
 
 		JsValueRef width, height, depth, realWidth, realHeight;
 		JsIntToNumber(texture->width, &width);
@@ -1854,11 +4227,11 @@ namespace {
 		JsIntToNumber(texture->texWidth, &realWidth);
 		JsIntToNumber(texture->texHeight, &realHeight);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
-		JsSetProperty(value, getId("depth"), depth, false);
-		JsSetProperty(value, getId("realWidth"), realWidth, false);
-		JsSetProperty(value, getId("realHeight"), realHeight, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[depth_id], depth, false);
+		JsSetProperty(value, ids[realWidth_id], realWidth, false);
+		JsSetProperty(value, ids[realHeight_id], realHeight, false);
 
 		return value;
 	}
@@ -1878,7 +4251,7 @@ namespace {
 		Kore::Graphics4::Texture* texture = new Kore::Graphics4::Texture(content, bufferLength, format, readable);
 
 		JsValueRef value;
-		JsCreateExternalObject(texture, nullptr, &value);
+		JsCreateExternalObject(texture, finalizeResource<ResourceTexture>, &value);
 		
 		JsValueRef width, height, realWidth, realHeight;
 		JsIntToNumber(texture->width, &width);
@@ -1886,10 +4259,10 @@ namespace {
 		JsIntToNumber(texture->texWidth, &realWidth);
 		JsIntToNumber(texture->texHeight, &realHeight);
 
-		JsSetProperty(value, getId("width"), width, false);
-		JsSetProperty(value, getId("height"), height, false);
-		JsSetProperty(value, getId("realWidth"), realWidth, false);
-		JsSetProperty(value, getId("realHeight"), realHeight, false);
+		JsSetProperty(value, ids[width_id], width, false);
+		JsSetProperty(value, ids[height_id], height, false);
+		JsSetProperty(value, ids[realWidth_id], realWidth, false);
+		JsSetProperty(value, ids[realHeight_id], realHeight, false);
 
 		return value;
 	}
@@ -1939,6 +4312,181 @@ namespace {
 		return JS_INVALID_REFERENCE;
 	}
 
+	int renderTargetByteSize(int format) {
+		switch (format) {
+		case Kore::Graphics4::Target64BitFloat:
+			return 8;
+		case Kore::Graphics4::Target128BitFloat:
+			return 16;
+		case Kore::Graphics4::Target16BitDepth:
+		case Kore::Graphics4::Target16BitRedFloat:
+			return 2;
+		case Kore::Graphics4::Target8BitRed:
+			return 1;
+		default:
+			return 4;
+		}
+	}
+
+	// Readbacks requested during a frame run at the start of the next
+	// update(), after the frame was presented, so they no longer interrupt
+	// command recording. They are deferred, not asynchronous: Kore has no
+	// copies into staging resources or fences, so every readback is still a
+	// synchronous getPixels that waits for the GPU to finish all queued work,
+	// only at a point where no commands are being recorded. Only render
+	// targets can be read back, the CPU copy of a texture does not contain
+	// anything written to it on the GPU. Requests see the contents at the end
+	// of the frame they were made in.
+	struct Readback {
+		JsValueRef object;
+		JsValueRef callback;
+	};
+
+	const int maxReadbacks = 16;
+	std::vector<Readback> readbacks;
+
+	bool requestReadback(JsValueRef object, JsValueRef callback) {
+		if ((int)readbacks.size() >= maxReadbacks) return false;
+		Readback readback;
+		readback.object = object;
+		readback.callback = callback;
+		JsAddRef(object, nullptr);
+		JsAddRef(callback, nullptr);
+		readbacks.push_back(readback);
+		return true;
+	}
+
+	JsValueRef readPixels(const Readback& readback) {
+		JsValueRef buffer;
+		JsGetNullValue(&buffer);
+		Kore::Graphics4::RenderTarget* renderTarget;
+		if (JsGetExternalData(readback.object, (void**)&renderTarget) != JsNoError || renderTarget == nullptr) return buffer;
+		JsValueRef formatObj;
+		int format = 0;
+		JsGetProperty(readback.object, ids[format_id], &formatObj);
+		JsNumberToInt(formatObj, &format);
+		Kore::u8* bufferData;
+		unsigned bufferLength;
+		JsCreateArrayBuffer(renderTargetByteSize(format) * renderTarget->texWidth * renderTarget->texHeight, &buffer);
+		JsGetArrayBufferStorage(buffer, &bufferData, &bufferLength);
+		renderTarget->getPixels(bufferData);
+		return buffer;
+	}
+
+	void processReadbacks() {
+		if (readbacks.empty()) return;
+		std::vector<Readback> pending;
+		pending.swap(readbacks);
+		for (size_t i = 0; i < pending.size(); ++i) {
+			JsValueRef args[2];
+			JsGetUndefinedValue(&args[0]);
+			args[1] = readPixels(pending[i]);
+			JsValueRef result;
+			JsCallFunction(pending[i].callback, args, 2, &result);
+			JsRelease(pending[i].object, nullptr);
+			JsRelease(pending[i].callback, nullptr);
+		}
+	}
+
+	// requestRenderTargetPixelsAsync(renderTarget, callback) returns false
+	// when too many readbacks are pending. The callback gets a new
+	// ArrayBuffer, or null if the target was deleted in the meantime.
+	// requestTexturePixelsAsync(texture, callback) always returns false,
+	// textures have to be rendered to a render target to be read back.
+	JsValueRef CALLBACK krom_request_render_target_pixels_async(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsBoolToBoolean(requestReadback(arguments[1], arguments[2]), &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_request_texture_pixels_async(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsBoolToBoolean(false, &value);
+		return value;
+	}
+
+	// Captures the render target set with setCaptureTarget. Like readbacks
+	// the pixels are read at the start of the next update(), encoding and
+	// writing happen on the capture threads. The read is a blocking
+	// getPixels, so every captured frame costs a full GPU sync and capturing
+	// lowers the frame rate. Kore can not read back the framebuffer, so
+	// applications that want to capture the screen render it to a target
+	// first.
+	JsValueRef captureTarget = JS_INVALID_REFERENCE;
+	bool captureRendered = false;
+	std::string capturePath;
+	// --capture without a target set in the first frame captures nothing
+	bool captureNeedsTarget = false;
+
+	void captureFrame() {
+		if (!captureRendered) return;
+		captureRendered = false;
+		Kore::Graphics4::RenderTarget* renderTarget;
+		if (JsGetExternalData(captureTarget, (void**)&renderTarget) != JsNoError || renderTarget == nullptr) return;
+		Kore::u8* pixels = captureAcquire((size_t)renderTarget->texWidth * renderTarget->texHeight * 4);
+		if (pixels == nullptr) return;
+		renderTarget->getPixels(pixels);
+		captureSubmit(renderTarget->width, renderTarget->height, renderTarget->texWidth, Kore::Graphics4::renderTargetsInvertedY());
+	}
+
+	// setCaptureTarget(renderTarget) only accepts 32 bit targets, null clears
+	// the target.
+	JsValueRef CALLBACK krom_set_capture_target(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueType type;
+		JsGetValueType(arguments[1], &type);
+		bool accepted = type == JsNull || type == JsUndefined;
+		if (!accepted) {
+			JsValueRef formatObj;
+			int format = -1;
+			JsGetProperty(arguments[1], ids[format_id], &formatObj);
+			JsNumberToInt(formatObj, &format);
+			accepted = format == Kore::Graphics4::Target32Bit;
+		}
+		if (accepted) {
+			if (captureTarget != JS_INVALID_REFERENCE) JsRelease(captureTarget, nullptr);
+			captureTarget = type == JsNull || type == JsUndefined ? JS_INVALID_REFERENCE : arguments[1];
+			if (captureTarget != JS_INVALID_REFERENCE) JsAddRef(captureTarget, nullptr);
+			captureRendered = false;
+		}
+		JsValueRef value;
+		JsBoolToBoolean(accepted, &value);
+		return value;
+	}
+
+	// startCapture(path, fps) writes a PNG sequence to the directory path or
+	// a Y4M video when path ends in .y4m. Without a path it uses the path
+	// passed with --capture or a capture directory next to the assets.
+	JsValueRef CALLBACK krom_start_capture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		std::string path = capturePath;
+		int fps = 60;
+		if (argumentCount > 1) {
+			JsValueType type;
+			JsGetValueType(arguments[1], &type);
+			if (type == JsString) {
+				size_t length;
+				JsCopyString(arguments[1], tempString, tempStringSize, &length);
+				path = std::string(tempString, length);
+			}
+		}
+		if (argumentCount > 2) JsNumberToInt(arguments[2], &fps);
+		captureRendered = false;
+		JsValueRef value;
+		JsBoolToBoolean(captureStart(path.c_str(), fps), &value);
+		return value;
+	}
+
+	JsValueRef CALLBACK krom_stop_capture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		captureStop();
+		captureRendered = false;
+		return JS_INVALID_REFERENCE;
+	}
+
+	JsValueRef CALLBACK krom_get_capture_dropped_frames(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		JsValueRef value;
+		JsIntToNumber(captureDropped(), &value);
+		return value;
+	}
+
 	JsValueRef CALLBACK krom_lock_texture(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		Kore::Graphics4::Texture* texture;
 		JsGetExternalData(arguments[1], (void**)&texture);
@@ -1995,7 +4543,7 @@ namespace {
 		JsGetExternalData(arguments[1], (void**)&texture);
 
 		JsValueRef lengthObj;
-		JsGetProperty(arguments[2], getId("length"), &lengthObj);
+		JsGetProperty(arguments[2], ids[length_id], &lengthObj);
 		int length;
 		JsNumberToInt(lengthObj, &length);
 		for (int i = 0; i < length; ++i) {
@@ -2003,7 +4551,7 @@ namespace {
 			JsIntToNumber(i, &index);
 			JsGetIndexedProperty(arguments[2], index, &element);
 			JsValueRef obj;
-			JsGetProperty(element, getId("texture_"), &obj);
+			JsGetProperty(element, ids[texture__id], &obj);
 			Kore::Graphics4::Texture* mipmap;
 			JsGetExternalData(obj, (void**)&mipmap);
 			texture->setMipmap(mipmap, i + 1);
@@ -2064,7 +4612,7 @@ namespace {
 		}
 		else {
 			JsValueRef rt;
-			JsGetProperty(arguments[1], getId("renderTarget_"), &rt);
+			JsGetProperty(arguments[1], ids[renderTarget__id], &rt);
 			Kore::Graphics4::RenderTarget* renderTarget;
 			JsGetExternalData(rt, (void**)&renderTarget);
 
@@ -2076,7 +4624,7 @@ namespace {
 			else {
 				Kore::Graphics4::RenderTarget* renderTargets[8] = { renderTarget, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
 				JsValueRef lengthObj;
-				JsGetProperty(arguments[2], getId("length"), &lengthObj);
+				JsGetProperty(arguments[2], ids[length_id], &lengthObj);
 				int length;
 				JsNumberToInt(lengthObj, &length);
 				if (length > 7) length = 7;
@@ -2085,7 +4633,7 @@ namespace {
 					JsIntToNumber(i, &index);
 					JsGetIndexedProperty(arguments[2], index, &element);
 					JsValueRef obj;
-					JsGetProperty(element, getId("renderTarget_"), &obj);
+					JsGetProperty(element, ids[renderTarget__id], &obj);
 					Kore::Graphics4::RenderTarget* art;
 					JsGetExternalData(obj, (void**)&art);
 					renderTargets[i + 1] = art;
@@ -2098,7 +4646,7 @@ namespace {
 
 	JsValueRef CALLBACK krom_begin_face(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		JsValueRef rt;
-		JsGetProperty(arguments[1], getId("renderTarget_"), &rt);
+		JsGetProperty(arguments[1], ids[renderTarget__id], &rt);
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(rt, (void**)&renderTarget);
 		int face;
@@ -2116,14 +4664,7 @@ namespace {
 		JsCopyString(arguments[1], tempString, tempStringSize, &length);
 		tempString[length] = 0;
 
-		Kore::u8* content;
-		unsigned bufferLength;
-		JsGetArrayBufferStorage(arguments[2], &content, &bufferLength);
-
-		FILE* file = fopen(tempString, "wb");
-		if (file == nullptr) return JS_INVALID_REFERENCE;
-		fwrite(content, 1, (int)bufferLength, file);
-		fclose(file);
+		queueSave(tempString, arguments[2], arguments, argumentCount, 3);
 		return JS_INVALID_REFERENCE;
 	}
 
@@ -2165,8 +4706,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_bool_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		int value;
 		JsNumberToInt(arguments[2], &value);
 		Kore::Compute::setBool(*location, value != 0);
@@ -2174,8 +4715,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_int_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		int value;
 		JsNumberToInt(arguments[2], &value);
 		Kore::Compute::setInt(*location, value);
@@ -2183,8 +4724,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value;
 		JsNumberToDouble(arguments[2], &value);
 		Kore::Compute::setFloat(*location, value);
@@ -2192,8 +4733,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float2_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -2202,8 +4743,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float3_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2, value3;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -2213,8 +4754,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_float4_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 		double value1, value2, value3, value4;
 		JsNumberToDouble(arguments[2], &value1);
 		JsNumberToDouble(arguments[3], &value2);
@@ -2225,8 +4766,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_floats_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -2240,8 +4781,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_matrix_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -2260,8 +4801,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_matrix3_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeConstantLocation* location;
-		JsGetExternalData(arguments[1], (void**)&location);
+		Kore::ComputeConstantLocation* location = getHandle(computeConstantLocations, arguments[1]);
+		if (location == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::u8* data;
 		unsigned bufferLength;
@@ -2279,8 +4820,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::Texture* texture;
 		JsGetExternalData(arguments[2], (void**)&texture);
@@ -2294,8 +4835,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_render_target_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(arguments[2], (void**)&renderTarget);
@@ -2309,8 +4850,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_sampled_texture_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::Texture* texture;
 		JsGetExternalData(arguments[2], (void**)&texture);
@@ -2320,8 +4861,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_sampled_render_target_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(arguments[2], (void**)&renderTarget);
@@ -2331,8 +4872,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_sampled_depth_texture_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		Kore::Graphics4::RenderTarget* renderTarget;
 		JsGetExternalData(arguments[2], (void**)&renderTarget);
@@ -2342,8 +4883,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_parameters_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		int u, v, min, max, mip;
 		JsNumberToInt(arguments[2], &u);
@@ -2362,8 +4903,8 @@ namespace {
 	}
 
 	JsValueRef CALLBACK krom_set_texture_3d_parameters_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
-		Kore::ComputeTextureUnit* unit;
-		JsGetExternalData(arguments[1], (void**)&unit);
+		Kore::ComputeTextureUnit* unit = getHandle(computeTextureUnits, arguments[1]);
+		if (unit == nullptr) return JS_INVALID_REFERENCE;
 
 		int u, v, w, min, max, mip;
 		JsNumberToInt(arguments[2], &u);
@@ -2398,14 +4939,15 @@ namespace {
 		Kore::ComputeShader* shader = new Kore::ComputeShader(content, (int)bufferLength);
 
 		JsValueRef value;
-		JsCreateExternalObject(shader, nullptr, &value);
+		JsCreateExternalObject(shader, finalizeResource<ResourceComputeShader>, &value);
 		return value;
 	}
 
 	JsValueRef CALLBACK krom_delete_shader_compute(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
 		Kore::ComputeShader* shader;
 		JsGetExternalData(arguments[1], (void**)&shader);
-		delete shader;
+		deleteComputeShader(shader);
+		JsSetExternalData(arguments[1], nullptr);
 		return JS_INVALID_REFERENCE;
 	}
 
@@ -2417,10 +4959,11 @@ namespace {
 		JsCopyString(arguments[2], tempString, tempStringSize, &length);
 		tempString[length] = 0;
 
-		Kore::ComputeConstantLocation location = shader->getConstantLocation(tempString);
+		double handle = computeConstantLocations.find(shader, tempString);
+		if (handle == 0) handle = computeConstantLocations.add(shader->getConstantLocation(tempString), shader, tempString);
 
 		JsValueRef value;
-		JsCreateExternalObject(new Kore::ComputeConstantLocation(location), nullptr, &value);
+		JsDoubleToNumber(handle, &value);
 
 		return value;
 	}
@@ -2433,10 +4976,11 @@ namespace {
 		JsCopyString(arguments[2], tempString, tempStringSize, &length);
 		tempString[length] = 0;
 
-		Kore::ComputeTextureUnit unit = shader->getTextureUnit(tempString);
+		double handle = computeTextureUnits.find(shader, tempString);
+		if (handle == 0) handle = computeTextureUnits.add(shader->getTextureUnit(tempString), shader, tempString);
 
 		JsValueRef value;
-		JsCreateExternalObject(new Kore::ComputeTextureUnit(unit), nullptr, &value);
+		JsDoubleToNumber(handle, &value);
 
 		return value;
 	}
@@ -2450,16 +4994,267 @@ namespace {
 		return JS_INVALID_REFERENCE;
 	}
 
+	// Opcodes for Krom.submitCommands(commands, length, handles). The command
+	// buffer is a stream of 32 bit words, each command being its opcode followed
+	// by its arguments. Resources are passed as indices into the handles array,
+	// floats are stored as Float32 bit patterns.
+	enum Command {
+		CommandEnd = 0,
+		CommandSetPipeline = 1,         // pipeline
+		CommandSetVertexBuffer = 2,     // vertexBuffer
+		CommandSetVertexBuffers = 3,    // count, vertexBuffer * count
+		CommandSetIndexBuffer = 4,      // indexBuffer
+		CommandSetTexture = 5,          // textureUnit, texture
+		CommandSetRenderTarget = 6,     // textureUnit, renderTarget
+		CommandSetTextureDepth = 7,     // textureUnit, renderTarget
+		CommandSetTextureParameters = 8,// textureUnit, u, v, min, max, mip
+		CommandSetBool = 9,             // location, value
+		CommandSetInt = 10,             // location, value
+		CommandSetFloat = 11,           // location, float
+		CommandSetFloat2 = 12,          // location, float * 2
+		CommandSetFloat3 = 13,          // location, float * 3
+		CommandSetFloat4 = 14,          // location, float * 4
+		CommandSetFloats = 15,          // location, count, float * count
+		CommandSetMatrix = 16,          // location, float * 16
+		CommandSetMatrix3 = 17,         // location, float * 9
+		CommandDrawIndexedVertices = 18,// start, count
+		CommandDrawIndexedVerticesInstanced = 19, // instanceCount, start, count
+		CommandViewport = 20,           // x, y, w, h
+		CommandScissor = 21,            // x, y, w, h
+		CommandDisableScissor = 22,
+		CommandClear = 23               // flags, color, float depth, stencil
+	};
+
+	std::vector<JsValueRef> commandHandles;
+	std::vector<void*> commandHandleData;
+
+	JsValueRef CALLBACK krom_submit_commands(JsValueRef callee, bool isConstructCall, JsValueRef *arguments, unsigned short argumentCount, void *callbackState) {
+		Kore::u8* data;
+		unsigned bufferLength;
+		JsGetArrayBufferStorage(arguments[1], &data, &bufferLength);
+		int length;
+		JsNumberToInt(arguments[2], &length);
+		if (length < 0 || (unsigned)length > bufferLength / 4) length = bufferLength / 4;
+
+		JsValueRef handleLengthObj;
+		JsGetProperty(arguments[3], ids[length_id], &handleLengthObj);
+		int handleCount = 0;
+		JsNumberToInt(handleLengthObj, &handleCount);
+		commandHandles.resize(handleCount);
+		commandHandleData.resize(handleCount);
+		for (int i = 0; i < handleCount; ++i) {
+			JsValueRef index;
+			JsIntToNumber(i, &index);
+			JsGetIndexedProperty(arguments[3], index, &commandHandles[i]);
+			commandHandleData[i] = nullptr;
+			JsGetExternalData(commandHandles[i], &commandHandleData[i]);
+		}
+
+		Kore::s32* words = (Kore::s32*)data;
+		float* floats = (float*)data;
+		int pc = 0;
+
+#define commandArgs(count) if ((count) < 0 || (count) > length - pc) { sendLogMessage("Truncated command buffer."); return JS_INVALID_REFERENCE; }
+#define commandHandle(offset) ((unsigned)words[pc + (offset)] < (unsigned)handleCount ? commandHandleData[words[pc + (offset)]] : nullptr)
+#define commandObject(offset) ((unsigned)words[pc + (offset)] < (unsigned)handleCount ? commandHandles[words[pc + (offset)]] : JS_INVALID_REFERENCE)
+#define commandLocation(offset) getHandle(constantLocations, commandObject(offset))
+#define commandTextureUnit(offset) getHandle(textureUnits, commandObject(offset))
+
+		// Commands that refer to deleted or invalid handles are skipped
+		while (pc < length) {
+			int command = words[pc++];
+			switch (command) {
+			case CommandEnd:
+				return JS_INVALID_REFERENCE;
+			case CommandSetPipeline:
+				commandArgs(1);
+				if (commandHandle(0) != nullptr) setPipeline(commandObject(0));
+				pc += 1;
+				break;
+			case CommandSetVertexBuffer:
+				commandArgs(1);
+				if (Kore::Graphics4::VertexBuffer* vertexBuffer = (Kore::Graphics4::VertexBuffer*)commandHandle(0)) Kore::Graphics4::setVertexBuffer(*vertexBuffer);
+				pc += 1;
+				break;
+			case CommandSetVertexBuffers: {
+				commandArgs(1);
+				int count = words[pc++];
+				commandArgs(count);
+				// Only the first eight are bound, the rest is skipped
+				int used = count < 8 ? count : 8;
+				Kore::Graphics4::VertexBuffer* vertexBuffers[8];
+				bool valid = true;
+				for (int i = 0; i < used; ++i) {
+					vertexBuffers[i] = (Kore::Graphics4::VertexBuffer*)commandHandle(i);
+					valid = valid && vertexBuffers[i] != nullptr;
+				}
+				if (valid) Kore::Graphics4::setVertexBuffers(vertexBuffers, used);
+				pc += count;
+				break;
+			}
+			case CommandSetIndexBuffer:
+				commandArgs(1);
+				if (Kore::Graphics4::IndexBuffer* indexBuffer = (Kore::Graphics4::IndexBuffer*)commandHandle(0)) Kore::Graphics4::setIndexBuffer(*indexBuffer);
+				pc += 1;
+				break;
+			case CommandSetTexture:
+				commandArgs(2);
+				if (Kore::Graphics4::TextureUnit* unit = commandTextureUnit(0)) {
+					if (commandHandle(1) != nullptr) setTexture(unit, commandObject(1));
+				}
+				pc += 2;
+				break;
+			case CommandSetRenderTarget:
+				commandArgs(2);
+				if (Kore::Graphics4::TextureUnit* unit = commandTextureUnit(0)) {
+					if (Kore::Graphics4::RenderTarget* renderTarget = (Kore::Graphics4::RenderTarget*)commandHandle(1)) renderTarget->useColorAsTexture(*unit);
+				}
+				pc += 2;
+				break;
+			case CommandSetTextureDepth:
+				commandArgs(2);
+				if (Kore::Graphics4::TextureUnit* unit = commandTextureUnit(0)) {
+					if (Kore::Graphics4::RenderTarget* renderTarget = (Kore::Graphics4::RenderTarget*)commandHandle(1)) renderTarget->useDepthAsTexture(*unit);
+				}
+				pc += 2;
+				break;
+			case CommandSetTextureParameters: {
+				commandArgs(6);
+				Kore::Graphics4::TextureUnit* unit = commandTextureUnit(0);
+				if (unit == nullptr) {
+					pc += 6;
+					break;
+				}
+				Kore::Graphics4::setTextureAddressing(*unit, Kore::Graphics4::U, convertTextureAddressing(words[pc + 1]));
+				Kore::Graphics4::setTextureAddressing(*unit, Kore::Graphics4::V, convertTextureAddressing(words[pc + 2]));
+				Kore::Graphics4::setTextureMinificationFilter(*unit, convertTextureFilter(words[pc + 3]));
+				Kore::Graphics4::setTextureMagnificationFilter(*unit, convertTextureFilter(words[pc + 4]));
+				Kore::Graphics4::setTextureMipmapFilter(*unit, convertMipmapFilter(words[pc + 5]));
+				pc += 6;
+				break;
+			}
+			case CommandSetBool:
+				commandArgs(2);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setBool(*location, words[pc + 1] != 0);
+				pc += 2;
+				break;
+			case CommandSetInt:
+				commandArgs(2);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setInt(*location, words[pc + 1]);
+				pc += 2;
+				break;
+			case CommandSetFloat:
+				commandArgs(2);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setFloat(*location, floats[pc + 1]);
+				pc += 2;
+				break;
+			case CommandSetFloat2:
+				commandArgs(3);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setFloat2(*location, floats[pc + 1], floats[pc + 2]);
+				pc += 3;
+				break;
+			case CommandSetFloat3:
+				commandArgs(4);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setFloat3(*location, floats[pc + 1], floats[pc + 2], floats[pc + 3]);
+				pc += 4;
+				break;
+			case CommandSetFloat4:
+				commandArgs(5);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setFloat4(*location, floats[pc + 1], floats[pc + 2], floats[pc + 3], floats[pc + 4]);
+				pc += 5;
+				break;
+			case CommandSetFloats: {
+				commandArgs(2);
+				int count = words[pc + 1];
+				if (count < 0) {
+					sendLogMessage("Negative count in command buffer.");
+					return JS_INVALID_REFERENCE;
+				}
+				// Not commandArgs(2 + count), which overflows for large counts
+				if (count > length - pc - 2) {
+					sendLogMessage("Truncated command buffer.");
+					return JS_INVALID_REFERENCE;
+				}
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setFloats(*location, &floats[pc + 2], count);
+				pc += 2 + count;
+				break;
+			}
+			case CommandSetMatrix: {
+				commandArgs(17);
+				float* from = &floats[pc + 1];
+				Kore::mat4 m;
+				m.Set(0, 0, from[0]); m.Set(1, 0, from[1]); m.Set(2, 0, from[2]); m.Set(3, 0, from[3]);
+				m.Set(0, 1, from[4]); m.Set(1, 1, from[5]); m.Set(2, 1, from[6]); m.Set(3, 1, from[7]);
+				m.Set(0, 2, from[8]); m.Set(1, 2, from[9]); m.Set(2, 2, from[10]); m.Set(3, 2, from[11]);
+				m.Set(0, 3, from[12]); m.Set(1, 3, from[13]); m.Set(2, 3, from[14]); m.Set(3, 3, from[15]);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setMatrix(*location, m);
+				pc += 17;
+				break;
+			}
+			case CommandSetMatrix3: {
+				commandArgs(10);
+				float* from = &floats[pc + 1];
+				Kore::mat3 m;
+				m.Set(0, 0, from[0]); m.Set(1, 0, from[1]); m.Set(2, 0, from[2]);
+				m.Set(0, 1, from[3]); m.Set(1, 1, from[4]); m.Set(2, 1, from[5]);
+				m.Set(0, 2, from[6]); m.Set(1, 2, from[7]); m.Set(2, 2, from[8]);
+				if (Kore::Graphics4::ConstantLocation* location = commandLocation(0)) Kore::Graphics4::setMatrix(*location, m);
+				pc += 10;
+				break;
+			}
+			case CommandDrawIndexedVertices:
+				commandArgs(2);
+				if (words[pc + 1] < 0) Kore::Graphics4::drawIndexedVertices();
+				else Kore::Graphics4::drawIndexedVertices(words[pc], words[pc + 1]);
+				pc += 2;
+				break;
+			case CommandDrawIndexedVerticesInstanced:
+				commandArgs(3);
+				if (words[pc + 2] < 0) Kore::Graphics4::drawIndexedVerticesInstanced(words[pc]);
+				else Kore::Graphics4::drawIndexedVerticesInstanced(words[pc], words[pc + 1], words[pc + 2]);
+				pc += 3;
+				break;
+			case CommandViewport:
+				commandArgs(4);
+				Kore::Graphics4::viewport(words[pc], words[pc + 1], words[pc + 2], words[pc + 3]);
+				pc += 4;
+				break;
+			case CommandScissor:
+				commandArgs(4);
+				Kore::Graphics4::scissor(words[pc], words[pc + 1], words[pc + 2], words[pc + 3]);
+				pc += 4;
+				break;
+			case CommandDisableScissor:
+				Kore::Graphics4::disableScissor();
+				break;
+			case CommandClear:
+				commandArgs(4);
+				Kore::Graphics4::clear(words[pc], words[pc + 1], floats[pc + 2], words[pc + 3]);
+				pc += 4;
+				break;
+			default:
+				sendLogMessage("Unknown command %i in command buffer.", command);
+				return JS_INVALID_REFERENCE;
+			}
+		}
+
+#undef commandArgs
+#undef commandHandle
+#undef commandObject
+#undef commandLocation
+#undef commandTextureUnit
+
+		return JS_INVALID_REFERENCE;
+	}
+
 #define addFunction(name, funcName) JsPropertyIdRef name##Id;\
 	JsValueRef name##Func;\
 	JsCreateFunction(funcName, nullptr, &name##Func);\
 	JsCreatePropertyId(#name, strlen(#name), &name##Id);\
 	JsSetProperty(krom, name##Id, name##Func, false)
 
-#define createId(name) JsCreatePropertyId(#name, strlen(#name), &name##_id)
-
 	void bindFunctions() {
-		createId(buffer);
+		createIds();
 
 		JsValueRef krom;
 		JsCreateObject(&krom);
@@ -2483,6 +5278,8 @@ namespace {
 		addFunction(setPenMoveCallback, krom_set_pen_move_callback);
 		addFunction(setGamepadAxisCallback, krom_set_gamepad_axis_callback);
 		addFunction(setGamepadButtonCallback, krom_set_gamepad_button_callback);
+		addFunction(setInputBufferCallback, krom_set_input_buffer_callback);
+		addFunction(getInputState, krom_get_input_state);
 		addFunction(lockMouse, krom_lock_mouse);
 		addFunction(unlockMouse, krom_unlock_mouse);
 		addFunction(canLockMouse, krom_can_lock_mouse);
@@ -2512,13 +5309,35 @@ namespace {
 		addFunction(createPipeline, krom_create_pipeline);
 		addFunction(deletePipeline, krom_delete_pipeline);
 		addFunction(compilePipeline, krom_compile_pipeline);
+		addFunction(getPipelineCacheStats, krom_get_pipeline_cache_stats);
 		addFunction(setPipeline, krom_set_pipeline);
 		addFunction(loadImage, krom_load_image);
 		addFunction(unloadImage, krom_unload_image);
 		addFunction(loadSound, krom_load_sound);
+		addFunction(createSoundStream, krom_create_sound_stream);
+		addFunction(readSoundStream, krom_read_sound_stream);
+		addFunction(resetSoundStream, krom_reset_sound_stream);
+		addFunction(deleteSoundStream, krom_delete_sound_stream);
 		addFunction(setAudioCallback, krom_set_audio_callback);
+		addFunction(getAudioStats, krom_get_audio_stats);
+		addFunction(startAudioWorker, krom_start_audio_worker);
+		addFunction(setMixerEnabled, krom_set_mixer_enabled);
+		addFunction(mixerPlay, krom_mixer_play);
+		addFunction(mixerSetVoice, krom_mixer_set_voice);
+		addFunction(mixerStop, krom_mixer_stop);
+		addFunction(mixerStopAll, krom_mixer_stop_all);
+		addFunction(mixerSetVoiceOutput, krom_mixer_set_voice_output);
+		addFunction(mixerVoiceCount, krom_mixer_voice_count);
+		addFunction(dspCreateNode, krom_dsp_create_node);
+		addFunction(dspDeleteNode, krom_dsp_delete_node);
+		addFunction(dspConnect, krom_dsp_connect);
+		addFunction(dspSetParameter, krom_dsp_set_parameter);
 		addFunction(writeAudioBuffer, krom_write_audio_buffer);
 		addFunction(loadBlob, krom_load_blob);
+		addFunction(loadImageAsync, krom_load_image_async);
+		addFunction(loadBlobAsync, krom_load_blob_async);
+		addFunction(loadSoundAsync, krom_load_sound_async);
+		addFunction(loadImages, krom_load_images);
 		addFunction(getConstantLocation, krom_get_constant_location);
 		addFunction(getTextureUnit, krom_get_texture_unit);
 		addFunction(setTexture, krom_set_texture);
@@ -2553,6 +5372,10 @@ namespace {
 		addFunction(displayIsPrimary, krom_display_is_primary);
 		addFunction(writeStorage, krom_write_storage);
 		addFunction(readStorage, krom_read_storage);
+		addFunction(kvGet, krom_kv_get);
+		addFunction(kvPut, krom_kv_put);
+		addFunction(kvDelete, krom_kv_delete);
+		addFunction(kvFlush, krom_kv_flush);
 		addFunction(createRenderTarget, krom_create_render_target);
 		addFunction(createRenderTargetCubeMap, krom_create_render_target_cube_map);
 		addFunction(createTexture, krom_create_texture);
@@ -2562,6 +5385,12 @@ namespace {
 		addFunction(createTextureFromEncodedBytes, krom_create_texture_from_encoded_bytes);
 		addFunction(getTexturePixels, krom_get_texture_pixels);
 		addFunction(getRenderTargetPixels, krom_get_render_target_pixels);
+		addFunction(requestRenderTargetPixelsAsync, krom_request_render_target_pixels_async);
+		addFunction(requestTexturePixelsAsync, krom_request_texture_pixels_async);
+		addFunction(setCaptureTarget, krom_set_capture_target);
+		addFunction(startCapture, krom_start_capture);
+		addFunction(stopCapture, krom_stop_capture);
+		addFunction(getCaptureDroppedFrames, krom_get_capture_dropped_frames);
 		addFunction(lockTexture, krom_lock_texture);
 		addFunction(unlockTexture, krom_unlock_texture);
 		addFunction(clearTexture, krom_clear_texture);
@@ -2604,11 +5433,12 @@ namespace {
 		addFunction(getConstantLocationCompute, krom_get_constant_location_compute);
 		addFunction(getTextureUnitCompute, krom_get_texture_unit_compute);
 		addFunction(compute, krom_compute);
+		addFunction(submitCommands, krom_submit_commands);
 
 		JsValueRef global;
 		JsGetGlobalObject(&global);
 
-		JsSetProperty(global, getId("Krom"), krom, false);
+		JsSetProperty(global, ids[Krom_id], krom, false);
 	}
 
 	JsSourceContext cookie = 1234;
@@ -2683,13 +5513,13 @@ namespace {
 			JsValueRef meta;
 			JsValueRef exceptionObj;
 			JsGetAndClearExceptionWithMetadata(&meta);
-			JsGetProperty(meta, getId("exception"), &exceptionObj);
+			JsGetProperty(meta, ids[exception_id], &exceptionObj);
 			char buf[2048];
 			size_t length;
 
 			sendLogMessage("Uncaught exception:");
 			JsValueRef sourceObj;
-			JsGetProperty(meta, getId("source"), &sourceObj);
+			JsGetProperty(meta, ids[source_id], &sourceObj);
 			JsCopyString(sourceObj, nullptr, 0, &length);
 			if (length < 2048) {
 				JsCopyString(sourceObj, buf, 2047, &length);
@@ -2697,7 +5527,7 @@ namespace {
 				sendLogMessage("%s", buf);
 			
 				JsValueRef columnObj;
-				JsGetProperty(meta, getId("column"), &columnObj);
+				JsGetProperty(meta, ids[column_id], &columnObj);
 				int column;
 				JsNumberToInt(columnObj, &column);
 				for (int i = 0; i < column; i++) if (buf[i] != '\t') buf[i] = ' ';
@@ -2707,7 +5537,7 @@ namespace {
 			}
 
 			JsValueRef stackObj;
-			JsGetProperty(exceptionObj, getId("stack"), &stackObj);
+			JsGetProperty(exceptionObj, ids[stack_id], &stackObj);
 			JsCopyString(stackObj, nullptr, 0, &length);
 			if (length < 2048) {
 				JsCopyString(stackObj, buf, 2047, &length);
@@ -2752,10 +5582,32 @@ namespace {
 		}
 	}
 
+	// Runs on the audio thread right before Audio2 reads the samples.
+	// With the native mixer enabled, the samples Audio2 is about to read are
+	// mixed in place, so the mixer adds no latency on top of the ring.
+	void mixIntoRing(int samples) {
+		Kore::Audio2::Buffer& ring = Kore::Audio2::buffer;
+		float* data = (float*)ring.data;
+		int ringSamples = ring.dataSize / 4;
+		int start = ring.readLocation / 4;
+		int first = samples < ringSamples - start ? samples : ringSamples - start;
+		mixerMix(&data[start], first / 2);
+		if (samples > first) mixerMix(data, (samples - first) / 2);
+		ring.writeLocation = ((start + samples) % ringSamples) * 4;
+	}
+
 	void updateAudio(int samples) {
-		audioMutex.lock();
+		if (mixerEnabled) {
+			mixIntoRing(samples);
+			return;
+		}
+		// Reports the voices stopped when the mixer was disabled, so
+		// releaseMixerBuffers can let go of their buffers
+		mixerApply();
+		int available = (Kore::Audio2::buffer.writeLocation - Kore::Audio2::buffer.readLocation + Kore::Audio2::buffer.dataSize) % Kore::Audio2::buffer.dataSize;
+		if (available < samples * 4) ++audioUnderruns;
 		audioSamples += samples;
-		audioMutex.unlock();
+		if (audioWorker.load(std::memory_order_acquire)) audioSemaphore->signal();
 	}
 
 	void update() {
@@ -2765,26 +5617,47 @@ namespace {
 		if (enableSound) {
 			Kore::Audio2::update();
 
-			audioMutex.lock();
-			if (audioSamples > 0) {
+			releaseMixerBuffers();
+			dspCollectGarbage();
+			if (audioWorker) deliverAudioWorkerLog();
+
+			int samples = audioWorker || mixerEnabled ? 0 : audioSamples.exchange(0);
+			if (samples > 0) {
 				JsValueRef args[2];
 				JsGetUndefinedValue(&args[0]);
-				JsIntToNumber(audioSamples, &args[1]);
+				JsIntToNumber(samples, &args[1]);
 				JsValueRef result;
 				JsCallFunction(audioFunction, args, 2, &result);
-				audioSamples = 0;
 			}
-			audioMutex.unlock();
 		}
+
+		if (inputBuffered) {
+			deliverInput();
+		}
+
+		jobsComplete();
+		deliverSaves();
+		processReadbacks();
+		captureFrame();
 		
 		Kore::Graphics4::begin();
 		
 		runJS();
+		captureRendered = captureActive() && captureTarget != JS_INVALID_REFERENCE;
+		if (captureNeedsTarget) {
+			captureNeedsTarget = false;
+			if (captureTarget == JS_INVALID_REFERENCE) {
+				sendLogMessage("Error: --capture needs a render target set with setCaptureTarget in the first frame, Krom can not capture the framebuffer. Capture stopped.");
+				captureStop();
+			}
+		}
 
 		JsSetCurrentContext(JS_INVALID_REFERENCE);
 		mutex.unlock();
 
 		Kore::Graphics4::end();
+		deleteQueuedResources();
+		freeUnusedPipelines();
 
 		unsigned int nextIdleTick;
 		JsIdle(&nextIdleTick);
@@ -2941,9 +5814,27 @@ namespace {
 
 		JsSetCurrentContext(JS_INVALID_REFERENCE);
 		mutex.unlock();
+
+		writeAccessTrace();
+		compactPipelineManifest();
+		saveFlush();
+		kvFlush();
+		captureStop();
+		captureFlush();
 	}
 
 	void keyDown(Kore::KeyCode code) {
+		if (inputStateEnabled) {
+			if ((unsigned)code < 256) inputState.keys[code] = 1;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputKeyDown, 0, (int)code);
+			return;
+		}
+
+		if (keyboardDownFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -2958,6 +5849,17 @@ namespace {
 	}
 
 	void keyUp(Kore::KeyCode code) {
+		if (inputStateEnabled) {
+			if ((unsigned)code < 256) inputState.keys[code] = 0;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputKeyUp, 0, (int)code);
+			return;
+		}
+
+		if (keyboardUpFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -2972,6 +5874,13 @@ namespace {
 	}
 
 	void keyPress(wchar_t character) {
+		if (inputBuffered) {
+			pushInput(InputKeyPress, 0, (int)character);
+			return;
+		}
+
+		if (keyboardPressFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -2986,6 +5895,20 @@ namespace {
 	}
 
 	void mouseMove(int window, int x, int y, int mx, int my) {
+		if (inputStateEnabled) {
+			inputState.mouseX = x;
+			inputState.mouseY = y;
+			inputState.mouseMovementX += mx;
+			inputState.mouseMovementY += my;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputMouseMove, window, x, y, mx, my);
+			return;
+		}
+
+		if (mouseMoveFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3003,6 +5926,19 @@ namespace {
 	}
 
 	void mouseDown(int window, int button, int x, int y) {
+		if (inputStateEnabled) {
+			if ((unsigned)button < 32) inputState.mouseButtons |= 1 << button;
+			inputState.mouseX = x;
+			inputState.mouseY = y;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputMouseDown, window, button, x, y);
+			return;
+		}
+
+		if (mouseDownFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3019,6 +5955,19 @@ namespace {
 	}
 
 	void mouseUp(int window, int button, int x, int y) {
+		if (inputStateEnabled) {
+			if ((unsigned)button < 32) inputState.mouseButtons &= ~(1 << button);
+			inputState.mouseX = x;
+			inputState.mouseY = y;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputMouseUp, window, button, x, y);
+			return;
+		}
+
+		if (mouseUpFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3035,6 +5984,17 @@ namespace {
 	}
 
 	void mouseWheel(int window, int delta) {
+		if (inputStateEnabled) {
+			inputState.mouseWheel += delta;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputMouseWheel, window, delta);
+			return;
+		}
+
+		if (mouseWheelFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3049,6 +6009,20 @@ namespace {
 	}
 
 	void penDown(int window, int x, int y, float pressure) {
+		if (inputStateEnabled) {
+			inputState.penX = x;
+			inputState.penY = y;
+			inputState.penDown = 1;
+			inputState.penPressure = pressure;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputPenDown, window, x, y, 0, 0, pressure);
+			return;
+		}
+
+		if (penDownFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3065,6 +6039,20 @@ namespace {
 	}
 
 	void penUp(int window, int x, int y, float pressure) {
+		if (inputStateEnabled) {
+			inputState.penX = x;
+			inputState.penY = y;
+			inputState.penDown = 0;
+			inputState.penPressure = pressure;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputPenUp, window, x, y, 0, 0, pressure);
+			return;
+		}
+
+		if (penUpFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3081,6 +6069,19 @@ namespace {
 	}
 
 	void penMove(int window, int x, int y, float pressure) {
+		if (inputStateEnabled) {
+			inputState.penX = x;
+			inputState.penY = y;
+			inputState.penPressure = pressure;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputPenMove, window, x, y, 0, 0, pressure);
+			return;
+		}
+
+		if (penMoveFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3097,6 +6098,17 @@ namespace {
 	}
 
 	void gamepadAxis(int gamepad, int axis, float value) {
+		if (inputStateEnabled) {
+			if ((unsigned)gamepad < maxGamepads && (unsigned)axis < maxGamepadAxes) inputState.gamepadAxes[gamepad][axis] = value;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputGamepadAxis, gamepad, axis, 0, 0, 0, value);
+			return;
+		}
+
+		if (gamepadAxisFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3113,6 +6125,17 @@ namespace {
 	}
 
 	void gamepadButton(int gamepad, int button, float value) {
+		if (inputStateEnabled) {
+			if ((unsigned)gamepad < maxGamepads && (unsigned)button < maxGamepadButtons) inputState.gamepadButtons[gamepad][button] = value;
+		}
+
+		if (inputBuffered) {
+			pushInput(InputGamepadButton, gamepad, button, 0, 0, 0, value);
+			return;
+		}
+
+		if (gamepadButtonFunction == JS_INVALID_REFERENCE) return;
+
 		mutex.lock();
 		JsSetCurrentContext(context);
 
@@ -3128,36 +6151,27 @@ namespace {
 		mutex.unlock();
 	}
 
-	void gamepad1Axis(int axis, float value) {
-		gamepadAxis(0, axis, value);
-	}
-
-	void gamepad1Button(int button, float value) {
-		gamepadButton(0, button, value);
-	}
-
-	void gamepad2Axis(int axis, float value) {
-		gamepadAxis(1, axis, value);
-	}
-
-	void gamepad2Button(int button, float value) {
-		gamepadButton(1, button, value);
+	template<int pad> void gamepadAxisOf(int axis, float value) {
+		gamepadAxis(pad, axis, value);
 	}
 
-	void gamepad3Axis(int axis, float value) {
-		gamepadAxis(2, axis, value);
+	template<int pad> void gamepadButtonOf(int button, float value) {
+		gamepadButton(pad, button, value);
 	}
 
-	void gamepad3Button(int button, float value) {
-		gamepadButton(2, button, value);
+	template<int pad> void registerGamepad() {
+		Kore::Gamepad* gamepad = Kore::Gamepad::get(pad);
+		if (gamepad != nullptr) {
+			gamepad->Axis = gamepadAxisOf<pad>;
+			gamepad->Button = gamepadButtonOf<pad>;
+		}
+		registerGamepad<pad + 1>();
 	}
 
-	void gamepad4Axis(int axis, float value) {
-		gamepadAxis(3, axis, value);
-	}
+	template<> void registerGamepad<maxGamepads>() {}
 
-	void gamepad4Button(int button, float value) {
-		gamepadButton(3, button, value);
+	void registerGamepads() {
+		registerGamepad<0>();
 	}
 
 	bool startsWith(std::string str, std::string start) {
@@ -3537,6 +6551,10 @@ extern "C" void filechanged(char* path) {
 
 //__declspec(dllimport) extern "C" void __stdcall Sleep(unsigned long milliseconds);
 
+bool skipPacking(const char* path) {
+	return endsWith(path, ".wav");
+}
+
 int kickstart(int argc, char** argv) {
 	_argc = argc;
 	_argv = argv;
@@ -3558,7 +6576,10 @@ int kickstart(int argc, char** argv) {
 	bool readStdoutPath = false;
 	bool readConsolePid = false;
 	bool readPort = false;
+	bool readCapturePath = false;
 	bool writebin = false;
+	bool writepack = false;
+	bool usePack = true;
 	int port = 0;
 	for (int i = optionIndex; i < argc; ++i) {
 		if (readPort) {
@@ -3597,11 +6618,48 @@ int kickstart(int argc, char** argv) {
 		else if (strcmp(argv[i], "--writebin") == 0) {
 			writebin = true;
 		}
+		else if (strcmp(argv[i], "--nopipelinemanifest") == 0) {
+			pipelineManifest = false;
+		}
+		else if (strcmp(argv[i], "--resetpipelinemanifest") == 0) {
+			resetPipelineManifest = true;
+		}
+		else if (strcmp(argv[i], "--soundcache") == 0) {
+			soundCache = true;
+		}
+		else if (strcmp(argv[i], "--texturecache") == 0) {
+			textureCache = true;
+		}
+		else if (strcmp(argv[i], "--writepack") == 0) {
+			writepack = true;
+		}
+		else if (strcmp(argv[i], "--nopack") == 0) {
+			usePack = false;
+		}
+		else if (strcmp(argv[i], "--notrace") == 0) {
+			accessTrace = false;
+		}
+		else if (readCapturePath) {
+			capturePath = argv[i];
+			readCapturePath = false;
+		}
+		else if (strcmp(argv[i], "--capture") == 0) {
+			readCapturePath = true;
+		}
 	}
 
 	kromjs = assetsdir + "/krom.js";
 	kinc_internal_set_files_location(&assetsdir[0u]);
 
+	packPath = assetsdir + "/krom.pack";
+	if (writepack) {
+		return packWrite(assetsdir.c_str(), packPath.c_str(), skipPacking) ? 0 : 1;
+	}
+	packOpened = usePack && packOpen(packPath.c_str());
+	tracePath = assetsdir + "/krom.trace";
+	bool captureOnStart = !capturePath.empty();
+	if (!captureOnStart) capturePath = assetsdir + "/capture";
+
 	Kore::FileReader reader;
 	if (!writebin && reader.open("krom.bin")) {
 		serialized = true;
@@ -3629,6 +6687,8 @@ int kickstart(int argc, char** argv) {
 	}
 
 	Kore::threadsInit();
+	startPrefetch();
+	if (captureOnStart) captureNeedsTarget = captureStart(capturePath.c_str(), 60);
 
 	if (watch) {
 		watchDirectories(argv[1], argv[2]);
@@ -3665,6 +6725,10 @@ int kickstart(int argc, char** argv) {
 	startKrom(code);
 	
 	Kore::System::start();
+	writeAccessTrace();
+	compactPipelineManifest();
+	saveFlush();
+	kvFlush();
 
 	if (enableSound) {
 		Kore::Audio2::shutdown();
@@ -0,0 +1,124 @@
+#include "pch.h"
+#include "mapping.h"
+
+#ifdef KORE_WINDOWS
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef KORE_WINDOWS
+
+bool mapFile(const char* path, FileMapping* mapping) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE map = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (map == nullptr) return false;
+	void* data = MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+	if (data == nullptr) {
+		CloseHandle(map);
+		return false;
+	}
+	mapping->data = (uint8_t*)data;
+	mapping->size = (size_t)size.QuadPart;
+	mapping->handle = map;
+	mapping->offset = 0;
+	return true;
+}
+
+bool mapFileRange(const char* path, uint64_t offset, size_t size, FileMapping* mapping) {
+	if (size == 0) return false;
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	uint64_t start = offset - offset % info.dwAllocationGranularity;
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	HANDLE map = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (map == nullptr) return false;
+	void* data = MapViewOfFile(map, FILE_MAP_COPY, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)(offset - start + size));
+	if (data == nullptr) {
+		CloseHandle(map);
+		return false;
+	}
+	mapping->offset = (size_t)(offset - start);
+	mapping->data = (uint8_t*)data + mapping->offset;
+	mapping->size = size;
+	mapping->handle = map;
+	return true;
+}
+
+void unmapFile(FileMapping* mapping) {
+	UnmapViewOfFile(mapping->data - mapping->offset);
+	CloseHandle((HANDLE)mapping->handle);
+	mapping->data = nullptr;
+	mapping->size = 0;
+}
+
+bool fileStats(const char* path, uint64_t* modified, uint64_t* size) {
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return false;
+	*modified = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	*size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	return true;
+}
+
+#else
+
+bool mapFile(const char* path, FileMapping* mapping) {
+	int file = open(path, O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		close(file);
+		return false;
+	}
+	void* data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file);
+	if (data == MAP_FAILED) return false;
+	mapping->data = (uint8_t*)data;
+	mapping->size = (size_t)info.st_size;
+	mapping->handle = nullptr;
+	mapping->offset = 0;
+	return true;
+}
+
+bool mapFileRange(const char* path, uint64_t offset, size_t size, FileMapping* mapping) {
+	if (size == 0) return false;
+	uint64_t start = offset - offset % (uint64_t)sysconf(_SC_PAGESIZE);
+	int file = open(path, O_RDONLY);
+	if (file < 0) return false;
+	void* data = mmap(nullptr, (size_t)(offset - start) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, (off_t)start);
+	close(file);
+	if (data == MAP_FAILED) return false;
+	mapping->offset = (size_t)(offset - start);
+	mapping->data = (uint8_t*)data + mapping->offset;
+	mapping->size = size;
+	mapping->handle = nullptr;
+	return true;
+}
+
+void unmapFile(FileMapping* mapping) {
+	munmap(mapping->data - mapping->offset, mapping->offset + mapping->size);
+	mapping->data = nullptr;
+	mapping->size = 0;
+}
+
+bool fileStats(const char* path, uint64_t* modified, uint64_t* size) {
+	struct stat info;
+	if (stat(path, &info) != 0) return false;
+	*modified = (uint64_t)info.st_mtime;
+	*size = (uint64_t)info.st_size;
+	return true;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A private, copy-on-write view of a whole file. Writes through data change
+// only this process' copy, so the view can be handed to JS as an ArrayBuffer.
+struct FileMapping {
+	uint8_t* data;
+	size_t size;
+	void* handle;
+	size_t offset; // of data from the start of the mapped pages
+};
+
+bool mapFile(const char* path, FileMapping* mapping);
+
+// Maps size bytes starting at offset, which does not need to be aligned.
+bool mapFileRange(const char* path, uint64_t offset, size_t size, FileMapping* mapping);
+void unmapFile(FileMapping* mapping);
+
+// Modification time and size, for cache keys.
+bool fileStats(const char* path, uint64_t* modified, uint64_t* size);
@@ -0,0 +1,274 @@
+#include "pch.h"
+#include "mixer.h"
+#include "dsp.h"
+#include "pcm.h"
+#include "ring.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <deque>
+
+namespace {
+	enum CommandType {
+		CommandPlay,
+		CommandSet,
+		CommandSetOutput,
+		CommandStop,
+		CommandStopAll
+	};
+
+	struct Command {
+		CommandType type;
+		int voice;
+		const void* data;
+		int frames;
+		bool int16;
+		bool loop;
+		float volume;
+		float pan;
+		float pitch;
+		int output;
+	};
+
+	struct Voice {
+		int id;
+		const void* data;
+		int frames;
+		bool int16;
+		bool loop;
+		float volume;
+		float pan;
+		float pitch;
+		int output;
+		double position;
+	};
+
+	const int maxVoices = 256;
+	const int blockFrames = 256;
+	const int queueSize = 1024;
+
+	Ring<Command, queueSize> commands;
+	// The audio thread only takes a command while this has room for more
+	// than maxVoices ids, so a command and the next mix always fit.
+	Ring<int, queueSize> finished;
+	volatile int activeVoices = 0;
+
+	// Only touched by the JS thread
+	std::deque<Command> overflow;
+	int nextVoice = 1;
+
+	// Only touched by the audio thread
+	Voice voices[maxVoices];
+	int voiceCount = 0;
+	float accumulator[blockFrames * 2];
+	float voiceBuffer[blockFrames * 2];
+
+	// Commands that did not fit into the ring wait here, in order
+	void flushOverflow() {
+		while (!overflow.empty() && commands.push(overflow.front())) {
+			overflow.pop_front();
+		}
+	}
+
+	void pushCommand(const Command& command) {
+		flushOverflow();
+		if (!overflow.empty() || !commands.push(command)) overflow.push_back(command);
+	}
+
+	Command makeCommand(CommandType type, int voice) {
+		Command command;
+		memset(&command, 0, sizeof(command));
+		command.type = type;
+		command.voice = voice;
+		return command;
+	}
+
+	void finishVoice(int index) {
+		finished.push(voices[index].id);
+		voices[index] = voices[--voiceCount];
+	}
+
+	void applyCommands() {
+		Command command;
+		while (finished.space() > maxVoices && commands.pop(&command)) {
+			switch (command.type) {
+			case CommandPlay: {
+				if (voiceCount == maxVoices) {
+					finished.push(command.voice);
+					break;
+				}
+				Voice& voice = voices[voiceCount++];
+				voice.id = command.voice;
+				voice.data = command.data;
+				voice.frames = command.frames;
+				voice.int16 = command.int16;
+				voice.loop = command.loop;
+				voice.volume = command.volume;
+				voice.pan = command.pan;
+				voice.pitch = command.pitch;
+				voice.output = 0;
+				voice.position = 0;
+				break;
+			}
+			case CommandSet:
+				for (int v = 0; v < voiceCount; ++v) {
+					if (voices[v].id == command.voice) {
+						voices[v].volume = command.volume;
+						voices[v].pan = command.pan;
+						voices[v].pitch = command.pitch;
+					}
+				}
+				break;
+			case CommandSetOutput:
+				for (int v = 0; v < voiceCount; ++v) {
+					if (voices[v].id == command.voice) voices[v].output = command.output;
+				}
+				break;
+			case CommandStop:
+				for (int v = 0; v < voiceCount; ++v) {
+					if (voices[v].id == command.voice) {
+						finishVoice(v);
+						break;
+					}
+				}
+				break;
+			case CommandStopAll:
+				while (voiceCount > 0) {
+					finishVoice(voiceCount - 1);
+				}
+				break;
+			}
+		}
+	}
+
+	float sampleAt(const Voice& voice, int index) {
+		if (voice.int16) return ((const short*)voice.data)[index] * (1.0f / 32767.0f);
+		return ((const float*)voice.data)[index];
+	}
+
+	// Renders up to frames frames of a voice into voiceBuffer, returns false
+	// when the voice ended.
+	bool renderVoice(Voice& voice, int frames, int* rendered) {
+		int i = 0;
+		if (voice.frames <= 0) {
+			*rendered = 0;
+			return false;
+		}
+		if (voice.pitch == 1.0f && voice.position == (int)voice.position) {
+			int position = (int)voice.position;
+			while (i < frames) {
+				int count = frames - i;
+				if (count > voice.frames - position) count = voice.frames - position;
+				if (voice.int16) convertPcm16(&((const short*)voice.data)[position * 2], &voiceBuffer[i * 2], count * 2);
+				else memcpy(&voiceBuffer[i * 2], &((const float*)voice.data)[position * 2], count * 2 * sizeof(float));
+				i += count;
+				position += count;
+				if (position >= voice.frames) {
+					if (!voice.loop) break;
+					position = 0;
+				}
+			}
+			voice.position = position;
+		}
+		else {
+			for (; i < frames; ++i) {
+				int index = (int)voice.position;
+				if (index >= voice.frames) {
+					if (!voice.loop) break;
+					// Pitches above the length skip whole loops
+					voice.position = fmod(voice.position, (double)voice.frames);
+					index = (int)voice.position;
+				}
+				int next = index + 1 < voice.frames ? index + 1 : (voice.loop ? 0 : index);
+				float t = (float)(voice.position - index);
+				voiceBuffer[i * 2 + 0] = sampleAt(voice, index * 2 + 0) * (1 - t) + sampleAt(voice, next * 2 + 0) * t;
+				voiceBuffer[i * 2 + 1] = sampleAt(voice, index * 2 + 1) * (1 - t) + sampleAt(voice, next * 2 + 1) * t;
+				voice.position += voice.pitch;
+			}
+		}
+		*rendered = i;
+		return i == frames && (voice.loop || voice.position < voice.frames);
+	}
+}
+
+int mixerPlay(const void* data, int frames, bool int16, float volume, float pan, float pitch, bool loop) {
+	Command command = makeCommand(CommandPlay, nextVoice++);
+	command.data = data;
+	command.frames = frames;
+	command.int16 = int16;
+	command.loop = loop;
+	command.volume = volume;
+	command.pan = pan;
+	command.pitch = pitch > 0 ? pitch : 1.0f;
+	pushCommand(command);
+	return command.voice;
+}
+
+void mixerSetVoice(int voice, float volume, float pan, float pitch) {
+	Command command = makeCommand(CommandSet, voice);
+	command.volume = volume;
+	command.pan = pan;
+	command.pitch = pitch > 0 ? pitch : 1.0f;
+	pushCommand(command);
+}
+
+void mixerSetVoiceOutput(int voice, int node) {
+	Command command = makeCommand(CommandSetOutput, voice);
+	command.output = node;
+	pushCommand(command);
+}
+
+void mixerStop(int voice) {
+	pushCommand(makeCommand(CommandStop, voice));
+}
+
+void mixerStopAll() {
+	pushCommand(makeCommand(CommandStopAll, 0));
+}
+
+int mixerVoiceCount() {
+	return activeVoices;
+}
+
+void mixerMix(float* to, int frames) {
+	applyCommands();
+	dspUpdate();
+
+	for (int offset = 0; offset < frames; offset += blockFrames) {
+		int block = frames - offset < blockFrames ? frames - offset : blockFrames;
+		memset(accumulator, 0, block * 2 * sizeof(float));
+		dspBeginBlock(block);
+		for (int v = 0; v < voiceCount;) {
+			Voice& voice = voices[v];
+			int rendered;
+			bool playing = renderVoice(voice, block, &rendered);
+			float pan = voice.pan < -1 ? -1 : (voice.pan > 1 ? 1 : voice.pan);
+			float left = voice.volume * (pan > 0 ? 1 - pan : 1);
+			float right = voice.volume * (pan < 0 ? 1 + pan : 1);
+			float* output = dspNodeInput(voice.output);
+			mixStereo(output != nullptr ? output : accumulator, voiceBuffer, left, right, rendered);
+			if (playing) {
+				++v;
+			}
+			else {
+				finishVoice(v);
+			}
+		}
+		dspProcess(accumulator, block);
+		clipSamples(accumulator, &to[offset * 2], block * 2);
+	}
+	activeVoices = voiceCount;
+}
+
+void mixerApply() {
+	applyCommands();
+	activeVoices = voiceCount;
+}
+
+int mixerTakeFinished(int* ids, int max) {
+	flushOverflow();
+	int count = 0;
+	while (count < max && finished.pop(&ids[count])) ++count;
+	return count;
+}
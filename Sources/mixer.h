@@ -0,0 +1,26 @@
+#pragma once
+
+// Native voice mixer. Voices play interleaved stereo sample data owned by the
+// caller, which has to stay valid until the voice is reported as finished.
+// Control functions are called from the JS thread and queue commands,
+// mixerMix runs on the audio thread and applies them without locking or
+// allocating.
+
+int mixerPlay(const void* data, int frames, bool int16, float volume, float pan, float pitch, bool loop);
+void mixerSetVoice(int voice, float volume, float pan, float pitch);
+// Sends a voice to a node of the effect graph, 0 is the master output.
+void mixerSetVoiceOutput(int voice, int node);
+void mixerStop(int voice);
+void mixerStopAll();
+int mixerVoiceCount();
+
+// Mixes frames stereo frames into to, clipped to [-1, 1].
+void mixerMix(float* to, int frames);
+
+// Applies queued commands without mixing. Call it on the audio thread while
+// the mixer is disabled, so voices stopped in the meantime are reported.
+void mixerApply();
+
+// Collects up to max ids of voices that ended or were stopped since the last
+// call, their data may be released afterwards.
+int mixerTakeFinished(int* voices, int max);
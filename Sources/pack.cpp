@@ -0,0 +1,340 @@
+#include "pch.h"
+#include "pack.h"
+#include "hash.h"
+#include "mapping.h"
+
+#include <Kore/Log.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef KORE_WINDOWS
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+	struct PackHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t count;
+		uint32_t namesSize;
+	};
+
+	struct PackEntry {
+		uint64_t hash;
+		uint64_t offset;
+		uint32_t size;
+		uint32_t storedSize;
+		uint32_t name;
+		uint32_t nameLength;
+	};
+
+	const uint32_t packMagic = 0x4b41504b; // KPAK
+	const uint32_t packVersion = 1;
+	const uint32_t alignment = 16;
+
+	FileMapping pack;
+	const PackEntry* entries = nullptr;
+	const char* names = nullptr;
+	uint32_t entryCount = 0;
+
+	uint32_t read32(const uint8_t* data) {
+		uint32_t value;
+		memcpy(&value, data, 4);
+		return value;
+	}
+
+	uint8_t* writeLength(uint8_t* to, uint32_t length) {
+		while (length >= 255) {
+			*to++ = 255;
+			length -= 255;
+		}
+		*to++ = (uint8_t)length;
+		return to;
+	}
+
+	// LZ4 block format, greedy matching against a small hash table. Returns 0
+	// when the result would not fit into capacity.
+	uint32_t compressLz4(const uint8_t* from, uint32_t size, uint8_t* to, uint32_t capacity) {
+		const uint32_t minMatch = 4;
+		const uint32_t lastLiterals = 5;
+		const uint32_t matchLimit = 12;
+		const int hashBits = 12;
+		int32_t table[1 << hashBits];
+		for (int i = 0; i < (1 << hashBits); ++i) table[i] = -1;
+
+		uint8_t* out = to;
+		uint8_t* end = to + capacity;
+		uint32_t anchor = 0;
+		uint32_t position = 0;
+		while (size > matchLimit && position < size - matchLimit) {
+			uint32_t sequence = read32(&from[position]);
+			uint32_t slot = (sequence * 2654435761u) >> (32 - hashBits);
+			int32_t candidate = table[slot];
+			table[slot] = (int32_t)position;
+			if (candidate < 0 || position - candidate > 65535 || read32(&from[candidate]) != sequence) {
+				++position;
+				continue;
+			}
+			uint32_t length = minMatch;
+			while (position + length < size - lastLiterals && from[candidate + length] == from[position + length]) ++length;
+
+			uint32_t literals = position - anchor;
+			if (out + 1 + literals / 255 + 1 + literals + 2 + (length - minMatch) / 255 + 1 > end) return 0;
+			uint8_t* token = out++;
+			*token = (uint8_t)(((literals < 15 ? literals : 15) << 4) | (length - minMatch < 15 ? length - minMatch : 15));
+			if (literals >= 15) out = writeLength(out, literals - 15);
+			memcpy(out, &from[anchor], literals);
+			out += literals;
+			uint32_t offset = position - candidate;
+			*out++ = (uint8_t)(offset & 0xff);
+			*out++ = (uint8_t)(offset >> 8);
+			if (length - minMatch >= 15) out = writeLength(out, length - minMatch - 15);
+			position += length;
+			anchor = position;
+		}
+
+		uint32_t literals = size - anchor;
+		if (out + 1 + literals / 255 + 1 + literals > end) return 0;
+		*out++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+		if (literals >= 15) out = writeLength(out, literals - 15);
+		memcpy(out, &from[anchor], literals);
+		out += literals;
+		return (uint32_t)(out - to);
+	}
+
+	bool decompressLz4(const uint8_t* from, uint32_t size, uint8_t* to, uint32_t capacity) {
+		const uint8_t* in = from;
+		const uint8_t* inEnd = from + size;
+		uint8_t* out = to;
+		uint8_t* outEnd = to + capacity;
+		while (in < inEnd) {
+			uint8_t token = *in++;
+			uint32_t literals = token >> 4;
+			if (literals == 15) {
+				uint8_t next;
+				do {
+					if (in == inEnd) return false;
+					next = *in++;
+					literals += next;
+				} while (next == 255);
+			}
+			if ((size_t)(inEnd - in) < literals || (size_t)(outEnd - out) < literals) return false;
+			memcpy(out, in, literals);
+			in += literals;
+			out += literals;
+			if (in == inEnd) break;
+
+			if (inEnd - in < 2) return false;
+			uint32_t offset = in[0] | (in[1] << 8);
+			in += 2;
+			if (offset == 0 || offset > (size_t)(out - to)) return false;
+			uint32_t length = token & 15;
+			if (length == 15) {
+				uint8_t next;
+				do {
+					if (in == inEnd) return false;
+					next = *in++;
+					length += next;
+				} while (next == 255);
+			}
+			length += 4;
+			if ((size_t)(outEnd - out) < length) return false;
+			const uint8_t* match = out - offset;
+			for (uint32_t i = 0; i < length; ++i) out[i] = match[i];
+			out += length;
+		}
+		return out == outEnd;
+	}
+
+	std::string normalizePath(const char* path) {
+		std::string normalized = path;
+		std::replace(normalized.begin(), normalized.end(), '\\', '/');
+		while (normalized.compare(0, 2, "./") == 0) normalized.erase(0, 2);
+		return normalized;
+	}
+
+	bool byHash(const PackEntry& a, const PackEntry& b) {
+		return a.hash < b.hash;
+	}
+
+#ifdef KORE_WINDOWS
+	void listFiles(const std::string& directory, const std::string& prefix, std::vector<std::string>& files) {
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA((directory + "\\" + prefix + "*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE) return;
+		do {
+			if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0) continue;
+			std::string path = prefix + data.cFileName;
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) listFiles(directory, path + "/", files);
+			else files.push_back(path);
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+	}
+#else
+	void listFiles(const std::string& directory, const std::string& prefix, std::vector<std::string>& files) {
+		DIR* dir = opendir((directory + "/" + prefix).c_str());
+		if (dir == nullptr) return;
+		while (dirent* entry = readdir(dir)) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+			std::string path = prefix + entry->d_name;
+			struct stat info;
+			if (stat((directory + "/" + path).c_str(), &info) != 0) continue;
+			if (S_ISDIR(info.st_mode)) listFiles(directory, path + "/", files);
+			else if (S_ISREG(info.st_mode)) files.push_back(path);
+		}
+		closedir(dir);
+	}
+#endif
+
+	bool readWholeFile(const std::string& path, std::vector<uint8_t>& contents) {
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == nullptr) return false;
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		contents.resize(size > 0 ? size : 0);
+		bool read = size <= 0 || fread(contents.data(), 1, size, file) == (size_t)size;
+		fclose(file);
+		return read;
+	}
+
+	bool writePadding(FILE* file, uint64_t& offset) {
+		static const uint8_t zeros[alignment] = {0};
+		uint32_t padding = (uint32_t)((alignment - offset % alignment) % alignment);
+		offset += padding;
+		return padding == 0 || fwrite(zeros, 1, padding, file) == padding;
+	}
+}
+
+bool packOpen(const char* path) {
+	if (!mapFile(path, &pack)) return false;
+	const PackHeader* header = (const PackHeader*)pack.data;
+	if (pack.size < sizeof(PackHeader) || header->magic != packMagic || header->version != packVersion
+		|| pack.size < sizeof(PackHeader) + (uint64_t)header->count * sizeof(PackEntry) + header->namesSize) {
+		Kore::log(Kore::Warning, "Ignoring invalid asset pack %s.", path);
+		unmapFile(&pack);
+		return false;
+	}
+	entries = (const PackEntry*)&pack.data[sizeof(PackHeader)];
+	names = (const char*)&entries[header->count];
+	entryCount = header->count;
+	return true;
+}
+
+bool packFind(const char* path, PackFile* file) {
+	if (entryCount == 0) return false;
+	std::string normalized = normalizePath(path);
+	PackEntry key;
+	key.hash = hashBytes(normalized.c_str(), normalized.size());
+	const PackEntry* entry = std::lower_bound(entries, entries + entryCount, key, byHash);
+	if (entry == entries + entryCount || entry->hash != key.hash) return false;
+	const PackHeader* header = (const PackHeader*)pack.data;
+	if (entry->name + (uint64_t)entry->nameLength > header->namesSize || entry->offset + entry->storedSize > pack.size) return false;
+	if (normalized.size() != entry->nameLength || memcmp(&names[entry->name], normalized.c_str(), entry->nameLength) != 0) return false;
+	file->data = &pack.data[entry->offset];
+	file->size = entry->size;
+	file->storedSize = entry->storedSize;
+	file->offset = entry->offset;
+	return true;
+}
+
+bool packRead(const PackFile& file, void* to) {
+	if (!packCompressed(file)) {
+		memcpy(to, file.data, file.size);
+		return true;
+	}
+	return decompressLz4(file.data, file.storedSize, (uint8_t*)to, file.size);
+}
+
+bool packWrite(const char* directory, const char* path, bool (*skip)(const char* path)) {
+	std::string packName = normalizePath(path);
+	std::string root = normalizePath(directory);
+	if (packName.compare(0, root.size() + 1, root + "/") == 0) packName.erase(0, root.size() + 1);
+
+	std::vector<std::string> listed;
+	listFiles(directory, "", listed);
+	std::vector<std::string> files;
+	for (size_t i = 0; i < listed.size(); ++i) {
+		if (listed[i] == packName || listed[i] == packName + ".tmp" || skip(listed[i].c_str())) continue;
+		files.push_back(listed[i]);
+	}
+
+	// The index and the paths come first, the file contents are streamed
+	// after them and the index is written last.
+	std::vector<PackEntry> index(files.size());
+	std::string namesData;
+	for (size_t i = 0; i < files.size(); ++i) {
+		index[i].hash = hashBytes(files[i].c_str(), files[i].size());
+		index[i].name = (uint32_t)namesData.size();
+		index[i].nameLength = (uint32_t)files[i].size();
+		namesData += files[i];
+	}
+
+	PackHeader header;
+	header.magic = packMagic;
+	header.version = packVersion;
+	header.count = (uint32_t)files.size();
+	header.namesSize = (uint32_t)namesData.size();
+
+	std::string temp = std::string(path) + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (file == nullptr) return false;
+	uint64_t offset = sizeof(PackHeader) + index.size() * sizeof(PackEntry);
+	bool written = fseek(file, (long)offset, SEEK_SET) == 0 && fwrite(namesData.data(), 1, namesData.size(), file) == namesData.size();
+	offset += namesData.size();
+
+	std::vector<uint8_t> contents;
+	std::vector<uint8_t> compressed;
+	uint64_t totalSize = 0, totalStored = 0;
+	for (size_t i = 0; i < files.size() && written; ++i) {
+		if (!readWholeFile(std::string(directory) + "/" + files[i], contents) || contents.size() > 0xffffffffu) {
+			Kore::log(Kore::Error, "Could not pack %s.", files[i].c_str());
+			written = false;
+			break;
+		}
+		uint32_t size = (uint32_t)contents.size();
+		// Only compressed entries that save at least an eighth are worth decoding
+		compressed.resize(size);
+		uint32_t compressedSize = size > 64 ? compressLz4(contents.data(), size, compressed.data(), size - size / 8) : 0;
+		const uint8_t* stored = compressedSize > 0 ? compressed.data() : contents.data();
+		uint32_t storedSize = compressedSize > 0 ? compressedSize : size;
+
+		written = writePadding(file, offset) && fwrite(stored, 1, storedSize, file) == storedSize;
+		index[i].offset = offset;
+		index[i].size = size;
+		index[i].storedSize = storedSize;
+		offset += storedSize;
+		totalSize += size;
+		totalStored += storedSize;
+	}
+
+	std::sort(index.begin(), index.end(), byHash);
+	for (size_t i = 1; i < index.size() && written; ++i) {
+		if (index[i].hash == index[i - 1].hash) {
+			Kore::log(Kore::Error, "Path hash collision in asset pack.");
+			written = false;
+		}
+	}
+
+	written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1
+		&& (index.empty() || fwrite(index.data(), sizeof(PackEntry), index.size(), file) == index.size());
+	written = fclose(file) == 0 && written;
+#ifdef KORE_WINDOWS
+	// rename does not replace existing files on Windows
+	if (written) remove(path);
+#endif
+	if (!written || rename(temp.c_str(), path) != 0) {
+		remove(temp.c_str());
+		return false;
+	}
+	Kore::log(Kore::Info, "Packed %u files, %llu of %llu bytes.", header.count, (unsigned long long)totalStored, (unsigned long long)totalSize);
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Asset packs bundle a directory into one file: a header, an index sorted by
+// path hash, the paths and the file contents, each aligned to 16 bytes.
+// Entries are stored as is or LZ4 compressed when that pays off.
+// The pack is mapped once and stays mapped for the lifetime of the process.
+
+struct PackFile {
+	const uint8_t* data;
+	uint32_t size;
+	uint32_t storedSize;
+	uint64_t offset; // in the pack file
+};
+
+inline bool packCompressed(const PackFile& file) {
+	return file.storedSize != file.size;
+}
+
+bool packOpen(const char* path);
+
+// Paths are relative to the packed directory, with forward slashes.
+bool packFind(const char* path, PackFile* file);
+
+// Writes the uncompressed contents of a file to to, which holds file.size bytes.
+bool packRead(const PackFile& file, void* to);
+
+// Packs all files below directory, except the pack itself and files for
+// which skip returns true.
+bool packWrite(const char* directory, const char* path, bool (*skip)(const char* path));
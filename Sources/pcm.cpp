@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "pcm.h"
+#include "simd.h"
+
+namespace {
+	const float scale = 1.0f / 32767.0f;
+}
+
+void convertPcm(const int16_t* left, const int16_t* right, float* to, int count) {
+	int i = 0;
+#if defined(KROM_SSE2)
+	const __m128 factor = _mm_set1_ps(scale);
+	for (; i + 8 <= count; i += 8) {
+		__m128i l = _mm_loadu_si128((const __m128i*)&left[i]);
+		__m128i r = _mm_loadu_si128((const __m128i*)&right[i]);
+		// Interleave first, then sign extend by shifting the samples into the high halves
+		__m128i lr0 = _mm_unpacklo_epi16(l, r);
+		__m128i lr1 = _mm_unpackhi_epi16(l, r);
+		__m128 f0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lr0, lr0), 16));
+		__m128 f1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lr0, lr0), 16));
+		__m128 f2 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lr1, lr1), 16));
+		__m128 f3 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lr1, lr1), 16));
+		_mm_storeu_ps(&to[i * 2 + 0], _mm_mul_ps(f0, factor));
+		_mm_storeu_ps(&to[i * 2 + 4], _mm_mul_ps(f1, factor));
+		_mm_storeu_ps(&to[i * 2 + 8], _mm_mul_ps(f2, factor));
+		_mm_storeu_ps(&to[i * 2 + 12], _mm_mul_ps(f3, factor));
+	}
+#elif defined(KROM_NEON)
+	const float32x4_t factor = vdupq_n_f32(scale);
+	for (; i + 8 <= count; i += 8) {
+		int16x8x2_t lr;
+		lr.val[0] = vld1q_s16(&left[i]);
+		lr.val[1] = vld1q_s16(&right[i]);
+		int16x8x2_t zipped = vzipq_s16(lr.val[0], lr.val[1]);
+		vst1q_f32(&to[i * 2 + 0], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(zipped.val[0]))), factor));
+		vst1q_f32(&to[i * 2 + 4], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(zipped.val[0]))), factor));
+		vst1q_f32(&to[i * 2 + 8], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(zipped.val[1]))), factor));
+		vst1q_f32(&to[i * 2 + 12], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(zipped.val[1]))), factor));
+	}
+#endif
+	for (; i < count; ++i) {
+		to[i * 2 + 0] = left[i] * scale;
+		to[i * 2 + 1] = right[i] * scale;
+	}
+}
+
+void interleavePcm16(const int16_t* left, const int16_t* right, int16_t* to, int count) {
+	int i = 0;
+#if defined(KROM_SSE2)
+	for (; i + 8 <= count; i += 8) {
+		__m128i l = _mm_loadu_si128((const __m128i*)&left[i]);
+		__m128i r = _mm_loadu_si128((const __m128i*)&right[i]);
+		_mm_storeu_si128((__m128i*)&to[i * 2 + 0], _mm_unpacklo_epi16(l, r));
+		_mm_storeu_si128((__m128i*)&to[i * 2 + 8], _mm_unpackhi_epi16(l, r));
+	}
+#elif defined(KROM_NEON)
+	for (; i + 8 <= count; i += 8) {
+		int16x8x2_t lr;
+		lr.val[0] = vld1q_s16(&left[i]);
+		lr.val[1] = vld1q_s16(&right[i]);
+		vst2q_s16(&to[i * 2], lr);
+	}
+#endif
+	for (; i < count; ++i) {
+		to[i * 2 + 0] = left[i];
+		to[i * 2 + 1] = right[i];
+	}
+}
+
+void convertPcm16(const int16_t* from, float* to, int count) {
+	int i = 0;
+#if defined(KROM_SSE2)
+	const __m128 factor = _mm_set1_ps(scale);
+	for (; i + 8 <= count; i += 8) {
+		__m128i samples = _mm_loadu_si128((const __m128i*)&from[i]);
+		__m128 f0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+		__m128 f1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+		_mm_storeu_ps(&to[i + 0], _mm_mul_ps(f0, factor));
+		_mm_storeu_ps(&to[i + 4], _mm_mul_ps(f1, factor));
+	}
+#elif defined(KROM_NEON)
+	const float32x4_t factor = vdupq_n_f32(scale);
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t samples = vld1q_s16(&from[i]);
+		vst1q_f32(&to[i + 0], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), factor));
+		vst1q_f32(&to[i + 4], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), factor));
+	}
+#endif
+	for (; i < count; ++i) {
+		to[i] = from[i] * scale;
+	}
+}
+
+void mixStereo(float* accumulator, const float* from, float leftGain, float rightGain, int frames) {
+	int i = 0;
+#if defined(KROM_SSE2)
+	const __m128 gains = _mm_setr_ps(leftGain, rightGain, leftGain, rightGain);
+	for (; i + 2 <= frames; i += 2) {
+		__m128 sum = _mm_add_ps(_mm_loadu_ps(&accumulator[i * 2]), _mm_mul_ps(_mm_loadu_ps(&from[i * 2]), gains));
+		_mm_storeu_ps(&accumulator[i * 2], sum);
+	}
+#elif defined(KROM_NEON)
+	const float gainValues[4] = {leftGain, rightGain, leftGain, rightGain};
+	const float32x4_t gains = vld1q_f32(gainValues);
+	for (; i + 2 <= frames; i += 2) {
+		vst1q_f32(&accumulator[i * 2], vmlaq_f32(vld1q_f32(&accumulator[i * 2]), vld1q_f32(&from[i * 2]), gains));
+	}
+#endif
+	for (; i < frames; ++i) {
+		accumulator[i * 2 + 0] += from[i * 2 + 0] * leftGain;
+		accumulator[i * 2 + 1] += from[i * 2 + 1] * rightGain;
+	}
+}
+
+void clipSamples(const float* from, float* to, int count) {
+	int i = 0;
+#if defined(KROM_SSE2)
+	const __m128 low = _mm_set1_ps(-1.0f);
+	const __m128 high = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(&to[i], _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&from[i]), low), high));
+	}
+#elif defined(KROM_NEON)
+	const float32x4_t low = vdupq_n_f32(-1.0f);
+	const float32x4_t high = vdupq_n_f32(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		vst1q_f32(&to[i], vminq_f32(vmaxq_f32(vld1q_f32(&from[i]), low), high));
+	}
+#endif
+	for (; i < count; ++i) {
+		float value = from[i];
+		to[i] = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+	}
+}
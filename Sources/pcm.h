@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// Converts two 16 bit channels to interleaved float samples in [-1, 1],
+// left channel first. Uses SSE2 or NEON where available.
+void convertPcm(const int16_t* left, const int16_t* right, float* to, int count);
+
+// Interleaves two 16 bit channels without converting them.
+void interleavePcm16(const int16_t* left, const int16_t* right, int16_t* to, int count);
+
+// Converts count 16 bit samples to floats in [-1, 1].
+void convertPcm16(const int16_t* from, float* to, int count);
+
+// Adds interleaved stereo frames to an accumulation buffer with separate
+// left and right gains.
+void mixStereo(float* accumulator, const float* from, float leftGain, float rightGain, int frames);
+
+// Copies count samples, clipped to [-1, 1].
+void clipSamples(const float* from, float* to, int count);
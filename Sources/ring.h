@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+
+// Bounded queue between exactly one producer and one consumer thread. It
+// never locks or allocates, so the audio thread can use it. Holds up to
+// size - 1 items.
+template<typename T, int size> class Ring {
+public:
+	Ring() : head(0), tail(0) {}
+
+	bool push(const T& item) {
+		int h = head.load(std::memory_order_relaxed);
+		int next = (h + 1) % size;
+		if (next == tail.load(std::memory_order_acquire)) return false;
+		items[h] = item;
+		head.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T* item) {
+		int t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) return false;
+		*item = items[t];
+		tail.store((t + 1) % size, std::memory_order_release);
+		return true;
+	}
+
+	// Free slots, exact on the producer thread.
+	int space() const {
+		int used = (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) + size) % size;
+		return size - 1 - used;
+	}
+
+private:
+	T items[size];
+	std::atomic<int> head;
+	std::atomic<int> tail;
+};
@@ -0,0 +1,189 @@
+#include "pch.h"
+#include "savewriter.h"
+#include "semaphore.h"
+
+#include <Kore/Threads/Mutex.h>
+#include <Kore/Threads/Thread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+#ifdef KORE_WINDOWS
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	struct Write {
+		std::string path;
+		void* data;
+		size_t size;
+		std::vector<int> ids;
+	};
+
+	Kore::Mutex mutex;
+	Semaphore* semaphore = nullptr;
+	std::deque<Write*> queued;
+	std::map<std::string, Write*> queuedPaths;
+	Write* writing = nullptr;
+	std::vector<SaveResult> finished;
+	int nextId = 1;
+
+#ifdef KORE_WINDOWS
+	bool writeDurably(const Write& write) {
+		std::string temp = write.path + ".tmp";
+		HANDLE file = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		bool written = true;
+		const char* data = (const char*)write.data;
+		size_t left = write.size;
+		while (left > 0 && written) {
+			DWORD chunk = left > 0x40000000 ? 0x40000000 : (DWORD)left;
+			DWORD count;
+			written = WriteFile(file, data, chunk, &count, nullptr) && count == chunk;
+			data += chunk;
+			left -= chunk;
+		}
+		written = written && FlushFileBuffers(file);
+		CloseHandle(file);
+		if (!written || !MoveFileExA(temp.c_str(), write.path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+			DeleteFileA(temp.c_str());
+			return false;
+		}
+		return true;
+	}
+#else
+	bool writeDurably(const Write& write) {
+		std::string temp = write.path + ".tmp";
+		int file = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (file < 0) return false;
+		bool written = true;
+		const char* data = (const char*)write.data;
+		size_t left = write.size;
+		while (left > 0 && written) {
+			ssize_t count = ::write(file, data, left);
+			written = count > 0;
+			if (written) {
+				data += count;
+				left -= count;
+			}
+		}
+		written = fsync(file) == 0 && written;
+		written = close(file) == 0 && written;
+		if (!written || rename(temp.c_str(), write.path.c_str()) != 0) {
+			unlink(temp.c_str());
+			return false;
+		}
+		// The rename itself is only durable once the directory is synced
+		size_t slash = write.path.find_last_of('/');
+		std::string directory = slash == std::string::npos ? "." : write.path.substr(0, slash > 0 ? slash : 1);
+		int dir = open(directory.c_str(), O_RDONLY);
+		if (dir >= 0) {
+			fsync(dir);
+			close(dir);
+		}
+		return true;
+	}
+#endif
+
+	void runWriter(void*) {
+		for (;;) {
+			semaphore->wait();
+			mutex.lock();
+			Write* write = queued.front();
+			queued.pop_front();
+			queuedPaths.erase(write->path);
+			writing = write;
+			mutex.unlock();
+
+			bool success = writeDurably(*write);
+
+			mutex.lock();
+			writing = nullptr;
+			for (size_t i = 0; i < write->ids.size(); ++i) {
+				SaveResult result;
+				result.id = write->ids[i];
+				result.success = success;
+				finished.push_back(result);
+			}
+			mutex.unlock();
+			free(write->data);
+			delete write;
+		}
+	}
+}
+
+int saveWrite(const char* path, void* data, size_t size) {
+	if (semaphore == nullptr) {
+		mutex.create();
+		semaphore = new Semaphore(0);
+		Kore::createAndRunThread(runWriter, nullptr);
+	}
+	mutex.lock();
+	int id = nextId++;
+	std::map<std::string, Write*>::iterator it = queuedPaths.find(path);
+	if (it != queuedPaths.end()) {
+		Write* write = it->second;
+		free(write->data);
+		write->data = data;
+		write->size = size;
+		write->ids.push_back(id);
+		mutex.unlock();
+		return id;
+	}
+	Write* write = new Write;
+	write->path = path;
+	write->data = data;
+	write->size = size;
+	write->ids.push_back(id);
+	queued.push_back(write);
+	queuedPaths[write->path] = write;
+	mutex.unlock();
+	semaphore->signal();
+	return id;
+}
+
+bool saveReadPending(const char* path, std::vector<unsigned char>& contents) {
+	if (semaphore == nullptr) return false;
+	mutex.lock();
+	Write* write = nullptr;
+	std::map<std::string, Write*>::iterator it = queuedPaths.find(path);
+	if (it != queuedPaths.end()) write = it->second;
+	else if (writing != nullptr && writing->path == path) write = writing;
+	if (write != nullptr) {
+		const unsigned char* data = (const unsigned char*)write->data;
+		contents.assign(data, data + write->size);
+	}
+	mutex.unlock();
+	return write != nullptr;
+}
+
+int saveTakeFinished(SaveResult* results, int max) {
+	if (semaphore == nullptr) return 0;
+	mutex.lock();
+	int count = (int)finished.size() < max ? (int)finished.size() : max;
+	for (int i = 0; i < count; ++i) {
+		results[i] = finished[i];
+	}
+	finished.erase(finished.begin(), finished.begin() + count);
+	mutex.unlock();
+	return count;
+}
+
+void saveFlush() {
+	if (semaphore == nullptr) return;
+	for (;;) {
+		mutex.lock();
+		bool done = queued.empty() && writing == nullptr;
+		mutex.unlock();
+		if (done) return;
+		Kore::threadSleep(1);
+	}
+}
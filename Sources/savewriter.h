@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+// Writes files on a background thread. Every write goes to a temp file that
+// is flushed to disk and then renamed over the target, so a crash leaves
+// either the old or the new contents. A queued write is replaced by a newer
+// write to the same path.
+
+struct SaveResult {
+	int id;
+	bool success;
+};
+
+// Takes ownership of data, which has to be allocated with malloc. Returns an
+// id that is reported by saveTakeFinished once the write is done.
+int saveWrite(const char* path, void* data, size_t size);
+
+// Latest contents queued for path that are not on disk yet.
+bool saveReadPending(const char* path, std::vector<unsigned char>& contents);
+
+// Collects up to max finished writes. Writes that were replaced report the
+// result of the write that replaced them.
+int saveTakeFinished(SaveResult* results, int max);
+
+// Blocks until all queued writes are done.
+void saveFlush();
@@ -7,7 +7,5 @@ public:
 	void wait();
 	void signal();
 private:
-#ifdef KORE_WINDOWS
 	void* semaphore;
-#endif
 };
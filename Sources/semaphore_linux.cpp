@@ -4,21 +4,49 @@
 
 #ifdef KORE_LINUX
 
-Semaphore::Semaphore(int count) {
+#include <pthread.h>
+
+// <semaphore.h> would resolve to this project's header, so this is built on
+// a mutex and a condition variable.
+namespace {
+	struct PosixSemaphore {
+		pthread_mutex_t mutex;
+		pthread_cond_t condition;
+		int count;
+	};
+}
 
+Semaphore::Semaphore(int count) {
+	PosixSemaphore* sem = new PosixSemaphore;
+	pthread_mutex_init(&sem->mutex, nullptr);
+	pthread_cond_init(&sem->condition, nullptr);
+	sem->count = count;
+	semaphore = sem;
 }
 
 Semaphore::~Semaphore() {
-
+	PosixSemaphore* sem = (PosixSemaphore*)semaphore;
+	pthread_cond_destroy(&sem->condition);
+	pthread_mutex_destroy(&sem->mutex);
+	delete sem;
 }
 
 void Semaphore::wait() {
-
+	PosixSemaphore* sem = (PosixSemaphore*)semaphore;
+	pthread_mutex_lock(&sem->mutex);
+	while (sem->count == 0) {
+		pthread_cond_wait(&sem->condition, &sem->mutex);
+	}
+	--sem->count;
+	pthread_mutex_unlock(&sem->mutex);
 }
 
 void Semaphore::signal() {
-
+	PosixSemaphore* sem = (PosixSemaphore*)semaphore;
+	pthread_mutex_lock(&sem->mutex);
+	++sem->count;
+	pthread_cond_signal(&sem->condition);
+	pthread_mutex_unlock(&sem->mutex);
 }
 
 #endif
-
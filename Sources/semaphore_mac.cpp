@@ -4,20 +4,22 @@
 
 #ifdef KORE_MACOS
 
-Semaphore::Semaphore(int count) {
+#include <dispatch/dispatch.h>
 
+Semaphore::Semaphore(int count) {
+	semaphore = dispatch_semaphore_create(count);
 }
 
 Semaphore::~Semaphore() {
-
+	dispatch_release((dispatch_semaphore_t)semaphore);
 }
 
 void Semaphore::wait() {
-
+	dispatch_semaphore_wait((dispatch_semaphore_t)semaphore, DISPATCH_TIME_FOREVER);
 }
 
 void Semaphore::signal() {
-
+	dispatch_semaphore_signal((dispatch_semaphore_t)semaphore);
 }
 
 #endif
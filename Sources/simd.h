@@ -0,0 +1,10 @@
+#pragma once
+
+// Selects the vector instruction set the audio kernels are built with.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KROM_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KROM_NEON
+#include <arm_neon.h>
+#endif